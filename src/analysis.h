@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Collects statistics about a GCODE file that is passed in arbitrary chunks to
+// feed(). The analysis sees the commands the way handle() sends them, i.e.
+// without comments and with whitespace compressed, so the line lengths it
+// reports are the ones that count for MarlinBuf.
+class GCodeAnalysis
+{
+    // Commands longer than this are counted, but only this much is parsed.
+    static const int LINE_MAX = 256;
+
+    // Maximum number of distinct unknown commands that are listed.
+    static const int UNKNOWN_MAX = 10;
+
+    // The command being assembled by feed().
+    char line[LINE_MAX + 1];
+    int linelen; // may exceed LINE_MAX
+    bool in_comment;
+    bool space_pending; // whitespace seen after the last character in line[]
+
+    // The comment being assembled by feed() (only the beginning, for ";TIME:")
+    char comment[32];
+    int comlen;
+
+    // Printer state after the last command.
+    double pos[4]; // X, Y, Z, E
+    double feedrate;
+    bool relative;
+    bool relative_e;
+    double layer_z; // Z of the last extruding move
+
+    GCodeAnalysis(const GCodeAnalysis&);
+    GCodeAnalysis& operator=(const GCodeAnalysis&);
+
+    static bool known(char letter, int code)
+    {
+        static const int gcodes[] = {0,  1,  2,  3,  4,  5,  10, 11, 12, 17, 18, 19, 20,
+                                     21, 26, 27, 28, 29, 30, 60, 61, 80, 90, 91, 92, -1};
+        static const int mcodes[] = {0,   1,   17,  18,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,
+                                     32,  73,  75,  76,  77,  78,  80,  81,  82,  83,  84,  85,  92,  104, 105,
+                                     106, 107, 108, 109, 110, 111, 112, 113, 114, 115, 117, 118, 119, 120, 121,
+                                     140, 141, 145, 149, 150, 155, 163, 164, 190, 191, 200, 201, 203, 204, 205,
+                                     206, 207, 208, 209, 211, 217, 218, 220, 221, 226, 240, 250, 280, 290, 300,
+                                     301, 302, 303, 304, 355, 400, 401, 402, 403, 404, 405, 406, 407, 410, 412,
+                                     413, 420, 421, 422, 423, 425, 428, 486, 500, 501, 502, 503, 504, 524, 540,
+                                     569, 575, 600, 603, 665, 666, 672, 701, 702, 710, 851, 852, 900, 906, 907,
+                                     908, 911, 912, 913, 914, 915, 916, 917, 928, 951, 993, 994, 995, 997, 999,
+                                     -1};
+        const int* list;
+        if (letter == 'G')
+            list = gcodes;
+        else if (letter == 'M')
+            list = mcodes;
+        else
+            return letter == 'T' && code >= 0 && code < 10;
+        for (; *list >= 0; list++)
+            if (*list == code)
+                return true;
+        return false;
+    }
+
+    // cmd must be writable. It is sanitized for use in JSON.
+    void unknown(char* cmd)
+    {
+        unknownCount++;
+        for (char* p = cmd; *p != 0; p++)
+            if (!isalnum(*p) && *p != '.')
+                *p = '_';
+        int i;
+        for (i = 0; i < UNKNOWN_MAX && unknownCommands[i] != 0; i++)
+            if (strcmp(unknownCommands[i], cmd) == 0)
+                return;
+        if (i < UNKNOWN_MAX)
+            unknownCommands[i] = strdup(cmd);
+    }
+
+    void append(char ch)
+    {
+        if (linelen < LINE_MAX)
+            line[linelen] = ch;
+        linelen++;
+    }
+
+    // Processes the comment collected in comment[].
+    void endComment()
+    {
+        comment[comlen] = 0;
+        if (strncmp("TIME:", comment, 5) == 0)
+        {
+            long l = strtol(comment + 5, 0, 10);
+            if (l > 0 && l < 8640000)
+                slicerTime = l;
+        }
+        comlen = 0;
+    }
+
+    // Processes the command collected in line[].
+    void endLine()
+    {
+        if (linelen == 0)
+            return;
+
+        commands++;
+        if (linelen > maxLineLength)
+            maxLineLength = linelen;
+        if (linelen > maxCommandLen)
+            longLines++;
+
+        line[linelen <= LINE_MAX ? linelen : LINE_MAX] = 0;
+
+        char letter = toupper(line[0]);
+        char* p;
+        int code = strtol(line + 1, &p, 10);
+        if (p == line + 1 || (*p != 0 && *p != ' ' && *p != '.' && !isalpha(*p)))
+        {
+            // not a command word, e.g. a string argument that got its own line
+            char cmd[16];
+            snprintf(cmd, sizeof(cmd), "%.15s", line);
+            char* space = strchr(cmd, ' ');
+            if (space != 0)
+                *space = 0;
+            unknown(cmd);
+            return;
+        }
+        if (*p == '.') // subcode
+            strtol(p + 1, &p, 10);
+
+        if (!known(letter, code))
+        {
+            char cmd[16];
+            snprintf(cmd, sizeof(cmd), "%c%d", letter, code);
+            unknown(cmd);
+            return;
+        }
+
+        if (letter == 'M')
+        {
+            if (code == 82)
+                relative_e = false;
+            else if (code == 83)
+                relative_e = true;
+            return;
+        }
+        if (letter != 'G')
+            return;
+
+        // Parameters. Commands with string parameters (M117 etc.) have been handled above.
+        double param[26];
+        int have = 0;
+        while (*p != 0)
+        {
+            while (*p == ' ')
+                p++;
+            char l = toupper(*p);
+            if (l < 'A' || l > 'Z')
+                break;
+            char* end;
+            double val = strtod(++p, &end);
+            if (end != p)
+            {
+                param[l - 'A'] = val;
+                have |= 1 << (l - 'A');
+            }
+            p = end;
+            while (*p != 0 && *p != ' ' && !isalpha(*p))
+                p++;
+        }
+#define HAVE(l) (have & (1 << ((l) - 'A')))
+
+        static const char axis[4] = {'X', 'Y', 'Z', 'E'};
+        switch (code)
+        {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            {
+                if (HAVE('F') && param['F' - 'A'] > 0)
+                    feedrate = param['F' - 'A'];
+                double old[4];
+                memcpy(old, pos, sizeof(old));
+                for (int i = 0; i < 4; i++)
+                    if (HAVE(axis[i]))
+                        pos[i] = ((i == 3) ? relative_e : relative) ? pos[i] + param[axis[i] - 'A']
+                                                                    : param[axis[i] - 'A'];
+                double dx = pos[0] - old[0];
+                double dy = pos[1] - old[1];
+                double dz = pos[2] - old[2];
+                double de = pos[3] - old[3];
+                double dist = sqrt(dx * dx + dy * dy + dz * dz);
+                if (dist == 0)
+                    dist = fabs(de);
+                if (feedrate > 0)
+                    estimatedTime += dist * 60 / feedrate;
+                filament += de;
+                if (de > 0 && (dx != 0 || dy != 0))
+                {
+                    if (extrusions++ == 0)
+                    {
+                        minX = maxX = old[0];
+                        minY = maxY = old[1];
+                        minZ = maxZ = pos[2];
+                    }
+                    for (int i = 0; i < 2; i++)
+                    {
+                        double* a = (i == 0) ? old : pos;
+                        minX = fmin(minX, a[0]);
+                        maxX = fmax(maxX, a[0]);
+                        minY = fmin(minY, a[1]);
+                        maxY = fmax(maxY, a[1]);
+                    }
+                    minZ = fmin(minZ, pos[2]);
+                    maxZ = fmax(maxZ, pos[2]);
+                    if (layers == 0 || pos[2] > layer_z + 0.001)
+                        layers++;
+                    layer_z = pos[2];
+                }
+                break;
+            }
+            case 4:
+                if (HAVE('P'))
+                    estimatedTime += param['P' - 'A'] / 1000;
+                if (HAVE('S'))
+                    estimatedTime += param['S' - 'A'];
+                break;
+            case 28:
+                for (int i = 0; i < 3; i++)
+                    if ((have & ((1 << ('X' - 'A')) | (1 << ('Y' - 'A')) | (1 << ('Z' - 'A')))) == 0 || HAVE(axis[i]))
+                        pos[i] = 0;
+                break;
+            case 90:
+                relative = relative_e = false;
+                break;
+            case 91:
+                relative = relative_e = true;
+                break;
+            case 92:
+                for (int i = 0; i < 4; i++)
+                    if (have == 0 || HAVE(axis[i]))
+                        pos[i] = HAVE(axis[i]) ? param[axis[i] - 'A'] : 0;
+                break;
+        }
+#undef HAVE
+    }
+
+  public:
+    // Physical lines and commands (i.e. lines that are not empty after
+    // stripping comments and whitespace).
+    int64_t lines;
+    int64_t commands;
+
+    // Length of the longest command and number of commands longer than
+    // maxCommandLen.
+    int maxLineLength;
+    int64_t longLines;
+    int maxCommandLen;
+
+    // Number of moves that extrude and the bounding box of these moves.
+    int64_t extrusions;
+    double minX, maxX, minY, maxY, minZ, maxZ;
+
+    // Number of times extrusion has moved up to a higher Z.
+    int layers;
+
+    // Net length of filament fed in mm.
+    double filament;
+
+    // Print time in seconds computed from moves and dwells, ignoring acceleration.
+    double estimatedTime;
+
+    // Print time in seconds from a slicer comment (";TIME:"); 0 if there is none.
+    int slicerTime;
+
+    // Number of commands unknown to Marlin and the first few distinct ones
+    // (malloc()ed, 0-terminated list).
+    int64_t unknownCount;
+    char* unknownCommands[UNKNOWN_MAX + 1];
+
+    // max_command_len is the limit for longLines, usually MarlinBuf::maxCommandLen().
+    GCodeAnalysis(int max_command_len)
+        : linelen(0), in_comment(false), space_pending(false), comlen(0), feedrate(0), relative(false),
+          relative_e(false), layer_z(0), lines(0), commands(0), maxLineLength(0), longLines(0),
+          maxCommandLen(max_command_len), extrusions(0), minX(0), maxX(0), minY(0), maxY(0), minZ(0), maxZ(0),
+          layers(0), filament(0), estimatedTime(0), slicerTime(0), unknownCount(0)
+    {
+        memset(pos, 0, sizeof(pos));
+        memset(unknownCommands, 0, sizeof(unknownCommands));
+    }
+
+    ~GCodeAnalysis()
+    {
+        for (int i = 0; unknownCommands[i] != 0; i++)
+            free(unknownCommands[i]);
+    }
+
+    // Analyzes the next len bytes of the file. Lines may be split across calls.
+    void feed(const char* data, int64_t len)
+    {
+        for (const char* end = data + len; data < end; data++)
+        {
+            char ch = *data;
+            if (ch == '\n')
+            {
+                lines++;
+                if (in_comment)
+                    endComment();
+                in_comment = false;
+                endLine();
+                linelen = 0;
+                space_pending = false;
+            }
+            else if (in_comment)
+            {
+                if (comlen < (int)sizeof(comment) - 1)
+                    comment[comlen++] = ch;
+            }
+            else if (ch == ';')
+                in_comment = true;
+            else if (isspace(ch))
+                space_pending = (linelen > 0);
+            else
+            {
+                if (space_pending)
+                    append(' ');
+                space_pending = false;
+                append(ch);
+            }
+        }
+    }
+
+    // Processes a last line that is not terminated by '\n'.
+    void finish()
+    {
+        if (linelen > 0 || in_comment)
+            feed("\n", 1);
+    }
+
+    // Returns the analysis as a JSON object in the format of Octoprint's
+    // "gcodeAnalysis" with marlinfeed's additional information under "marlinfeed".
+    // The caller must free() the result.
+    char* toJSON()
+    {
+        char* unknown_list = strdup("");
+        for (int i = 0; unknownCommands[i] != 0; i++)
+        {
+            char* more;
+            if (0 < asprintf(&more, "%s%s\"%s\"", unknown_list, (i == 0) ? "" : ", ", unknownCommands[i]))
+            {
+                free(unknown_list);
+                unknown_list = more;
+            }
+        }
+        char* json;
+        if (0 > asprintf(&json,
+                         "{\r\n"
+                         "    \"estimatedPrintTime\": %.0f,\r\n"
+                         "    \"dimensions\": {\"width\": %.2f, \"depth\": %.2f, \"height\": %.2f},\r\n"
+                         "    \"printingArea\": {\"minX\": %.2f, \"maxX\": %.2f, \"minY\": %.2f, \"maxY\": %.2f, "
+                         "\"minZ\": %.2f, \"maxZ\": %.2f},\r\n"
+                         "    \"filament\": {\"tool0\": {\"length\": %.1f}},\r\n"
+                         "    \"marlinfeed\": {\"lines\": %lld, \"commands\": %lld, \"layers\": %d, "
+                         "\"maxLineLength\": %d, \"longLines\": %lld, \"unknownCommands\": %lld, "
+                         "\"firstUnknownCommands\": [%s]}\r\n"
+                         "  }",
+                         (slicerTime > 0) ? (double)slicerTime : estimatedTime, maxX - minX, maxY - minY, maxZ - minZ,
+                         minX, maxX, minY, maxY, minZ, maxZ, filament, (long long)lines, (long long)commands, layers,
+                         maxLineLength, (long long)longLines, (long long)unknownCount, unknown_list))
+            json = 0;
+        free(unknown_list);
+        return json;
+    }
+};
+
+#endif
@@ -36,6 +36,19 @@ struct Arg : public option::Arg
         return option::ARG_ILLEGAL;
     }
 
+    static option::ArgStatus Compression(const option::Option& option, bool msg)
+    {
+        if (option.arg != 0)
+        {
+            if (strcmp(option.arg, "gzip") == 0 || strcmp(option.arg, "zstd") == 0)
+                return option::ARG_OK;
+        }
+
+        if (msg)
+            printError("Option '", option, "' needs one of the following arguments: 'gzip', 'zstd'\n");
+        return option::ARG_ILLEGAL;
+    }
+
     static option::ArgStatus Required(const option::Option& option, bool msg)
     {
         if (option.arg != 0)
@@ -91,6 +104,23 @@ struct Arg : public option::Arg
             printError("Option '", option, "' requires an argument of the form <number>,<number>\n");
         return option::ARG_ILLEGAL;
     }
+
+    static option::ArgStatus Baud(const option::Option& option, bool msg)
+    {
+        if (option.arg != 0)
+        {
+            if (strcmp(option.arg, "auto") == 0)
+                return option::ARG_OK;
+            char* endptr = 0;
+            long rate = strtol(option.arg, &endptr, 10);
+            if (endptr != option.arg && *endptr == 0 && rate > 0)
+                return option::ARG_OK;
+        };
+
+        if (msg)
+            printError("Option '", option, "' requires a baud rate or 'auto' as argument\n");
+        return option::ARG_ILLEGAL;
+    }
 };
 
 #endif
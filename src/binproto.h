@@ -0,0 +1,678 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "gcode.h"
+#include "millis.h"
+
+// Marlin's binary file transfer protocol (BINARY_FILE_TRANSFER), which writes a
+// file to the printer's SD card much faster than M28/M29 with one line of GCODE
+// per command. The printer is switched to it with "M28 B1". From then on the
+// host sends packets and the printer answers each one with an ASCII line
+// "ok<sync>" (accepted), "rs<sync>" (please resend packet <sync>) or "fe<sync>"
+// (fatal error). Packet format (all numbers little endian):
+//
+//   uint16 token 0xB5AD
+//   uint8  sync      counts packets, so that losses and duplicates are detected
+//   uint8  meta      protocol << 4 | packet type
+//   uint16 size      of the payload
+//   uint16 checksum  over sync, meta and size
+//   payload          only if size > 0, followed by
+//   uint16 checksum  over everything after the token
+//
+// The checksums are Fletcher-16, computed the way Marlin does it.
+class BinaryProtocol
+{
+  public:
+    static const uint16_t TOKEN = 0xB5AD;
+    static const int HEADER_SIZE = 8;
+    static const int FOOTER_SIZE = 2;
+
+    // The size of Marlin's packet buffer, which limits the payload.
+    static const int MAX_PAYLOAD = 512;
+
+    static const int MAX_PACKET = HEADER_SIZE + MAX_PAYLOAD + FOOTER_SIZE;
+
+    enum Protocol
+    {
+        CONTROL = 0,
+        FILE_TRANSFER = 1
+    };
+
+    // Packet types for protocol CONTROL.
+    enum Control
+    {
+        SYNC = 1, // printer replies "ss<sync>,<max payload>,<version>"
+        CLOSE = 2 // back to GCODE
+    };
+
+    // Packet types for protocol FILE_TRANSFER. The printer replies with a line
+    // starting with "PFT:" to all but WRITE (unless there's an error).
+    enum FileTransfer
+    {
+        QUERY = 0,      // "PFT:version:<version>:compression:<none or heatshrink,<window>,<lookahead>>"
+        OPEN = 1,       // payload: dummy flag, compression flag, 0-terminated file name
+        CLOSE_FILE = 2, // "PFT:success"
+        WRITE = 3,      // payload: file data
+        ABORT = 4       // closes and deletes the file
+    };
+
+    static uint16_t checksum(uint16_t cs, uint8_t value)
+    {
+        uint16_t cs_low = ((cs & 0xFF) + value) % 255;
+        return ((((cs >> 8) + cs_low) % 255) << 8) | cs_low;
+    }
+
+    static uint16_t checksum(uint16_t cs, const char* data, int len)
+    {
+        for (int i = 0; i < len; i++)
+            cs = checksum(cs, (uint8_t)data[i]);
+        return cs;
+    }
+
+    // Stores the packet with the len bytes of payload in out, which must have
+    // room for HEADER_SIZE + len + FOOTER_SIZE bytes. Returns the packet's length.
+    static int packet(uint8_t sync, int protocol, int type, const char* payload, int len, char* out)
+    {
+        out[0] = (char)(TOKEN & 0xFF);
+        out[1] = (char)(TOKEN >> 8);
+        out[2] = (char)sync;
+        out[3] = (char)((protocol << 4) | (type & 0xF));
+        out[4] = (char)(len & 0xFF);
+        out[5] = (char)(len >> 8);
+        uint16_t cs = checksum(0, out + 2, 4);
+        out[6] = (char)(cs & 0xFF);
+        out[7] = (char)(cs >> 8);
+        if (len == 0)
+            return HEADER_SIZE;
+        memcpy(out + HEADER_SIZE, payload, len);
+        cs = checksum(0, out + 2, HEADER_SIZE - 2 + len);
+        out[HEADER_SIZE + len] = (char)(cs & 0xFF);
+        out[HEADER_SIZE + len + 1] = (char)(cs >> 8);
+        return HEADER_SIZE + len + FOOTER_SIZE;
+    }
+
+    // The printer's side of the packet layer. Fed with the bytes from the host,
+    // it produces the replies and the payloads of the accepted packets.
+    class Receiver
+    {
+        char buf[MAX_PACKET];
+        int have;         // number of bytes of the current packet in buf
+        uint8_t expected; // sync of the next packet
+        char rep[64];
+        bool has_reply;
+        bool complete; // buf holds an accepted packet
+
+        static uint16_t get16(const char* p) { return (uint8_t)p[0] | ((uint8_t)p[1] << 8); }
+
+        void reply(const char* tag, int sync)
+        {
+            snprintf(rep, sizeof(rep), "%s%d\n", tag, sync);
+            has_reply = true;
+            have = 0;
+        }
+
+      public:
+        Receiver() : have(0), expected(0), has_reply(false), complete(false) {}
+
+        // Processes up to len bytes of data received from the host. Stops after a
+        // byte that completes a packet or requires a reply. Returns the number of
+        // bytes processed.
+        int receive(const char* data, int len)
+        {
+            if (complete)
+                have = 0;
+            has_reply = complete = false;
+
+            int i = 0;
+            while (i < len && !has_reply)
+            {
+                char ch = data[i++];
+                if (have == 0)
+                {
+                    if (ch == (char)(TOKEN & 0xFF))
+                        buf[have++] = ch;
+                    continue;
+                }
+                if (have == 1)
+                {
+                    if (ch == (char)(TOKEN >> 8))
+                        buf[have++] = ch;
+                    else if (ch != (char)(TOKEN & 0xFF))
+                        have = 0;
+                    continue;
+                }
+
+                buf[have++] = ch;
+                if (have == HEADER_SIZE)
+                {
+                    if (checksum(0, buf + 2, 4) != get16(buf + 6) || size() > MAX_PAYLOAD)
+                        reply("rs", expected);
+                    else if (protocol() == CONTROL && type() == SYNC) // does not need the right sync
+                    {
+                        snprintf(rep, sizeof(rep), "ss%d,%d,0.1.0\n", expected, MAX_PAYLOAD);
+                        has_reply = true;
+                        have = 0;
+                    }
+                }
+                if (have >= HEADER_SIZE && have == HEADER_SIZE + size() + (size() > 0 ? FOOTER_SIZE : 0))
+                {
+                    if (size() > 0 && checksum(0, buf + 2, have - 4) != get16(buf + have - 2))
+                        reply("rs", expected);
+                    else if ((uint8_t)buf[2] == (uint8_t)(expected - 1)) // our ok got lost
+                        reply("ok", (uint8_t)buf[2]);
+                    else if ((uint8_t)buf[2] != expected)
+                        reply("rs", expected);
+                    else
+                    {
+                        reply("ok", expected++);
+                        complete = true;
+                    }
+                }
+            }
+            return i;
+        }
+
+        // The line to send to the host after the last receive(); 0 if none.
+        const char* reply() { return has_reply ? rep : 0; }
+
+        // true if the last receive() has completed a packet that has to be processed.
+        bool hasPacket() { return complete; }
+
+        int protocol() { return ((uint8_t)buf[3]) >> 4; }
+        int type() { return buf[3] & 0xF; }
+        int size() { return get16(buf + 4); }
+        const char* payload() { return buf + HEADER_SIZE; }
+    };
+};
+
+// The heatshrink LZSS compression that Marlin built with BINARY_STREAM_COMPRESSION
+// can undo while receiving a file. The data is a stream of bits (most significant
+// first), in which a 1 is followed by an 8 bit literal byte and a 0 by a
+// reference to earlier data: WINDOW_BITS bits of (distance - 1) and
+// LOOKAHEAD_BITS bits of (length - 1). Marlin's decoder uses 8 and 4.
+class Heatshrink
+{
+  public:
+    static const int WINDOW_BITS = 8;
+    static const int LOOKAHEAD_BITS = 4;
+    static const int WINDOW = 1 << WINDOW_BITS;
+    static const int LOOKAHEAD = 1 << LOOKAHEAD_BITS;
+
+    class Encoder
+    {
+        // The last (up to) WINDOW bytes that have been encoded, followed by the
+        // bytes that have not been encoded, yet, because they might be the start of a
+        // match with data from the next encode().
+        char keep[WINDOW + LOOKAHEAD];
+        int keephist;
+        int keeppend;
+
+        // Bits that do not fill a byte, yet.
+        uint32_t acc;
+        int nacc;
+
+        void put(uint32_t bits, int count, char* out, int& n)
+        {
+            acc = (acc << count) | bits;
+            nacc += count;
+            while (nacc >= 8)
+            {
+                nacc -= 8;
+                out[n++] = (char)(acc >> nacc);
+            }
+            acc &= (1u << nacc) - 1;
+        }
+
+      public:
+        Encoder() : keephist(0), keeppend(0), acc(0), nacc(0) {}
+
+        // Size of the buffer that encode() needs for len bytes of input.
+        static int maxOutput(int len) { return ((len + LOOKAHEAD) * 9 + 7) / 8 + 1; }
+
+        // Compresses the len bytes at in and stores the result in out. If finish
+        // is true, this is the end of the data. Otherwise some input may be held
+        // back until the next call. Returns the number of bytes stored in out.
+        int encode(const char* in, int len, char* out, bool finish)
+        {
+            int total = keephist + keeppend + len;
+            char* work = (char*)malloc(total + 1);
+            memcpy(work, keep, keephist + keeppend);
+            if (len > 0)
+                memcpy(work + keephist + keeppend, in, len);
+
+            // Chains of earlier positions with the same first 2 bytes, most recent first.
+            int* head = (int*)malloc(65536 * sizeof(int));
+            int* prev = (int*)malloc((total + 1) * sizeof(int));
+            memset(head, -1, 65536 * sizeof(int));
+#define HEATSHRINK_KEY(q) (((uint8_t)work[q] << 8) | (uint8_t)work[(q) + 1])
+#define HEATSHRINK_INSERT(q)                                                                                        \
+    if ((q) + 1 < total)                                                                                            \
+    {                                                                                                               \
+        prev[q] = head[HEATSHRINK_KEY(q)];                                                                          \
+        head[HEATSHRINK_KEY(q)] = (q);                                                                              \
+    }
+
+            int p = keephist;
+            for (int q = 0; q < p; q++)
+                HEATSHRINK_INSERT(q);
+
+            int n = 0;
+            int end = finish ? total : total - LOOKAHEAD + 1;
+            while (p < end)
+            {
+                int maxlen = total - p;
+                if (maxlen > LOOKAHEAD)
+                    maxlen = LOOKAHEAD;
+                int best = 0;
+                int dist = 0;
+                if (maxlen >= 2)
+                    for (int q = head[HEATSHRINK_KEY(p)]; q >= 0 && p - q <= WINDOW; q = prev[q])
+                    {
+                        int l = 2;
+                        while (l < maxlen && work[q + l] == work[p + l])
+                            l++;
+                        if (l > best)
+                        {
+                            best = l;
+                            dist = p - q;
+                            if (l == maxlen)
+                                break;
+                        }
+                    }
+
+                if (best >= 2)
+                {
+                    put(0, 1, out, n);
+                    put(dist - 1, WINDOW_BITS, out, n);
+                    put(best - 1, LOOKAHEAD_BITS, out, n);
+                }
+                else
+                {
+                    best = 1;
+                    put(0x100 | (uint8_t)work[p], 9, out, n);
+                }
+                for (; best > 0; best--, p++)
+                    HEATSHRINK_INSERT(p);
+            }
+#undef HEATSHRINK_INSERT
+#undef HEATSHRINK_KEY
+
+            if (finish && nacc > 0)
+                put(0, 8 - nacc, out, n);
+
+            keephist = (p < WINDOW) ? p : WINDOW;
+            keeppend = total - p;
+            memcpy(keep, work + p - keephist, keephist + keeppend);
+
+            free(prev);
+            free(head);
+            free(work);
+            return n;
+        }
+    };
+
+    class Decoder
+    {
+        char window[WINDOW];
+        int pos; // where the next byte goes into window
+
+        // Bits that do not complete an item, yet.
+        uint32_t acc;
+        int nacc;
+
+      public:
+        Decoder() : pos(0), acc(0), nacc(0) { memset(window, 0, sizeof(window)); }
+
+        // Size of the buffer that decode() needs for len bytes of input.
+        static int maxOutput(int len) { return (len * 8 / (1 + WINDOW_BITS + LOOKAHEAD_BITS) + 1) * LOOKAHEAD; }
+
+        // Decompresses the len bytes at in and stores the result in out.
+        // Returns the number of bytes stored in out.
+        int decode(const char* in, int len, char* out)
+        {
+            int n = 0;
+            for (int i = 0; i < len; i++)
+            {
+                acc = (acc << 8) | (uint8_t)in[i];
+                nacc += 8;
+                for (;;)
+                {
+                    if (nacc >= 9 && (acc >> (nacc - 1)) & 1)
+                    {
+                        nacc -= 9;
+                        out[n++] = window[pos] = (char)(acc >> nacc);
+                        pos = (pos + 1) & (WINDOW - 1);
+                    }
+                    else if (nacc >= 1 + WINDOW_BITS + LOOKAHEAD_BITS && !((acc >> (nacc - 1)) & 1))
+                    {
+                        nacc -= 1 + WINDOW_BITS + LOOKAHEAD_BITS;
+                        int dist = ((acc >> (nacc + LOOKAHEAD_BITS)) & (WINDOW - 1)) + 1;
+                        int count = ((acc >> nacc) & (LOOKAHEAD - 1)) + 1;
+                        for (; count > 0; count--, pos = (pos + 1) & (WINDOW - 1))
+                            out[n++] = window[pos] = window[(pos - dist) & (WINDOW - 1)];
+                    }
+                    else
+                        break;
+                    acc &= (1u << nacc) - 1;
+                }
+            }
+            return n;
+        }
+    };
+};
+
+// The host's side of the binary file transfer. Each function sends its request
+// and waits until the printer has confirmed it. false means failure, and error()
+// tells why. The ASCII lines the printer sends in between (e.g. temperature
+// reports) are ignored.
+class BinaryTransfer
+{
+    // Milliseconds to wait for the printer's reply before sending a packet again.
+    static const int TIMEOUT = 1000;
+
+    // Number of times a packet is sent before giving up.
+    static const int MAX_TRIES = 5;
+
+    File& serial;
+    gcode::Reader& serial_in; // must read from serial
+
+    uint8_t sync;
+    int blocksize;
+    bool can_compress;
+    bool compressing;
+    Heatshrink::Encoder encoder;
+
+    // Compressed data not sent yet because it doesn't fill a block.
+    char* pending;
+    int pendlen;
+
+    const char* err;
+    int64_t wire;
+
+    BinaryTransfer(const BinaryTransfer&);
+    BinaryTransfer& operator=(const BinaryTransfer&);
+
+    bool fail(const char* msg)
+    {
+        err = msg;
+        return false;
+    }
+
+    // Returns the next line from the printer or 0 if none arrives until deadline.
+    gcode::Line* nextLine(int64_t deadline)
+    {
+        for (;;)
+        {
+            gcode::Line* line = serial_in.next();
+            if (line != 0)
+                return line;
+            if (serial.hasError() || serial.EndOfFile())
+                return 0;
+            int64_t wait = deadline - millis();
+            if (wait <= 0 || serial.poll(POLLIN, wait) <= 0)
+                return 0;
+        }
+    }
+
+    // Sends a packet and waits for the printer's ok.
+    bool send(int protocol, int type, const char* payload, int len)
+    {
+        char packet[BinaryProtocol::MAX_PACKET];
+        for (int tries = 0; tries < MAX_TRIES;)
+        {
+            int n = BinaryProtocol::packet(sync, protocol, type, payload, len, packet);
+            serial.setNonBlock(false);
+            if (!serial.writeAll(packet, n))
+                return fail(serial.error());
+            serial.setNonBlock(true);
+            wire += n;
+            tries++;
+
+            for (int64_t deadline = millis() + TIMEOUT;;)
+            {
+                gcode::Line* line = nextLine(deadline);
+                if (line == 0)
+                {
+                    if (serial.hasError())
+                        return fail(serial.error());
+                    break; // send again
+                }
+                const char* d = line->data();
+                bool numbered = line->length() > 2 && isdigit(d[2]);
+                int num = numbered ? atoi(d + 2) : -1;
+                bool ok = numbered && d[0] == 'o' && d[1] == 'k';
+                bool rs = numbered && d[0] == 'r' && d[1] == 's';
+                bool fe = d[0] == 'f' && d[1] == 'e';
+                delete line;
+                if (fe)
+                    return fail("Fatal error in binary file transfer");
+                if (ok && num == sync)
+                {
+                    sync++;
+                    return true;
+                }
+                if (rs)
+                {
+                    sync = (uint8_t)num;
+                    break;
+                }
+            }
+        }
+        return fail("Printer does not accept binary file transfer packets");
+    }
+
+    // Waits for the printer's "PFT:" reply and returns it (to be delete'd by
+    // the caller) or 0 if none arrives.
+    gcode::Line* pftReply()
+    {
+        for (int64_t deadline = millis() + TIMEOUT;;)
+        {
+            gcode::Line* line = nextLine(deadline);
+            if (line == 0)
+                return 0;
+            int idx = line->startsWith("echo:");
+            line->slice(idx);
+            if (line->startsWith("PFT:"))
+                return line;
+            delete line;
+        }
+    }
+
+    // Sends a FILE_TRANSFER packet and expects "PFT:success".
+    bool command(int type, const char* payload, int len, const char* errmsg)
+    {
+        if (!send(BinaryProtocol::FILE_TRANSFER, type, payload, len))
+            return false;
+        gcode::Line* reply = pftReply();
+        bool success = reply != 0 && reply->startsWith("PFT:success\b");
+        delete reply;
+        return success || fail(errmsg);
+    }
+
+    // Sends the pending data in blocks of blocksize bytes. If all is false, the
+    // data that doesn't fill a block is kept.
+    bool flush(bool all)
+    {
+        int done = 0;
+        while (pendlen - done >= blocksize || (all && pendlen > done))
+        {
+            int n = pendlen - done;
+            if (n > blocksize)
+                n = blocksize;
+            if (!send(BinaryProtocol::FILE_TRANSFER, BinaryProtocol::WRITE, pending + done, n))
+                return false;
+            done += n;
+        }
+        pendlen -= done;
+        memmove(pending, pending + done, pendlen);
+        return true;
+    }
+
+  public:
+    BinaryTransfer(File& serial_, gcode::Reader& serial_in_)
+        : serial(serial_), serial_in(serial_in_), sync(0), blocksize(BinaryProtocol::MAX_PAYLOAD),
+          can_compress(false), compressing(false), pending(0), pendlen(0), err(0), wire(0)
+    {
+    }
+
+    ~BinaryTransfer() { free(pending); }
+
+    // Switches the printer to the binary protocol. The printer must not owe us
+    // any reply. preamble are commands (each terminated by '\n') that are sent
+    // first, e.g. to start heating up. They must not take long to execute.
+    bool connect(const char* preamble = "")
+    {
+        int len = strlen(preamble);
+        char* gcode = (char*)malloc(len + 8);
+        memcpy(gcode, preamble, len);
+        memcpy(gcode + len, "M28 B1\n", 8);
+        serial.setNonBlock(false);
+        bool written = serial.writeAll(gcode, len + 7);
+        free(gcode);
+        if (!written)
+            return fail(serial.error());
+        serial.setNonBlock(true);
+
+        int oks = 1;
+        for (const char* p = preamble; *p != 0; p++)
+            oks += (*p == '\n');
+        for (int64_t deadline = millis() + TIMEOUT; oks > 0;)
+        {
+            gcode::Line* line = nextLine(deadline);
+            if (line == 0)
+                return fail("Printer did not acknowledge M28 B1");
+            if (line->startsWith("ok\b"))
+                oks--;
+            delete line;
+        }
+
+        // SYNC tells us the printer's sync and block size.
+        char packet[BinaryProtocol::HEADER_SIZE];
+        for (int tries = 0;; tries++)
+        {
+            if (tries == MAX_TRIES)
+                return fail("Printer does not answer binary protocol SYNC");
+            int n = BinaryProtocol::packet(sync, BinaryProtocol::CONTROL, BinaryProtocol::SYNC, 0, 0, packet);
+            serial.setNonBlock(false);
+            if (!serial.writeAll(packet, n))
+                return fail(serial.error());
+            serial.setNonBlock(true);
+            wire += n;
+            gcode::Line* line = 0;
+            for (int64_t deadline = millis() + TIMEOUT; 0 != (line = nextLine(deadline)) && !line->startsWith("ss");)
+                delete line;
+            if (line != 0)
+            {
+                char* comma;
+                sync = (uint8_t)strtol(line->data() + 2, &comma, 10);
+                if (*comma == ',')
+                    blocksize = atoi(comma + 1);
+                if (blocksize <= 0 || blocksize > BinaryProtocol::MAX_PAYLOAD)
+                    blocksize = BinaryProtocol::MAX_PAYLOAD;
+                delete line;
+                break;
+            }
+        }
+
+        if (!send(BinaryProtocol::FILE_TRANSFER, BinaryProtocol::QUERY, 0, 0))
+            return false;
+        gcode::Line* reply = pftReply();
+        if (reply == 0)
+            return fail("Printer did not answer binary file transfer QUERY");
+        // Marlin spells it "compresion".
+        const char* hs = strstr(reply->data(), ":heatshrink,");
+        can_compress = hs != 0 && atoi(hs + 12) == Heatshrink::WINDOW_BITS &&
+                       strchr(hs + 12, ',') != 0 && atoi(strchr(hs + 12, ',') + 1) == Heatshrink::LOOKAHEAD_BITS;
+        delete reply;
+        return true;
+    }
+
+    // Creates file name (8.3) on the SD card, overwriting an existing file.
+    // If compress is true and the printer supports it, the data will be sent
+    // compressed.
+    bool open(const char* name, bool compress)
+    {
+        compressing = compress && can_compress;
+        int len = strlen(name);
+        char* payload = (char*)malloc(len + 3);
+        payload[0] = 0; // not a dummy transfer
+        payload[1] = compressing;
+        memcpy(payload + 2, name, len + 1);
+        bool ok = command(BinaryProtocol::OPEN, payload, len + 3, "Cannot create file on SD card");
+        free(payload);
+        pending = (char*)realloc(pending, blocksize + Heatshrink::Encoder::maxOutput(blocksize));
+        pendlen = 0;
+        return ok;
+    }
+
+    // Appends len bytes to the file.
+    bool write(const char* data, int len)
+    {
+        while (len > 0)
+        {
+            int n = (len < blocksize) ? len : blocksize;
+            if (compressing)
+                pendlen += encoder.encode(data, n, pending + pendlen, false);
+            else
+            {
+                memcpy(pending + pendlen, data, n);
+                pendlen += n;
+            }
+            data += n;
+            len -= n;
+            if (!flush(false))
+                return false;
+        }
+        return true;
+    }
+
+    // Sends the rest of the data and closes the file.
+    bool close()
+    {
+        if (compressing)
+            pendlen += encoder.encode(0, 0, pending + pendlen, true);
+        return flush(true) && command(BinaryProtocol::CLOSE_FILE, 0, 0, "Cannot write file to SD card");
+    }
+
+    // Switches the printer back to GCODE.
+    bool disconnect() { return send(BinaryProtocol::CONTROL, BinaryProtocol::CLOSE, 0, 0); }
+
+    // true if open() has chosen to compress the data.
+    bool compressed() { return compressing; }
+
+    // Number of bytes sent over the wire so far.
+    int64_t wireBytes() { return wire; }
+
+    const char* error() { return err; }
+};
+
+#endif
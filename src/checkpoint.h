@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "gcode.h"
+
+// The state of the printer that GCODE commands change for all following commands.
+// Tracked while streaming a file so that a print can be continued in the middle.
+struct ModalState
+{
+    bool relative;   // G91 (true) or G90 (false)
+    bool relative_e; // M83 (true) or M82 (false)
+    float feedrate;  // last F
+    float e;         // E position (only meaningful if !relative_e)
+    float z;
+    float hotend; // last target temperatures
+    float bed;
+
+    ModalState() : relative(false), relative_e(false), feedrate(0), e(0), z(0), hotend(0), bed(0) {}
+
+    // Applies the effect of line, which must have been read with whitespace
+    // compression level 1 and without comments.
+    void update(gcode::Line& line)
+    {
+        if (line.startsWith("G0\b") || line.startsWith("G1\b"))
+        {
+            feedrate = line.getDouble("F", feedrate);
+            e = line.getDouble("E", e, relative_e);
+            z = line.getDouble("Z", z, relative);
+        }
+        else if (line.startsWith("G90\b"))
+            relative = relative_e = false;
+        else if (line.startsWith("G91\b"))
+            relative = relative_e = true;
+        else if (line.startsWith("M82\b"))
+            relative_e = false;
+        else if (line.startsWith("M83\b"))
+            relative_e = true;
+        else if (line.startsWith("G92\b"))
+        {
+            if (line.length() <= 4) // "G92" or "G92\n" sets all axes to 0
+                e = z = 0;
+            else
+            {
+                e = line.getDouble("E", e);
+                z = line.getDouble("Z", z);
+            }
+        }
+        else if (line.startsWith("M104\b") || line.startsWith("M109\b"))
+            hotend = line.getDouble("S", line.getDouble("R", hotend));
+        else if (line.startsWith("M140\b") || line.startsWith("M190\b"))
+            bed = line.getDouble("S", line.getDouble("R", bed));
+    }
+};
+
+// Records the progress of a print in a small memory-mapped file, so that the
+// print can be resumed after marlinfeed has died or the printer connection has
+// been lost. The file is updated through the mapping, so save() is cheap
+// enough to be called for every line. Two records are kept and the
+// one not currently valid is overwritten, so that a crash in the middle of
+// save() leaves the previous record intact.
+class Checkpoint
+{
+  public:
+    struct Record
+    {
+        // Offset in the print file of the first byte that has not been ack'd
+        // by the printer.
+        int64_t offset;
+
+        // The state after the last ack'd line.
+        ModalState state;
+    };
+
+  private:
+    static const uint32_t MAGIC = 0x4d464350; // "MFCP"
+
+    struct Data
+    {
+        uint32_t magic;
+        uint32_t size; // sizeof(Data) to detect incompatible files
+
+        // true from begin() until finish().
+        volatile int32_t active;
+
+        // Index into rec[] of the valid record.
+        volatile int32_t current;
+
+        // st_mtime of the print file, to detect a file that has changed since.
+        int64_t mtime;
+
+        Record rec[2];
+
+        char path[PATH_MAX];
+    };
+
+    Data* data;
+
+    Checkpoint(const Checkpoint&);
+    Checkpoint& operator=(const Checkpoint&);
+
+  public:
+    Checkpoint() : data(0) {}
+
+    ~Checkpoint()
+    {
+        if (data != 0)
+            munmap(data, sizeof(Data));
+    }
+
+    // Maps the checkpoint file at path (which is created if necessary) into memory.
+    // Returns false and prints an error if that's not possible, in which case all
+    // other functions do nothing.
+    bool open(const char* path)
+    {
+        File f(path);
+        f.action("opening checkpoint file");
+        if (!f.open(O_RDWR | O_CREAT, 0644))
+        {
+            fprintf(stderr, "%s\n", f.error());
+            return false;
+        }
+
+        struct stat statbuf;
+        bool fresh = !f.stat(&statbuf) || statbuf.st_size != (off_t)sizeof(Data);
+        if (fresh && ftruncate(f.fileDescriptor(), sizeof(Data)) != 0)
+        {
+            perror(path);
+            return false;
+        }
+
+        void* map = mmap(0, sizeof(Data), PROT_READ | PROT_WRITE, MAP_SHARED, f.fileDescriptor(), 0);
+        if (map == MAP_FAILED)
+        {
+            perror(path);
+            return false;
+        }
+        if (data != 0)
+            munmap(data, sizeof(Data));
+        data = (Data*)map;
+
+        if (data->magic != MAGIC || data->size != sizeof(Data))
+        {
+            memset((void*)data, 0, sizeof(Data));
+            data->magic = MAGIC;
+            data->size = sizeof(Data);
+        }
+        return true;
+    }
+
+    // Starts recording the progress of printing file path whose st_mtime is mtime.
+    void begin(const char* path, int64_t mtime)
+    {
+        if (data == 0 || strlen(path) >= sizeof(data->path))
+            return;
+        data->active = 0;
+        __sync_synchronize();
+        strcpy(data->path, path);
+        data->mtime = mtime;
+        data->rec[0] = Record();
+        data->rec[0].offset = 0;
+        data->current = 0;
+        __sync_synchronize();
+        data->active = 1;
+    }
+
+    // Records that the print has progressed to r.
+    void save(const Record& r)
+    {
+        if (data == 0 || !data->active)
+            return;
+        int other = 1 - data->current;
+        data->rec[other] = r;
+        __sync_synchronize();
+        data->current = other;
+    }
+
+    // Starts writing the checkpoint to disk. Without this the kernel does it
+    // eventually, which only matters if the machine loses power.
+    void flush()
+    {
+        if (data != 0)
+            msync(data, sizeof(Data), MS_ASYNC);
+    }
+
+    // Ends recording, i.e. the print is done (or has been cancelled) and must not be resumed.
+    void finish()
+    {
+        if (data == 0 || !data->active)
+            return;
+        data->active = 0;
+        msync(data, sizeof(Data), MS_ASYNC);
+    }
+
+    // Returns true if a print was begin()'d but never finish()ed.
+    bool interrupted() { return data != 0 && data->active; }
+
+    // The file of the interrupted print.
+    const char* path() { return data->path; }
+
+    int64_t mtime() { return data->mtime; }
+
+    // The last record save()d for the interrupted print.
+    Record last() { return data->rec[data->current]; }
+
+    // Returns the GCODE (malloc()ed, lines terminated by '\n') that prepares the
+    // printer to continue an interrupted print with state s: it heats up,
+    // lifts the nozzle by lift mm, homes X and Y, goes back down and restores
+    // the modal state. The Z position is assumed to be unchanged since the
+    // interruption, which is the case unless the printer has been switched off.
+    static char* resumeGCode(const ModalState& s, float lift = 5)
+    {
+        char buf[512];
+        int n = 0;
+        if (s.bed > 0)
+            n += snprintf(buf + n, sizeof(buf) - n, "M140 S%g\n", s.bed);
+        if (s.hotend > 0)
+            n += snprintf(buf + n, sizeof(buf) - n, "M104 S%g\n", s.hotend);
+        if (s.bed > 0)
+            n += snprintf(buf + n, sizeof(buf) - n, "M190 S%g\n", s.bed);
+        if (s.hotend > 0)
+            n += snprintf(buf + n, sizeof(buf) - n, "M109 S%g\n", s.hotend);
+        n += snprintf(buf + n, sizeof(buf) - n, "G92 Z%g\nG91\nG0 Z%g\nG90\nG28 X Y\nG0 Z%g\n", s.z, lift, s.z);
+        n += snprintf(buf + n, sizeof(buf) - n, "G92 E%g\n%s\n%s\n", s.relative_e ? 0 : s.e,
+                      s.relative ? "G91" : "G90", s.relative_e ? "M83" : "M82");
+        if (s.feedrate > 0)
+            snprintf(buf + n, sizeof(buf) - n, "G1 F%g\n", s.feedrate);
+        return strdup(buf);
+    }
+};
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file.h"
+
+// Support for GCODE files compressed with gzip or zstd. The actual work is done
+// by the gzip(1) and zstd(1) programs running in child processes, so there is
+// no library dependency and decompression runs on a different CPU core than
+// the process talking to the printer.
+class Codec
+{
+  public:
+    enum Type
+    {
+        NONE,
+        GZIP,
+        ZSTD
+    };
+
+    // Returns the compression implied by the suffix of file name.
+    static Type fromName(const char* name)
+    {
+        const char* ext = strrchr(name, '.');
+        if (ext == 0)
+            return NONE;
+        if (strcmp(ext, ".gz") == 0)
+            return GZIP;
+        if (strcmp(ext, ".zst") == 0)
+            return ZSTD;
+        return NONE;
+    }
+
+    // Returns the compression named by an HTTP Content-Encoding value (leading
+    // whitespace is skipped, trailing junk such as CRLF is ignored) or a
+    // program name.
+    static Type fromEncoding(const char* enc)
+    {
+        while (*enc == ' ' || *enc == '\t')
+            enc++;
+        if (strncasecmp(enc, "gzip", 4) == 0 || strncasecmp(enc, "x-gzip", 6) == 0)
+            return GZIP;
+        if (strncasecmp(enc, "zstd", 4) == 0)
+            return ZSTD;
+        return NONE;
+    }
+
+    // File name suffix for type t, e.g. ".gz".
+    static const char* suffix(Type t)
+    {
+        switch (t)
+        {
+            case GZIP:
+                return ".gz";
+            case ZSTD:
+                return ".zst";
+            default:
+                return "";
+        }
+    }
+
+    // Returns true if name ends in ".gcode", optionally followed by a
+    // compression suffix.
+    static bool isGCodeName(const char* name)
+    {
+        size_t len = strlen(name) - strlen(suffix(fromName(name)));
+        return len >= 6 && strncmp(name + len - 6, ".gcode", 6) == 0;
+    }
+
+    // Starts a child process that reads from infd and writes to outfd the
+    // data (de)compressed according to t. Returns the child's pid or -1 on error.
+    // The caller should close its copies of infd and outfd where appropriate,
+    // so that the child sees EOF and the reader of outfd sees EOF when the
+    // child terminates.
+    static pid_t spawn(Type t, bool decode, int infd, int outfd)
+    {
+        const char* program = (t == ZSTD) ? "zstd" : "gzip";
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (dup2(infd, 0) < 0 || dup2(outfd, 1) < 0)
+                _exit(1);
+            for (int fd = 3; fd < 1024; fd++) // don't keep printer and client connections open
+                close(fd);
+            signal(SIGPIPE, SIG_DFL); // reader went away => silently die
+            execlp(program, program, "-q", decode ? "-dc" : "-c", (const char*)0);
+            perror(program);
+            _exit(1);
+        }
+        return pid;
+    }
+
+    // Replaces the file descriptor of f (which must be open for reading) with a
+    // pipe that delivers the contents of f decompressed according to t.
+    // f is read from its current file offset.
+    // Returns false and prints an error message if this fails.
+    static bool decompress(File& f, Type t)
+    {
+        int pfd[2];
+        if (pipe(pfd) != 0)
+        {
+            perror("pipe");
+            return false;
+        }
+        pid_t pid = spawn(t, true, f.fileDescriptor(), pfd[1]);
+        close(pfd[1]);
+        if (pid < 0 || dup2(pfd[0], f.fileDescriptor()) < 0)
+        {
+            perror("starting decompressor");
+            close(pfd[0]);
+            return false;
+        }
+        close(pfd[0]);
+        return true;
+    }
+
+    // Returns a file descriptor that delivers the decompressed data of the
+    // length bytes (until EOF if length <= 0) read from in. The first prefix_len
+    // of these bytes have already been read from in and are passed in prefix.
+    // A second child process copies the data from in to the decompressor, so
+    // that the decompressor gets EOF after length bytes even if in is a
+    // connection that stays open. Returns -1 on error.
+    static int decodeStream(Type t, File& in, int64_t length, const char* prefix, int prefix_len)
+    {
+        int inpipe[2];
+        int outpipe[2];
+        if (pipe(inpipe) != 0)
+            return -1;
+        if (pipe(outpipe) != 0)
+        {
+            close(inpipe[0]);
+            close(inpipe[1]);
+            return -1;
+        }
+        pid_t pid = spawn(t, true, inpipe[0], outpipe[1]);
+        close(inpipe[0]);
+        close(outpipe[1]);
+        if (pid >= 0 && (pid = fork()) == 0)
+        {
+            close(outpipe[0]);
+            File sink("decompressor", inpipe[1]);
+            sink.writeAll(prefix, prefix_len);
+            int64_t unread = (length <= 0) ? INT64_MAX : length - prefix_len;
+            char buf[65536];
+            while (unread > 0 && !sink.hasError())
+            {
+                int n = in.read(buf, (unread < (int64_t)sizeof(buf)) ? unread : sizeof(buf), 0, 30000, 30000);
+                if (n <= 0)
+                    break;
+                sink.writeAll(buf, n);
+                unread -= n;
+            }
+            _exit(0);
+        }
+        close(inpipe[1]);
+        if (pid < 0)
+        {
+            close(outpipe[0]);
+            return -1;
+        }
+        return outpipe[0];
+    }
+
+    // Returns the size of the decompressed contents of f as recorded in the file
+    // or -1 if it is not known. f is not read through, so its offset is unchanged.
+    static int64_t uncompressedSize(File& f, Type t)
+    {
+        unsigned char b[18];
+        int fd = f.fileDescriptor();
+        if (t == GZIP)
+        {
+            // gzip ends with the size modulo 2^32
+            struct stat statbuf;
+            if (!f.stat(&statbuf) || statbuf.st_size < 18 || pread(fd, b, 4, statbuf.st_size - 4) != 4)
+                return -1;
+            return b[0] | (b[1] << 8) | (b[2] << 16) | ((int64_t)b[3] << 24);
+        }
+        if (t == ZSTD)
+        {
+            // The frame header may contain the Frame_Content_Size.
+            if (pread(fd, b, sizeof(b), 0) != (ssize_t)sizeof(b))
+                return -1;
+            if (b[0] != 0x28 || b[1] != 0xb5 || b[2] != 0x2f || b[3] != 0xfd)
+                return -1;
+            int fhd = b[4];
+            bool single_segment = fhd & 0x20;
+            static const int dict_id_size[4] = {0, 1, 2, 4};
+            int pos = 5 + (single_segment ? 0 : 1) + dict_id_size[fhd & 3];
+            int fcs_size = (fhd >> 6) == 0 ? (single_segment ? 1 : 0) : (1 << (fhd >> 6));
+            if (fcs_size == 0)
+                return -1;
+            int64_t size = 0;
+            for (int i = fcs_size - 1; i >= 0; i--)
+                size = (size << 8) | b[pos + i];
+            if (fcs_size == 2)
+                size += 256;
+            return size;
+        }
+        return -1;
+    }
+};
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DEVFINDER_H
+#define DEVFINDER_H
+
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fifo.h"
+#include "file.h"
+#include "millis.h"
+
+// Finds the TTY of a printer that may get a different device name whenever it
+// is plugged in or reset (e.g. ttyUSB1 instead of ttyUSB0). The printer is
+// specified in one of these forms:
+//   <dir>                The first entry named ttyUSB* or ttyACM* found by a
+//                        breadth first search of the directory <dir>, e.g.
+//                        /sys/bus/usb-serial or the sysfs directory of a
+//                        particular USB port.
+//   usb:<vendor>:<product>  The first TTY of a USB device with these IDs
+//                        (4 hex digits each as in lsusb).
+//   usb:<serial>         The TTY of the USB device with this serial number.
+//   anything else        A fixed path (device or socket) used as is.
+// Kernel uevents received via netlink tell when a TTY appears, so that
+// wait() can return as soon as the printer is back.
+class DeviceFinder
+{
+    // Breadth first search does not go deeper than this.
+    static const int MAX_DEPTH = 8;
+
+    // While a new TTY is not accessible, yet (udev still setting permissions),
+    // it is checked this often (in milliseconds).
+    static const int SETTLE_INTERVAL = 50;
+
+    // The printer as specified by the user. Not copied.
+    const char* spec;
+
+    // The last device path returned by resolve(). malloc()ed. 0 if none, yet.
+    char* device;
+
+    // Netlink socket receiving kernel uevents. -1 if not available.
+    int uevent_fd;
+
+    DeviceFinder(const DeviceFinder&);
+    DeviceFinder& operator=(const DeviceFinder&);
+
+    static bool isTTYName(const char* name)
+    {
+        return strncmp(name, "ttyUSB", 6) == 0 || strncmp(name, "ttyACM", 6) == 0;
+    }
+
+    // Returns "/dev/<name>" of the first TTY found in dir or 0. malloc()ed.
+    static char* search(const char* dir)
+    {
+        FIFO<char> queue;
+        FIFO<char> next;
+        queue.put(strdup(dir));
+        char* found = 0;
+        for (int depth = 0; depth <= MAX_DEPTH && found == 0 && !queue.empty(); depth++)
+        {
+            for (char* d; 0 != (d = queue.get());)
+            {
+                DIR* dirp = (found == 0) ? opendir(d) : 0;
+                for (struct dirent* ent; dirp != 0 && found == 0 && 0 != (ent = readdir(dirp));)
+                {
+                    if (ent->d_name[0] == '.')
+                        continue;
+                    if (isTTYName(ent->d_name))
+                        assert(0 <= asprintf(&found, "/dev/%s", ent->d_name));
+                    else if (ent->d_type == DT_DIR) // sysfs is full of cyclic symlinks => don't follow them
+                    {
+                        char* sub;
+                        assert(0 <= asprintf(&sub, "%s/%s", d, ent->d_name));
+                        next.put(sub);
+                    }
+                }
+                if (dirp != 0)
+                    closedir(dirp);
+                free(d);
+            }
+            while (!next.empty())
+                queue.put(next.get());
+        }
+        while (!queue.empty())
+            free(queue.get());
+        return found;
+    }
+
+    // Returns "/dev/<tty>" of the first TTY whose USB device matches spec
+    // ("usb:..." form) or 0. malloc()ed.
+    static char* searchUSB(const char* spec)
+    {
+        const char* id = spec + 4;
+        DIR* dirp = opendir("/sys/class/tty");
+        char* found = 0;
+        for (struct dirent* ent; dirp != 0 && found == 0 && 0 != (ent = readdir(dirp));)
+        {
+            char attr[3][128];
+            if (!isTTYName(ent->d_name) || !usbAttributes(ent->d_name, attr))
+                continue;
+            char vidpid[258];
+            snprintf(vidpid, sizeof(vidpid), "%s:%s", attr[0], attr[1]);
+            if (strcasecmp(id, vidpid) == 0 || strcmp(id, attr[2]) == 0)
+                assert(0 <= asprintf(&found, "/dev/%s", ent->d_name));
+        }
+        if (dirp != 0)
+            closedir(dirp);
+        return found;
+    }
+
+    // Returns true if the device spec refers to exists and can be opened.
+    bool available()
+    {
+        const char* dev = resolve();
+        return access(dev, R_OK | W_OK) == 0;
+    }
+
+  public:
+    DeviceFinder() : spec(0), device(0), uevent_fd(-1) {}
+
+    ~DeviceFinder()
+    {
+        free(device);
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+    }
+
+    // Reads the USB attributes idVendor, idProduct and serial of the USB device
+    // the TTY /dev/<tty> belongs to into attr[0..2]. Returns false if tty is not
+    // a USB device with a serial number.
+    static bool usbAttributes(const char* tty, char attr[3][128])
+    {
+        // /sys/class/tty/<tty>/device leads to the USB interface. The USB
+        // device with the serial number is one of its ancestors.
+        char sys[PATH_MAX + 32];
+        char usb[PATH_MAX];
+        snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device", tty);
+        if (realpath(sys, usb) == 0)
+            return false;
+        for (char* slash; 0 != (slash = strrchr(usb, '/')) && slash != usb; *slash = 0)
+        {
+            const char* attr_names[3] = {"idVendor", "idProduct", "serial"};
+            int found = 0;
+            for (; found < 3; found++)
+            {
+                snprintf(sys, sizeof(sys), "%s/%s", usb, attr_names[found]);
+                File f(sys);
+                if (!f.open(O_RDONLY))
+                    break;
+                int n = f.read(attr[found], sizeof(attr[found]) - 1);
+                if (n <= 0)
+                    break;
+                while (n > 0 && isspace(attr[found][n - 1]))
+                    n--;
+                attr[found][n] = 0;
+            }
+            if (found == 3)
+                return true;
+        }
+        return false;
+    }
+
+    // Uses printer_spec (not copied!) as the printer specification and starts
+    // listening for uevents.
+    void open(const char* printer_spec)
+    {
+        spec = printer_spec;
+        if (uevent_fd < 0)
+        {
+            uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+            struct sockaddr_nl addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.nl_family = AF_NETLINK;
+            addr.nl_groups = 1; // kernel events
+            if (uevent_fd >= 0 && bind(uevent_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+            {
+                close(uevent_fd);
+                uevent_fd = -1;
+            }
+        }
+    }
+
+    // Returns true if spec does not name a fixed path.
+    bool isSearch()
+    {
+        struct stat statbuf;
+        return strncmp(spec, "usb:", 4) == 0 || (stat(spec, &statbuf) == 0 && S_ISDIR(statbuf.st_mode));
+    }
+
+    // Returns the current path of the printer's device. If the device is not
+    // present, the path from the last successful call is returned (or spec if
+    // there is none), so that opening it fails with a proper error message.
+    // The returned pointer remains valid until a call of resolve() returns a
+    // different path.
+    const char* resolve()
+    {
+        if (!isSearch())
+            return spec;
+        char* found = (strncmp(spec, "usb:", 4) == 0) ? searchUSB(spec) : search(spec);
+        if (found != 0 && (device == 0 || strcmp(found, device) != 0))
+        {
+            free(device);
+            device = found;
+        }
+        else
+            free(found);
+        return (device != 0) ? device : spec;
+    }
+
+    // Waits up to timeout milliseconds for a TTY to appear that is (or could
+    // be) the printer. Returns true if the printer's device has appeared and is
+    // accessible, false on timeout or signal. Without uevents this just sleeps.
+    bool wait(int timeout)
+    {
+        int64_t deadline = millis() + timeout;
+        bool added = false;
+        for (;;)
+        {
+            int left = deadline - millis();
+            if (left <= 0)
+                return false;
+            if (added && left > SETTLE_INTERVAL)
+                left = SETTLE_INTERVAL;
+            struct pollfd pfd = {uevent_fd, POLLIN, 0};
+            int ready = ::poll(&pfd, (uevent_fd >= 0) ? 1 : 0, left);
+            if (ready < 0 && errno == EINTR)
+                return false;
+
+            char msg[4096];
+            ssize_t n;
+            while (ready > 0 && (n = recv(uevent_fd, msg, sizeof(msg) - 1, MSG_DONTWAIT)) > 0)
+            {
+                msg[n] = 0; // The header "<action>@<devpath>" is the first 0-terminated string.
+                if (strncmp(msg, "add@", 4) == 0 && strstr(msg, "/tty/") != 0)
+                    added = true;
+            }
+            if (added && available())
+                return true;
+        }
+    }
+};
+
+#endif
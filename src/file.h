@@ -24,10 +24,12 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/serial.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -36,6 +38,26 @@
 #include <termios.h>
 #include <unistd.h>
 
+#ifdef TCGETS2
+// The kernel's struct termios2 from <asm/termbits.h>, which can't be included
+// together with <termios.h>. It is needed for baud rates like 250000 that
+// have no B... constant.
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER CBAUDEX
+#endif
+#endif
+
 // Simple wrapper around a file descriptor to make UNIX syscalls easier to use.
 class File
 {
@@ -244,6 +266,15 @@ class File
         return checkError(retval);
     }
 
+    // Assigns newpath to this file as its new path for future operations such
+    // as open(). Does not affect an already open file descriptor.
+    //
+    // NOTE: The pointer newpath is used directly. DO NOT FREE!
+    void setPath(const char* newpath) { fpath = newpath; }
+
+    // Returns the path passed to the constructor or setPath().
+    const char* path() { return fpath; }
+
     // Connects to a Unix Domain Socket on the file path passed to the constructor.
     // If the File is already open, it is closed first.
     // Another party must have used listen() and accept() on the same path
@@ -403,15 +434,120 @@ class File
         return retval;
     }
 
+    // Assuming the file is a connected Unix Domain Socket (e.g. one end of a
+    // socketpair()), this sends pass_fd to the process at the other end, which
+    // can get its own descriptor for the same open file via receiveFd().
+    // pass_fd remains open in this process.
+    // Returns true on success and false on error.
+    bool sendFd(int pass_fd)
+    {
+        if (hasError())
+            return false;
+
+        char dummy = 0; // at least 1 byte of data is required to transport the descriptor
+        struct iovec iov = {&dummy, 1};
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctrl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(&ctrl, 0, sizeof(ctrl));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+
+        int retval;
+        do
+            retval = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        while (retval < 0 && errno == EINTR);
+
+        return checkError(retval);
+    }
+
+    // Counterpart of sendFd(). Returns the received file descriptor or -1 if
+    // none could be received. Like accept(), EAGAIN is translated to EWOULDBLOCK.
+    // If the other end has closed the connection, the error is ECONNRESET.
+    int receiveFd()
+    {
+        if (hasError())
+            return -1;
+
+        char dummy;
+        struct iovec iov = {&dummy, 1};
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctrl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+
+        int retval;
+        do
+            retval = recvmsg(fd, &msg, 0);
+        while (retval < 0 && errno == EINTR);
+
+        if (retval == 0)
+        {
+            errno = ECONNRESET;
+            retval = -1;
+        }
+        if (retval < 0 && errno == EAGAIN) // translate EAGAIN to EWOULDBLOCK
+            errno = EWOULDBLOCK;
+        if (!checkError(retval))
+            return -1;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            errno = EBADMSG;
+            checkError(-1);
+            return -1;
+        }
+
+        int received;
+        memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+        return received;
+    }
+
+    // Returns the B... constant for baudrate (in bits/s) or B0 if there is none.
+    static speed_t ttySpeed(int baudrate)
+    {
+        static const struct
+        {
+            int rate;
+            speed_t speed;
+        } speeds[] = {{9600, B9600},       {19200, B19200},     {38400, B38400},     {57600, B57600},
+                      {115200, B115200},   {230400, B230400},   {460800, B460800},   {500000, B500000},
+                      {576000, B576000},   {921600, B921600},   {1000000, B1000000}, {1152000, B1152000},
+                      {1500000, B1500000}, {2000000, B2000000}, {2500000, B2500000}, {3000000, B3000000}};
+        for (unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+            if (speeds[i].rate == baudrate)
+                return speeds[i].speed;
+        return B0;
+    }
+
     // Assuming the file is open and a TTY device, this sets it up properly
-    // for reading and writing.
+    // for reading and writing at baudrate bits/s. Rates without a B... constant
+    // (e.g. 250000) are set with termios2 where the kernel supports that.
     // Returns true on success and false on error.
-    bool setupTTY(speed_t baudrate = B115200)
+    bool setupTTY(int baudrate = 115200)
     {
         if (hasError())
             return false;
 
         struct termios tty;
+        speed_t speed = ttySpeed(baudrate);
 
         if (checkError(tcgetattr(fd, &tty)))
         {
@@ -427,11 +563,12 @@ class File
             tty.c_cflag |= CREAD;  // enable receiver
             tty.c_cflag |= CLOCAL; // ignore modem control lines
 
-            cfsetispeed(&tty, baudrate);
-            cfsetospeed(&tty, baudrate);
+            // An unusual rate is set below, on top of a standard one.
+            cfsetispeed(&tty, (speed != B0) ? speed : B38400);
+            cfsetospeed(&tty, (speed != B0) ? speed : B38400);
 
             // Set up new attributes to become active after flush
-            if (checkError(tcsetattr(fd, TCSADRAIN, &tty)))
+            if (checkError(tcsetattr(fd, TCSADRAIN, &tty)) && (speed != B0 || setCustomSpeed(baudrate)))
             {
                 // Flush (i.e. discard) all pending data in both directions
                 checkError(tcflush(fd, TCIOFLUSH));
@@ -441,6 +578,59 @@ class File
         return err == 0;
     }
 
+    // Sets the TTY's speed to baudrate bits/s, which need not be one of the
+    // B... constants. Returns true on success and false on error.
+    bool setCustomSpeed(int baudrate)
+    {
+#ifdef TCGETS2
+        struct termios2 tty2;
+        if (checkError(ioctl(fd, TCGETS2, &tty2)))
+        {
+            tty2.c_cflag &= ~CBAUD;
+            tty2.c_cflag |= BOTHER;
+            tty2.c_ispeed = baudrate;
+            tty2.c_ospeed = baudrate;
+            checkError(ioctl(fd, TCSETS2, &tty2));
+        }
+#else
+        (void)baudrate;
+        errno = EINVAL;
+        checkError(-1);
+#endif
+        return err == 0;
+    }
+
+    // Assuming the file is open and a TTY device, this asks the driver to pass
+    // received bytes on immediately (ASYNC_LOW_LATENCY) and, for USB serial
+    // adapters with a latency timer (e.g. FTDI, 16ms by default), sets that
+    // timer to 1ms. Failure (e.g. no permission or a driver without these
+    // settings) does not put the File into an error state.
+    // Returns true if at least one of the settings has been made.
+    bool setLowLatency()
+    {
+        bool ok = false;
+        struct serial_struct serinfo;
+        if (ioctl(fd, TIOCGSERIAL, &serinfo) == 0)
+        {
+            serinfo.flags |= ASYNC_LOW_LATENCY;
+            ok = (ioctl(fd, TIOCSSERIAL, &serinfo) == 0);
+        }
+
+        char dev[PATH_MAX];
+        if (realpath(fpath, dev) != 0)
+        {
+            char timer[PATH_MAX + 64];
+            snprintf(timer, sizeof(timer), "/sys/class/tty/%s/device/latency_timer", strrchr(dev, '/') + 1);
+            int tfd = ::open(timer, O_WRONLY);
+            if (tfd >= 0)
+            {
+                ok |= (::write(tfd, "1\n", 2) == 2);
+                ::close(tfd);
+            }
+        }
+        return ok;
+    }
+
     // Polls the file descriptor of this File for events.
     // See poll(2) for a description of timeout and return value.
     int poll(short events, int timeout_millis)
@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "fifo.h"
+#include "file.h"
+
+// In-memory index of the GCODE files in the upload directory with the JSON
+// for the Octoprint file API rendered in advance. The directory is only read
+// again when its modification time changes (i.e. a file has been added,
+// removed or renamed), so serving a listing costs no I/O. API requests are
+// handled in forked children which get a copy of the index, so the parent
+// calls refresh() before forking.
+class FileIndex
+{
+  public:
+    struct Entry
+    {
+        char* name;
+        int64_t size;
+        int64_t mtime; // seconds
+
+        // JSON object with the GCodeAnalysis from the ".<name>.analysis" file
+        // written after the upload. 0 if there is none (yet).
+        char* analysis;
+
+        // This entry's Octoprint file information as JSON object.
+        char* json;
+    };
+
+  private:
+    // A scan of the directory made less than this many nanoseconds after its
+    // mtime may have missed changes made within the resolution of the mtime,
+    // so the next refresh() scans again.
+    static const int64_t SETTLE_NS = 2000000000LL;
+
+    char* dir;
+    const char* base_url;
+
+    // Sorted by name.
+    Entry* entries;
+    int count;
+
+    // st_mtim of dir when it was last read.
+    int64_t dir_mtime;
+
+    // CLOCK_REALTIME of the last scan.
+    int64_t last_scan;
+
+    // Cached result of listing(). 0 if it has to be rendered again.
+    char* listing_json;
+
+    FileIndex(const FileIndex&);
+    FileIndex& operator=(const FileIndex&);
+
+    static int64_t nano(const timespec& tp) { return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec; }
+
+    static int compare(const void* a, const void* b) { return strcmp(((Entry*)a)->name, ((Entry*)b)->name); }
+
+    static bool isAnalysisName(const char* name, size_t len)
+    {
+        return len > 10 && name[0] == '.' && strcmp(name + len - 9, ".analysis") == 0;
+    }
+
+    static void clear(Entry& e)
+    {
+        free(e.name);
+        free(e.analysis);
+        free(e.json);
+    }
+
+    // Returns name with '"' and '\' escaped and control characters replaced for
+    // use in a JSON string. malloc()ed.
+    static char* escape(const char* name)
+    {
+        char* esc = (char*)malloc(2 * strlen(name) + 1);
+        char* p = esc;
+        for (; *name != 0; name++)
+        {
+            if (*name == '"' || *name == '\\')
+                *p++ = '\\';
+            *p++ = ((unsigned char)*name < ' ') ? '_' : *name;
+        }
+        *p = 0;
+        return esc;
+    }
+
+    // Returns the index of the entry for name or -(insertion point + 1).
+    int search(const char* name)
+    {
+        int lo = 0;
+        int hi = count - 1;
+        while (lo <= hi)
+        {
+            int mid = (lo + hi) / 2;
+            int c = strcmp(entries[mid].name, name);
+            if (c == 0)
+                return mid;
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+        return -(lo + 1);
+    }
+
+    void loadAnalysis(Entry& e)
+    {
+        char* path;
+        assert(0 < asprintf(&path, "%s/.%s.analysis", dir, e.name));
+        File f(path);
+        if (f.open(O_RDONLY))
+        {
+            char buf[65536];
+            int len = f.read(buf, sizeof(buf) - 1);
+            if (len > 0)
+            {
+                free(e.analysis);
+                e.analysis = strndup(buf, len);
+            }
+            f.close();
+        }
+        free(path);
+    }
+
+    void render(Entry& e)
+    {
+        char* name = escape(e.name);
+        free(e.json);
+        if (0 > asprintf(&e.json,
+                         "{\r\n"
+                         "  \"name\": \"%s\",\r\n"
+                         "  \"display\": \"%s\",\r\n"
+                         "  \"path\": \"%s\",\r\n"
+                         "  \"type\": \"machinecode\",\r\n"
+                         "  \"typePath\": [\"machinecode\", \"gcode\"],\r\n"
+                         "  \"origin\": \"local\",\r\n"
+                         "  \"size\": %lld,\r\n"
+                         "  \"date\": %lld,\r\n"
+                         "  \"refs\": {\"resource\": \"%s/api/files/local/%s\"}%s%s\r\n"
+                         "}",
+                         name, name, name, (long long)e.size, (long long)e.mtime, base_url, name,
+                         e.analysis ? ",\r\n  \"gcodeAnalysis\": " : "", e.analysis ? e.analysis : ""))
+            e.json = strdup("{}");
+        free(name);
+        free(listing_json);
+        listing_json = 0;
+    }
+
+    // Reads dir and rebuilds entries. Entries of files whose size and mtime have
+    // not changed are kept as they are.
+    void scan()
+    {
+        DIR* dp = opendir(dir);
+        if (dp == 0)
+        {
+            perror(dir);
+            return;
+        }
+
+        int capacity = count + 16;
+        Entry* fresh = (Entry*)malloc(capacity * sizeof(Entry));
+        int n = 0;
+        FIFO<char> analyses;
+        int dfd = dirfd(dp);
+        for (;;)
+        {
+            auto f = readdir(dp);
+            if (f == 0)
+                break;
+            size_t len = strlen(f->d_name);
+            if (isAnalysisName(f->d_name, len))
+            {
+                analyses.put(strndup(f->d_name + 1, len - 10));
+                continue;
+            }
+            if (f->d_name[0] == '.' || !Codec::isGCodeName(f->d_name))
+                continue;
+            struct stat statbuf;
+            if (0 > fstatat(dfd, f->d_name, &statbuf, 0) || !S_ISREG(statbuf.st_mode))
+                continue;
+
+            if (n == capacity)
+            {
+                capacity *= 2;
+                fresh = (Entry*)realloc(fresh, capacity * sizeof(Entry));
+            }
+            Entry& e = fresh[n++];
+            int i = search(f->d_name);
+            if (i >= 0 && entries[i].size == statbuf.st_size && entries[i].mtime == statbuf.st_mtime)
+            {
+                e = entries[i];
+                entries[i].size = -1; // moved, search() still needs the name
+            }
+            else
+            {
+                e.name = strdup(f->d_name);
+                e.size = statbuf.st_size;
+                e.mtime = statbuf.st_mtime;
+                e.analysis = 0;
+                e.json = 0;
+            }
+        }
+        closedir(dp);
+
+        for (int i = 0; i < count; i++)
+            if (entries[i].size >= 0)
+                clear(entries[i]);
+        free(entries);
+        entries = fresh;
+        count = n;
+        qsort(entries, count, sizeof(Entry), compare);
+
+        while (!analyses.empty())
+        {
+            char* name = analyses.get();
+            int i = search(name);
+            if (i >= 0 && entries[i].analysis == 0)
+                loadAnalysis(entries[i]);
+            free(name);
+        }
+
+        for (int i = 0; i < count; i++)
+            if (entries[i].json == 0 || (entries[i].analysis != 0 && strstr(entries[i].json, "gcodeAnalysis") == 0))
+                render(entries[i]);
+
+        free(listing_json);
+        listing_json = 0;
+    }
+
+  public:
+    FileIndex() : dir(0), base_url(""), entries(0), count(0), dir_mtime(0), last_scan(0), listing_json(0) {}
+
+    ~FileIndex()
+    {
+        for (int i = 0; i < count; i++)
+            clear(entries[i]);
+        free(entries);
+        free(dir);
+        free(listing_json);
+    }
+
+    // Starts indexing directory dpath. base_url is the prefix for "refs".
+    void open(const char* dpath, const char* base_url_)
+    {
+        free(dir);
+        dir = strdup(dpath);
+        base_url = base_url_ ? base_url_ : "";
+        dir_mtime = -1;
+        refresh();
+    }
+
+    // Reads the directory again if it has changed.
+    void refresh()
+    {
+        if (dir == 0)
+            return;
+        struct stat statbuf;
+        if (stat(dir, &statbuf) != 0)
+            return;
+        struct timespec tp;
+        clock_gettime(CLOCK_REALTIME, &tp);
+        int64_t now = nano(tp);
+        int64_t mtime = nano(statbuf.st_mtim);
+        if (mtime == dir_mtime && last_scan >= dir_mtime + SETTLE_NS)
+            return;
+        dir_mtime = mtime;
+        last_scan = now;
+        scan();
+    }
+
+    // Updates the entry for fpath, e.g. because DirScanner has reported a
+    // change (which does not necessarily change the directory's mtime).
+    void update(const char* fpath)
+    {
+        const char* name = strrchr(fpath, '/');
+        if (dir == 0 || name == 0 || (size_t)(name - fpath) != strlen(dir) || strncmp(fpath, dir, name - fpath) != 0)
+            return;
+        name++;
+        int i = search(name);
+        struct stat statbuf;
+        if (stat(fpath, &statbuf) != 0 || !S_ISREG(statbuf.st_mode))
+        {
+            if (i >= 0)
+            {
+                clear(entries[i]);
+                memmove(entries + i, entries + i + 1, (count - i - 1) * sizeof(Entry));
+                count--;
+                free(listing_json);
+                listing_json = 0;
+            }
+            return;
+        }
+        if (i < 0)
+        {
+            if (name[0] == '.' || !Codec::isGCodeName(name))
+                return;
+            i = -(i + 1);
+            entries = (Entry*)realloc(entries, (count + 1) * sizeof(Entry));
+            memmove(entries + i + 1, entries + i, (count - i) * sizeof(Entry));
+            count++;
+            Entry& e = entries[i];
+            e.name = strdup(name);
+            e.analysis = 0;
+            e.json = 0;
+        }
+        Entry& e = entries[i];
+        if (e.json != 0 && e.size == statbuf.st_size && e.mtime == statbuf.st_mtime)
+            return;
+        e.size = statbuf.st_size;
+        e.mtime = statbuf.st_mtime;
+        free(e.analysis);
+        e.analysis = 0;
+        loadAnalysis(e);
+        render(e);
+    }
+
+    // Returns the entry for the file called name or 0 if there is none.
+    const Entry* find(const char* name)
+    {
+        int i = search(name);
+        return (i >= 0) ? &entries[i] : 0;
+    }
+
+    int size() { return count; }
+
+    // Returns the response to GET /api/files. The result is cached until the
+    // index changes. Do not free().
+    const char* listing()
+    {
+        if (listing_json != 0)
+            return listing_json;
+
+        size_t len = 0;
+        for (int i = 0; i < count; i++)
+            len += strlen(entries[i].json) + 4;
+        char* json = (char*)malloc(len + 128);
+        char* p = json;
+        p += sprintf(p, "{\r\n\"files\": [");
+        for (int i = 0; i < count; i++)
+            p += sprintf(p, "%s%s", (i == 0) ? "\r\n" : ",\r\n", entries[i].json);
+
+        struct statvfs vfs;
+        long long free_bytes = 0;
+        long long total_bytes = 0;
+        if (dir != 0 && statvfs(dir, &vfs) == 0)
+        {
+            free_bytes = (long long)vfs.f_bavail * vfs.f_frsize;
+            total_bytes = (long long)vfs.f_blocks * vfs.f_frsize;
+        }
+        sprintf(p, "],\r\n\"free\": %lld,\r\n\"total\": %lld\r\n}\r\n", free_bytes, total_bytes);
+        listing_json = json;
+        return listing_json;
+    }
+};
+
+#endif
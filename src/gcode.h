@@ -33,10 +33,11 @@ namespace gcode
 {
 
 /* Copied from https://github.com/OctoPrint/OctoPrint/blob/master/src/octoprint/settings.py
-At this point we have no special handling for different types of GCode commands, this
-may become useful in the future. Of particular interest are the "longRunningCommands", which
-are commands that are acknowledged with 'ok' only when they are finished, whereas normally
-an 'ok' is sent when the command has been transferred to the planner buffer.
+The "emergencyCommands" are recognized by Line::isEmergency(). Other than that we have no
+special handling for different types of GCode commands, this may become useful in the future.
+Of particular interest are the "longRunningCommands", which are commands that are
+acknowledged with 'ok' only when they are finished, whereas normally an 'ok' is sent when
+the command has been transferred to the planner buffer.
 
                 "longRunningCommands": ["G4", "G28", "G29", "G30", "G32", "M400", "M226", "M600"],
                 "pausingCommands": ["M0", "M1", "M25"],
@@ -194,6 +195,11 @@ class Line
         return found;
     }
 
+    // Returns true if the line is one of the commands that Marlin built with
+    // EMERGENCY_PARSER executes as soon as they arrive, ahead of everything
+    // that is waiting in its buffers.
+    bool isEmergency() const { return startsWith("M112\b") || startsWith("M108\b") || startsWith("M410\b"); }
+
     // Returns 0 if the line does not start with prefix; otherwise
     // returns the length of the matched prefix (which is strlen(prefix), unless
     // you use any of the below special characters).
@@ -343,6 +349,10 @@ class Reader
     // Total number of bytes received from the underlying file.
     int64_t bytesRead;
 
+    // Number of bytes of the underlying file up to the end of the last line
+    // returned by next().
+    int64_t bytesConsumed;
+
     // Print time extracted from slicer comments; 0 if not parsed (yet)
     int printTime;
 
@@ -454,7 +464,7 @@ class Reader
     // in has to be open already.
     Reader(File& _in)
         : in(_in), comidx(0), bufidx(0), ready(0), wsComp(3), full_scan(false), comment(';'), in_comment(false),
-          bytesRead(0), printTime(0){};
+          bytesRead(0), bytesConsumed(0), printTime(0){};
 
     // Discard all data currently buffered by the reader. The next attempt to
     // read will start a new line at whatever file position the underlying
@@ -509,6 +519,12 @@ class Reader
     // whether they have been extracted via next()).
     int64_t totalBytesRead() { return bytesRead; }
 
+    // Returns the number of bytes of the underlying file up to and including the
+    // '\n' of the last line returned by next(), i.e. the file offset (relative to
+    // where reading started) at which the next line begins.
+    // NOTE: Not updated by discard() and raw().
+    int64_t consumedBytes() { return bytesConsumed; }
+
     // Returns the estimated print time as parsed from slicer comments; or 0 if
     // no such comment has been parsed yet.
     int estimatedPrintTime() { return printTime; }
@@ -545,6 +561,9 @@ class Reader
         bufidx -= ready;
         ready = 0;
         full_scan = true;
+        // What follows the line in buf has not been scanned, yet, i.e. it is
+        // still exactly what was read from the file.
+        bytesConsumed = bytesRead - bufidx;
         return ret;
     };
 };
@@ -0,0 +1,551 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fifo.h"
+#include "file.h"
+#include "millis.h"
+#include "timerwheel.h"
+
+// The queue of print jobs. All changes are recorded in an append-only journal
+// file so that the queue survives restarts. Other processes (e.g. the children
+// handling API requests) change the queue by appending records to the same
+// journal. The owner of the queue picks them up with update(). The order of
+// records in the journal is the order in which they take effect, so the
+// queue is the same no matter who wrote the records and when they are read.
+//
+// Without a journal (see open()) the queue exists in memory only.
+//
+// Journal records are lines of text. The id of a job is the journal offset of
+// the Q record that queued it.
+//   Q <mtime> <path>   queue <path>, whose modification time in ns is <mtime>
+//   S <id>             job <id> started printing
+//   D <id> <offset>    job <id> done, <offset> bytes of the file were read
+//   A <id> <offset>    job <id> aborted or failed after <offset> bytes
+//   C <id>             cancel queued job <id>
+//   M <id> <pos>       move queued job <id> to position <pos> (0 is the head)
+class JobQueue
+{
+  public:
+    struct Job
+    {
+        // Journal offset of the Q record or a negative number for jobs that are not
+        // in the journal.
+        int64_t id;
+
+        // Modification time of the file in ns when the job was queued. Together with
+        // path this identifies the job, so that the same file is not queued twice.
+        int64_t mtime;
+
+        // malloc()ed
+        char* path;
+
+        Job(int64_t id_, int64_t mtime_, const char* path_) : id(id_), mtime(mtime_), path(strdup(path_)) {}
+        ~Job() { free(path); }
+    };
+
+  private:
+    // Number of finished jobs remembered to detect duplicates.
+    static const int HISTORY = 100;
+
+    // Records we write are fdatasync()ed at most this many milliseconds later.
+    static const int SYNC_DELAY = 1000;
+
+    // Longest record we can read.
+    static const int MAX_RECORD = PATH_MAX + 64;
+
+    // 0 if the queue is in memory only.
+    File* journal;
+
+    // Path of journal. malloc()ed because File uses the pointer directly.
+    char* journal_path;
+
+    // Journal offset up to which records have been applied.
+    int64_t read_pos;
+
+    // Number of records applied since read_pos was 0.
+    int records;
+
+    // Next id for jobs that are not journaled.
+    int64_t next_local_id;
+
+    FIFO<Job> queued;
+    FIFO<Job> history;
+    Job* current;
+
+    TimerWheel& wheel;
+    TimerWheel::Timer sync_timer;
+
+    JobQueue(const JobQueue&);
+    JobQueue& operator=(const JobQueue&);
+
+    // Finds (and optionally removes) the job with a given id or path and mtime.
+    struct Finder
+    {
+        int64_t id;
+        const char* path;
+        int64_t mtime;
+        bool remove;
+        Job* found;
+        bool operator()(Job* j)
+        {
+            if (found == 0 && (j->id == id || (path != 0 && j->mtime == mtime && strcmp(j->path, path) == 0)))
+            {
+                found = j;
+                return !remove;
+            }
+            return true;
+        }
+    };
+
+    Job* find(FIFO<Job>& fifo, int64_t id, bool remove = false)
+    {
+        Finder f{id, 0, 0, remove, 0};
+        if (remove)
+            return fifo.filter(f).found;
+        return fifo.visit(f).found;
+    }
+
+    // Finds a job with a given path regardless of its mtime.
+    struct PathFinder
+    {
+        const char* path;
+        bool found;
+        bool operator()(Job* j)
+        {
+            found = strcmp(j->path, path) == 0;
+            return !found;
+        }
+    };
+
+    bool known(const char* path, int64_t mtime)
+    {
+        Finder f{INT64_MIN, path, mtime, false, 0};
+        if (queued.visit(f).found || history.visit(f).found)
+            return true;
+        return current != 0 && current->mtime == mtime && strcmp(current->path, path) == 0;
+    }
+
+    void retire(Job* job)
+    {
+        history.put(job);
+        if (history.size() > HISTORY)
+            delete history.get();
+    }
+
+    // Applies a single record that starts at journal offset pos.
+    void apply(char* rec, int64_t pos)
+    {
+        char type = rec[0];
+        if (type == 0 || rec[1] != ' ')
+            return;
+        char* p = rec + 2;
+        int64_t id = strtoll(p, &p, 10);
+        if (*p == ' ')
+            p++;
+
+        switch (type)
+        {
+            case 'Q':
+                if (*p != 0 && !known(p, id)) // for Q the first number is the mtime
+                    queued.put(new Job(pos, id, p));
+                break;
+            case 'S':
+            {
+                Job* job = find(queued, id, true);
+                if (job != 0)
+                {
+                    if (current != 0)
+                        retire(current);
+                    current = job;
+                }
+                break;
+            }
+            case 'D':
+            case 'A':
+                if (current != 0 && current->id == id)
+                {
+                    retire(current);
+                    current = 0;
+                }
+                break;
+            case 'C':
+            {
+                Job* job = find(queued, id, true);
+                if (job != 0)
+                    retire(job);
+                break;
+            }
+            case 'M':
+            {
+                long to = strtol(p, 0, 10);
+                Job* job = find(queued, id, true);
+                if (job == 0)
+                    break;
+                FIFO<Job> tmp;
+                for (long i = 0; !queued.empty(); i++)
+                {
+                    if (i == to)
+                    {
+                        tmp.put(job);
+                        job = 0;
+                    }
+                    tmp.put(queued.get());
+                }
+                if (job != 0)
+                    tmp.put(job);
+                while (!tmp.empty())
+                    queued.put(tmp.get());
+                break;
+            }
+        }
+    }
+
+    // Appends a record to the journal and applies it. If there is no journal or
+    // writing fails, the record is only applied in memory.
+    void record(const char* format, ...)
+    {
+        char rec[MAX_RECORD];
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(rec, sizeof(rec) - 1, format, args); // -1 for the '\n'
+        va_end(args);
+        if (len < 0 || len >= (int)sizeof(rec) - 1)
+            return;
+
+        if (journal != 0)
+        {
+            rec[len] = '\n';
+            if (journal->writeAll(rec, len + 1)) // O_APPEND => a single write() is not interleaved
+            {
+                if (!sync_timer.scheduled())
+                    wheel.start(sync_timer, millis(), SYNC_DELAY);
+                update();
+                return;
+            }
+            fprintf(stderr, "%s\n", journal->error());
+            journal->clearError();
+        }
+
+        rec[len] = 0;
+        apply(rec, next_local_id--);
+    }
+
+    void clear()
+    {
+        while (!queued.empty())
+            delete queued.get();
+        while (!history.empty())
+            delete history.get();
+        delete current;
+        current = 0;
+    }
+
+  public:
+    // The timer for batching fdatasync()s is put on wheel with the id timer_id.
+    JobQueue(TimerWheel& wheel_, int timer_id)
+        : journal(0), journal_path(0), read_pos(0), records(0), next_local_id(-1), current(0), wheel(wheel_),
+          sync_timer(timer_id)
+    {
+    }
+
+    ~JobQueue()
+    {
+        sync();
+        clear();
+        delete journal;
+        free(journal_path);
+    }
+
+    // Opens (and creates if necessary) the journal file at path and restores the
+    // queue from it. A job that was started but never finished was interrupted by a
+    // crash and is not restarted from the beginning (see Checkpoint for continuing
+    // it). Afterwards the journal is compacted to contain only the jobs that are
+    // still queued, which changes their ids.
+    // Returns false and prints an error if the journal can't be used, in which case
+    // the queue continues in memory only.
+    bool open(const char* journal_file)
+    {
+        char* path = strdup(journal_file);
+        File* j = new File(path);
+        j->action("opening job journal");
+        if (!j->open(O_RDWR | O_CREAT | O_APPEND, 0644))
+        {
+            fprintf(stderr, "%s\n", j->error());
+            delete j;
+            free(path);
+            return false;
+        }
+
+        delete journal;
+        free(journal_path);
+        journal = j;
+        journal_path = path;
+        journal->action("writing job journal");
+        read_pos = 0;
+        records = 0;
+        clear();
+        update();
+
+        if (current != 0)
+        {
+            fprintf(stderr, "Print of '%s' was interrupted\n", current->path);
+            delete current;
+            current = 0;
+        }
+
+        // Compaction. Skipped if there is nothing to drop.
+        char* newpath;
+        if (records == queued.size() || 0 > asprintf(&newpath, "%s.new", path))
+            return true;
+        File compact(newpath);
+        compact.action("compacting job journal");
+        if (compact.open(O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        {
+            for (int n = queued.size(); n > 0; n--)
+            {
+                Job* job = queued.get();
+                char rec[MAX_RECORD];
+                int len = snprintf(rec, sizeof(rec), "Q %lld %s\n", (long long)job->mtime, job->path);
+                if (len > 0 && len < (int)sizeof(rec))
+                    compact.writeAll(rec, len);
+                queued.put(job);
+            }
+            if (!compact.hasError() && fdatasync(compact.fileDescriptor()) == 0 && rename(newpath, path) == 0)
+            {
+                j = new File(path);
+                j->action("writing job journal");
+                if (j->open(O_RDWR | O_APPEND, 0644))
+                {
+                    delete journal;
+                    journal = j;
+                    read_pos = 0;
+                    records = 0;
+                    clear();
+                    update();
+                }
+                else
+                    delete j;
+            }
+            else
+                unlink(newpath);
+        }
+        free(newpath);
+        return true;
+    }
+
+    // Applies the records other processes have appended to the journal since the
+    // last call.
+    void update()
+    {
+        if (journal == 0)
+            return;
+
+        struct stat statbuf;
+        if (fstat(journal->fileDescriptor(), &statbuf) != 0 || statbuf.st_size <= read_pos)
+            return;
+
+        char buf[MAX_RECORD + 1];
+        for (;;)
+        {
+            ssize_t n = pread(journal->fileDescriptor(), buf, MAX_RECORD, read_pos);
+            if (n <= 0)
+                break;
+            buf[n] = 0;
+
+            char* p = buf;
+            for (char* nl; 0 != (nl = strchr(p, '\n')); p = nl + 1)
+            {
+                *nl = 0;
+                apply(p, read_pos + (p - buf));
+                records++;
+            }
+
+            if (p == buf) // no complete record
+            {
+                if (n < MAX_RECORD)
+                    break; // still being written
+                p += n;    // garbage => skip
+            }
+            read_pos += p - buf;
+        }
+    }
+
+    // Writes pending journal records to disk now rather than later.
+    void sync()
+    {
+        wheel.cancel(sync_timer);
+        if (journal != 0)
+            fdatasync(journal->fileDescriptor());
+    }
+
+    // If t is our timer, syncs the journal and returns true. Otherwise returns false.
+    bool fire(TimerWheel::Timer* t)
+    {
+        if (t != &sync_timer)
+            return false;
+        sync();
+        return true;
+    }
+
+    // Queues the file at path. Does nothing if the same version (i.e. modification
+    // time) of the file has already been queued recently. If journal is false, the
+    // job is not recorded in the journal and no check for duplicates is done.
+    void add(const char* path, bool journal_it = true)
+    {
+        if (!journal_it)
+        {
+            queued.put(new Job(next_local_id--, 0, path));
+            return;
+        }
+
+        struct stat statbuf;
+        int64_t mtime = 0;
+        if (stat(path, &statbuf) == 0)
+            mtime = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+        update();
+        if (!known(path, mtime))
+            record("Q %lld %s", (long long)mtime, path);
+    }
+
+    // Removes job id from the queue. Does nothing if it's not queued (anymore).
+    void cancel(int64_t id) { record("C %lld", (long long)id); }
+
+    // Moves job id to position pos in the queue; 0 is the head.
+    void move(int64_t id, int pos) { record("M %lld %d", (long long)id, pos); }
+
+    // Drops all queued jobs from memory without recording anything, so that they
+    // are still queued when the journal is opened the next time.
+    void forget()
+    {
+        while (!queued.empty())
+            delete queued.get();
+    }
+
+    bool empty() { return queued.empty(); }
+
+    // Returns true if job id is waiting in the queue.
+    bool isQueued(int64_t id) { return find(queued, id) != 0; }
+
+    int size() { return queued.size(); }
+
+    // Returns true if the file at path is printing or waiting in the queue.
+    bool references(const char* path)
+    {
+        update();
+        if (current != 0 && strcmp(current->path, path) == 0)
+            return true;
+        PathFinder f{path, false};
+        return queued.visit(f).found;
+    }
+
+    // Returns the job that is printing or 0.
+    Job* printing() { return current; }
+
+    // Takes the head of the queue and makes it the printing job. Returns the
+    // latter or 0 if the queue is empty.
+    Job* start()
+    {
+        update();
+        if (queued.empty())
+            return 0;
+        Job& job = queued.peek();
+        if (job.id < 0)
+        {
+            if (current != 0)
+                retire(current);
+            current = queued.get();
+        }
+        else
+            record("S %lld", (long long)job.id);
+        return current;
+    }
+
+    // Ends the printing job. offset is the number of bytes read from the file.
+    void finish(bool ok, int64_t offset)
+    {
+        if (current == 0)
+            return;
+        if (current->id < 0)
+        {
+            retire(current);
+            current = 0;
+        }
+        else
+            record("%c %lld %lld", ok ? 'D' : 'A', (long long)current->id, (long long)offset);
+    }
+
+    // Returns the queue as malloc()ed JSON text, starting with the printing job.
+    char* toJSON()
+    {
+        struct Renderer
+        {
+            char* json;
+            const char* state;
+            bool operator()(Job* job)
+            {
+                const char* name = strrchr(job->path, '/');
+                name = (name == 0) ? job->path : name + 1;
+                char esc[2 * strlen(name) + 1];
+                char* e = esc;
+                for (const char* p = name; *p != 0; p++)
+                {
+                    if (*p == '"' || *p == '\\')
+                        *e++ = '\\';
+                    *e++ = ((unsigned char)*p < ' ') ? '_' : *p;
+                }
+                *e = 0;
+                char* more;
+                if (0 < asprintf(&more, "%s%s    {\"id\": %lld, \"name\": \"%s\", \"state\": \"%s\"}", json,
+                                 json[strlen(json) - 1] == '[' ? "\r\n" : ",\r\n", (long long)job->id, esc, state))
+                {
+                    free(json);
+                    json = more;
+                }
+                return true;
+            }
+        } render{strdup("{\r\n  \"jobs\": ["), "printing"};
+
+        if (current != 0)
+            render(current);
+        render.state = "queued";
+        queued.visit(render);
+
+        char* json;
+        if (0 > asprintf(&json, "%s\r\n  ]\r\n}\r\n", render.json))
+            json = 0;
+        free(render.json);
+        return json;
+    }
+};
+
+#endif
@@ -24,15 +24,30 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "meatpack.h"
+
 // A buffer for GCode commands to be sent to Marlin. Performs the following
 // functions:
 //  * line numbering and checksumming
 //  * keeps track of which lines are acknowledged by 'ok'
 //  * rewind to an already sent (but not ack'd line) for Resend support
 //  * keep track of the serial buffer fill state to prevent overflowing it
+//    (in terms of MeatPack-packed bytes if setPacking(true) has been called),
+//    including lines sent out of band (see outOfBand())
+//
+// There are 2 line numbering schemes:
+//  * classic: N0 to N98, then the line "N99M110N-1*97" is inserted
+//    automatically so that the numbers roll around to 0. At most 98 lines can
+//    be waiting for ack.
+//  * wide (see setWideNumbers()): N0, N1, N2,... up to the largest number
+//    Marlin's 32 bit line counter can hold. The wrap-around line is only needed
+//    after that, i.e. practically never. The number of lines waiting for ack is
+//    only limited by the buffer size, so a large buffer can actually be used.
 class MarlinBuf
 {
     // Size of the serial port transfer buffer. This is the limiting factor,
@@ -45,92 +60,172 @@ class MarlinBuf
     // commonly used on 8-bit boards.
     int buf_size = 128;
 
-    // Each line in the buffer is 1 GCODE command prefixed by "Nxx" where
-    // xx is the line number (0 to 99), and suffixed by "*chk" where chk is
-    // the checksum as per Marlin protocol (i.e. the XOR of all bytes preceding
-    // the "*", including the Nxx). Each line ends in '\n'.
-    // line[99] is always "N99M110N-1*97\n" so that line numbers roll around to 0
-    // after 99.
-    // When line 98 is added to the buffer, line 99 is automatically added after it.
-    char* line[100];
+    // The lines in the buffer are kept in a ring of ring_size entries that grows
+    // as needed. Entry k (counting all entries ever appended) is stored at index
+    // k % ring_size of the following arrays.
+    int ring_size = 0;
+
+    // Each line in the buffer is 1 GCODE command prefixed by "N<num>" where num
+    // is the line number, and suffixed by "*chk" where chk is the checksum as per
+    // Marlin protocol (i.e. the XOR of all bytes preceding the "*", including the
+    // N<num>). Each line ends in '\n'.
+    // When line wrap_at-1 is added to the buffer, the wrap-around line
+    // "N<wrap_at>M110N-1*chk" is automatically added after it.
+    // The memory of entries is never freed, only realloc()ed.
+    char** line = 0;
 
     // String length (excluding 0-terminator) of corresponding line[].
-    int lineLen[100];
+    int* lineLen = 0;
+
+    // The number of bytes the corresponding line[] takes on the wire, i.e.
+    // lineLen[] or the MeatPack-packed length if packing is true.
+    int* wireLen = 0;
 
-    // The next line appended to the buffer will become line[i_in].
-    int i_in = 0;
+    // The tag passed to append() for the corresponding line[]; -1 if none.
+    int64_t* tag = 0;
 
-    // line[i_out] is the next line to be transmitted over the wire.
+    // The line number of the corresponding line[].
+    int32_t* number = 0;
+
+    // The next line appended to the buffer will become entry i_in.
+    int64_t i_in = 0;
+
+    // Entry i_out is the next line to be transmitted over the wire.
     // If i_out == i_in, nothing is queued for transmission.
-    int i_out = 0;
+    int64_t i_out = 0;
 
-    // The next buffer entry to have its memory freed is line[i_free].
-    // Note that this trails behind i_out, because lines get freed when
+    // The next entry to be removed by ack() is i_free.
+    // Note that this trails behind i_out, because lines get removed when
     // Marlin ACKs them with "ok".
-    int i_free = 0;
+    int64_t i_free = 0;
+
+    // The number of entries between i_free and i_in that are not wrap-around lines.
+    int64_t lines = 0;
 
-    // The sum of line lengths of unACK'd lines in the buffer.
+    // The line number of the next line appended.
+    int32_t n_in = 0;
+
+    // The number of the wrap-around line.
+    int32_t wrap_at = CLASSIC_WRAP_AT;
+
+    // "N<wrap_at>M110N-1*chk\n"
+    char wrap_line[32];
+    int wrap_len;
+    int wrap_wire; // wrap_len or packed length
+
+    // The sum of wireLen[] of unACK'd lines in the buffer.
     int sz = 0;
 
+    bool packing = false;
+
+    // The tag of the most recently ack()d line that had one.
+    int64_t acked_tag = -1;
+
+    // Lines sent out of band whose ok has not been received, yet, oldest first.
+    // The ok for oob_after[k] comes right after the ok for entry oob_after[k]-1,
+    // because the line has been sent after that entry.
+    static const int OOB_MAX = 8;
+    int64_t oob_after[OOB_MAX];
+    int oob_wire[OOB_MAX];
+    int oob_count = 0;
+
+    static const int32_t CLASSIC_WRAP_AT = 99;
+
+    // Marlin's line counter is a long, which is 32 bits on all supported boards.
+    static const int32_t WIDE_WRAP_AT = 2147483647;
+
+    MarlinBuf(const MarlinBuf&);
+    MarlinBuf& operator=(const MarlinBuf&);
+
   public:
     static const char* const WRAP_AROUND_STRING;
     static const int WRAP_AROUND_STRING_LENGTH = 14;
 
     MarlinBuf()
     {
-        line[99] = strdup(WRAP_AROUND_STRING);
-        lineLen[99] = WRAP_AROUND_STRING_LENGTH;
+        grow(100);
+        setWrap(CLASSIC_WRAP_AT);
+    }
 
-        // Pre-fill line[] with line numbers.
-        // We never free the memory, only use realloc, so the line
-        // numbers stay forever.
-        for (int i = 0; i < 99; i++)
-        {
-            lineLen[i] = 0;
-            line[i] = (char*)malloc(3);
-            line[i][0] = 'N';
-            if (i < 10)
-            {
-                line[i][1] = '0' + i;
-            }
-            else
-            {
-                line[i][1] = '0' + i / 10;
-                line[i][2] = '0' + (i % 10);
-            }
-        }
+    ~MarlinBuf()
+    {
+        for (int i = 0; i < ring_size; i++)
+            free(line[i]);
+        free(line);
+        free(lineLen);
+        free(wireLen);
+        free(tag);
+        free(number);
     }
 
     // Changes the size of the assumed Marlin buffer. This will affect future calls
     // to maxAppendLen(). If you reduce the buffer size below what's currently
     // stored, maxAppendLen() will return a negative value, because changing the
     // buffer size does not actually remove anything from the buffer.
-    // NOTE: Independent of the buffer size there is a fixed upper limit of 99 lines
-    // that can be stored in the buffer.
+    // NOTE: With classic line numbers there is a fixed upper limit of 98 lines
+    // that can be stored in the buffer, independent of the buffer size.
     void setBufSize(int new_buf_size) { buf_size = new_buf_size; }
 
+    // Switches between classic and wide line numbers (see class description).
+    // Either way the first line is N0, which requires the printer's line counter
+    // to have been reset with WRAP_AROUND_STRING.
+    // Must only be called while the buffer is empty.
+    void setWideNumbers(bool on)
+    {
+        assert(i_free == i_in);
+        n_in = 0;
+        setWrap(on ? WIDE_WRAP_AT : CLASSIC_WRAP_AT);
+    }
+
+    // Returns the line number of the next line appended. Once all lines have
+    // been ack()d, this is the number the printer expects next.
+    int32_t nextNumber() { return n_in; }
+
+    // Numbers lines starting with n (a nextNumber() of a previous buffer with
+    // the same numbering scheme) instead of 0, so that the printer's line
+    // counter does not have to be reset between buffers.
+    // Must only be called while the buffer is empty.
+    void continueAt(int32_t n)
+    {
+        assert(i_free == i_in && n >= 0 && n < wrap_at);
+        n_in = n;
+    }
+
+    // Switches accounting for the serial buffer to MeatPack-packed line lengths
+    // (or back). The caller is responsible for packing the lines returned by next().
+    // Must only be called while the buffer is empty.
+    void setPacking(bool on)
+    {
+        assert(i_free == i_in);
+        packing = on;
+        wrap_wire = on ? MeatPack::pack(wrap_line, wrap_len) : wrap_len;
+    }
+
+    // Returns the length of the longest GCODE command that fits into the empty
+    // buffer at every line number, including the last one before the wrap-around
+    // which needs room for the wrap-around line. A longer command may never fit,
+    // so sending it would stall.
+    int maxCommandLen() { return buf_size - numberLen(wrap_at - 1) - wrap_len - 4 - 1; }
+
     // Returns the maximum length of GCODE command that still fits in the buffer.
     // Takes into account the line number, checksum and '\n' that will be added
     // as well as a potential line number wrap-around.
-    // NOTE: Independent of the free space in the buffer there is a fixed upper limit
-    // of 98 lines that can be stored in the buffer (the 99th line is auto-generated to
-    // roll around the line numbers from 99 to 0). Once that limit is reached,
-    // maxAppendLen() will return 0.
+    // NOTE: With packing the free space is counted in packed bytes, but a
+    // command can pack to more bytes than its length. Use fits() then.
+    // NOTE: With classic line numbers there is a fixed upper limit of 98 lines
+    // (the 99th line is auto-generated to roll around the line numbers from 99 to
+    // 0). Once that limit is reached, maxAppendLen() will return 0.
     int maxAppendLen()
     {
-        // Return 0 if all line spots are taken, regardless of size.
-        // The number is 99, not 100, because of the special line[99].
-        if ((i_in + 1) % 99 == i_free)
+        // Return 0 if all line numbers are taken, regardless of size.
+        if (lines >= wrap_at - 1)
             return 0;
 
         int remain = buf_size - sz;
-        if (i_in < 10)
-            remain -= 2; // Nx
-        else
-            remain -= 3; // Nxx
+        remain -= numberLen(n_in);
 
-        if (i_in == 98)
-            remain -= WRAP_AROUND_STRING_LENGTH;
+        if (n_in == wrap_at - 1)
+            remain -= wrap_wire;
 
         remain -= 4; // *chk
         remain--;    // \n
@@ -144,21 +239,145 @@ class MarlinBuf
     // Make sure you check maxAppendLen() first and don't forget to free
     // the memory of gcode (because this function creates its own copy).
     // If gcode is the empty string (after stripping whitespace) nothing is done.
-    void append(const char* gcode)
+    // If tag >= 0, ackedTag() will return it after the line has been ack()d.
+    void append(const char* gcode, int64_t tag_ = -1)
+    {
+        int i = slot(i_in);
+        int len = frame(gcode);
+        if (len == 0)
+            return;
+
+        lineLen[i] = len;
+        wireLen[i] = wire(i);
+        tag[i] = tag_;
+        number[i] = n_in++;
+        sz += wireLen[i];
+        i_in++;
+        lines++;
+
+        // if we just appended line wrap_at-1, automatically append the wraparound M110
+        if (n_in == wrap_at)
+        {
+            i = slot(i_in);
+            line[i] = (char*)realloc(line[i], wrap_len + 1);
+            memcpy(line[i], wrap_line, wrap_len + 1);
+            lineLen[i] = wrap_len;
+            wireLen[i] = wrap_wire;
+            tag[i] = -1;
+            number[i] = wrap_at;
+            sz += wrap_wire;
+            i_in++;
+            n_in = 0;
+        }
+
+        assert(lines < wrap_at);
+        assert(sz <= buf_size);
+    }
+
+    // Returns true if append(gcode) would not overflow the buffer. Unlike
+    // maxAppendLen() this is exact with packing.
+    bool fits(const char* gcode)
+    {
+        if (lines >= wrap_at - 1)
+            return false;
+        int i = slot(i_in);
+        int len = frame(gcode);
+        if (len == 0)
+            return true;
+        lineLen[i] = len; // no harm, line[i] is unused until append()
+        int need = wire(i);
+        if (n_in == wrap_at - 1)
+            need += wrap_wire;
+        return need <= buf_size - sz;
+    }
+
+  private:
+    static int numberLen(int32_t n)
+    {
+        int len = 2; // N and 1 digit
+        while (n >= 10)
+        {
+            n /= 10;
+            len++;
+        }
+        return len;
+    }
+
+    void setWrap(int32_t n)
+    {
+        wrap_at = n;
+        snprintf(wrap_line, sizeof(wrap_line), "N%dM110N-1", (int)n);
+        int chk = 0;
+        for (const char* p = wrap_line; *p != 0; p++)
+            chk ^= *p;
+        int len = strlen(wrap_line);
+        wrap_len = len + snprintf(wrap_line + len, sizeof(wrap_line) - len, "*%d\n", chk);
+        wrap_wire = packing ? MeatPack::pack(wrap_line, wrap_len) : wrap_len;
+    }
+
+    // Changes the number of ring entries to new_size, which must be large enough
+    // for all entries from i_free to i_in.
+    void grow(int new_size)
+    {
+        char** new_line = (char**)calloc(new_size, sizeof(char*));
+        int* new_lineLen = (int*)calloc(new_size, sizeof(int));
+        int* new_wireLen = (int*)calloc(new_size, sizeof(int));
+        int64_t* new_tag = (int64_t*)calloc(new_size, sizeof(int64_t));
+        int32_t* new_number = (int32_t*)calloc(new_size, sizeof(int32_t));
+        // All old entries (including unused ones, to keep their memory) are
+        // moved, starting with i_free.
+        for (int64_t k = i_free; k < i_free + ring_size; k++)
+        {
+            int i = k % ring_size;
+            int j = k % new_size;
+            new_line[j] = line[i];
+            new_lineLen[j] = lineLen[i];
+            new_wireLen[j] = wireLen[i];
+            new_tag[j] = tag[i];
+            new_number[j] = number[i];
+        }
+        free(line);
+        free(lineLen);
+        free(wireLen);
+        free(tag);
+        free(number);
+        line = new_line;
+        lineLen = new_lineLen;
+        wireLen = new_wireLen;
+        tag = new_tag;
+        number = new_number;
+        ring_size = new_size;
+    }
+
+    // Returns the index into the ring arrays of entry k, which must not be
+    // more than 1 beyond i_in. Grows the ring if it does not have room for the
+    // entries from i_free to k and a following wrap-around line.
+    int slot(int64_t k)
+    {
+        if (k + 2 - i_free > ring_size)
+            grow(ring_size * 2);
+        return k % ring_size;
+    }
+
+    // Returns the number of bytes line[i] takes on the wire.
+    int wire(int i) { return packing ? MeatPack::pack(line[i], lineLen[i]) : lineLen[i]; }
+
+    // Stores gcode with line number n_in, checksum and '\n' in the entry i_in and
+    // returns its length. Returns 0 if gcode is empty after stripping comment and
+    // whitespace, in which case the entry is unchanged.
+    int frame(const char* gcode)
     {
         // strip leading whitespace
         while (isspace(*gcode))
             gcode++;
 
-        int len = 0;
-        int chk = line[i_in][0] ^ line[i_in][1];
+        char N[16];
+        int N_len = snprintf(N, sizeof(N), "N%d", (int)n_in);
 
-        int N_len = 2; // Nx
-        if (i_in >= 10)
-        {
-            N_len++; // Nxx
-            chk ^= line[i_in][2];
-        }
+        int len = 0;
+        int chk = 0;
+        for (int k = 0; k < N_len; k++)
+            chk ^= N[k];
 
         const char* p = gcode;
 
@@ -178,7 +397,7 @@ class MarlinBuf
         }
 
         if (len == 0)
-            return;
+            return 0;
 
         char lend[6]; // line end: * checksum \n 0
         int endlen = 0;
@@ -202,31 +421,39 @@ class MarlinBuf
         lend[endlen++] = '\n';
         lend[endlen++] = 0;
 
-        line[i_in] = (char*)realloc(line[i_in], N_len + len + endlen);
-        memcpy(line[i_in] + N_len, gcode, len);
-        memcpy(line[i_in] + N_len + len, lend, endlen);
-
-        lineLen[i_in] = N_len + len + endlen - 1; // -1 because we don't count the 0 terminator
-        sz += lineLen[i_in];
-        i_in++;
-
-        // if we just appended line 98, automatically append the wraparound M110
-        if (i_in == 99)
-        {
-            i_in = 0;
-            sz += WRAP_AROUND_STRING_LENGTH;
-        }
+        int i = i_in % ring_size;
+        line[i] = (char*)realloc(line[i], N_len + len + endlen);
+        memcpy(line[i], N, N_len);
+        memcpy(line[i] + N_len, gcode, len);
+        memcpy(line[i] + N_len + len, lend, endlen);
 
-        assert(i_in != i_free);
-        assert(i_in != i_out);
-        assert(sz <= buf_size);
+        return N_len + len + endlen - 1; // -1 because we don't count the 0 terminator
     }
 
+  public:
     // Returns true if there is a line to be sent over the wire.
     bool hasNext() { return i_out != i_in; }
 
     // Returns true if there is still a line that has been sent but not ack()d.
-    bool needsAck() { return i_free != i_out; }
+    bool needsAck() { return i_free != i_out || oob_count > 0; }
+
+    // Records that the caller has sent a line of len bytes (a complete line
+    // without line number, as MeatPack::plain() if packing is on) to the printer
+    // directly, i.e. ahead of the lines that are still waiting for next(). The
+    // line takes space in the serial buffer and the printer acks it like any
+    // other, so ack() needs to know about it.
+    // Returns false (and records nothing) if too many lines sent out of band are
+    // waiting for ack. The caller should then append() the line instead.
+    bool outOfBand(int len)
+    {
+        if (oob_count == OOB_MAX)
+            return false;
+        oob_after[oob_count] = i_out;
+        oob_wire[oob_count] = packing ? len + MeatPack::PLAIN_OVERHEAD : len;
+        sz += oob_wire[oob_count];
+        oob_count++;
+        return true;
+    }
 
     // Returns the next line to be sent over the wire.
     // If the pointer len is passed as non-null, the length of the
@@ -236,13 +463,10 @@ class MarlinBuf
     const char* next(int* len = 0)
     {
         assert(hasNext());
-        const char* p = line[i_out];
+        int i = i_out++ % ring_size;
         if (len != 0)
-            *len = lineLen[i_out];
-        if (++i_out == 100)
-            i_out = 0;
-
-        return p;
+            *len = lineLen[i];
+        return line[i];
     }
 
     // Remove the oldest line from the buffer.
@@ -251,35 +475,55 @@ class MarlinBuf
     // to be ack'd.
     bool ack()
     {
+        if (oob_count > 0 && oob_after[0] == i_free)
+        {
+            sz -= oob_wire[0];
+            oob_count--;
+            memmove(oob_after, oob_after + 1, oob_count * sizeof(oob_after[0]));
+            memmove(oob_wire, oob_wire + 1, oob_count * sizeof(oob_wire[0]));
+            return true;
+        }
         if (i_free == i_out)
             return false;
-        sz -= lineLen[i_free];
+        int i = i_free++ % ring_size;
+        sz -= wireLen[i];
         assert(sz >= 0);
-        if (++i_free == 100)
-            i_free = 0;
+        if (number[i] != wrap_at)
+            lines--;
+        if (tag[i] >= 0)
+            acked_tag = tag[i];
         return true;
     }
 
-    // Makes line l the next line to be returned by next().
+    // Returns the tag of the most recently ack()d line that was append()ed with
+    // a tag; -1 if there is none.
+    int64_t ackedTag() { return acked_tag; }
+
+    // Makes line number l the next line to be returned by next().
     // The line must actually be in the buffer and not have been ack()d, yet.
     // Returns false if l is not a valid line to seek to.
-    bool seek(int l)
+    bool seek(int64_t l)
     {
         // buffer empty
         if (i_free == i_in)
             return false;
 
-        if (i_free < i_in)
-        {
-            if (l < i_free || l >= i_in)
-                return false;
-        }
-        else // i_in < i_free
-        {
-            if (l >= 100 || l < 0 || (l < i_free && l >= i_in))
-                return false;
-        }
-        i_out = l;
+        // Line numbers are consecutive from entry i_free on, modulo wrap_at+1.
+        int64_t first = number[i_free % ring_size];
+        int64_t offset = (l - first) % ((int64_t)wrap_at + 1);
+        if (l < 0 || l > wrap_at)
+            return false;
+        if (offset < 0)
+            offset += (int64_t)wrap_at + 1;
+        if (offset >= i_in - i_free)
+            return false;
+        i_out = i_free + offset;
+
+        // The printer has dropped the lines from l on, so the lines sent out of
+        // band after them are ack()d before them.
+        for (int k = 0; k < oob_count; k++)
+            if (oob_after[k] > i_out)
+                oob_after[k] = i_out;
         return true;
     }
 };
@@ -26,18 +26,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
 
 #include "arg.h"
 
+#include "analysis.h"
 #include "arg.h"
+#include "binproto.h"
+#include "checkpoint.h"
+#include "compression.h"
+#include "devfinder.h"
 #include "dirscanner.h"
 #include "fifo.h"
 #include "file.h"
+#include "fileindex.h"
 #include "gcode.h"
+#include "jobqueue.h"
 #include "marlinbuf.h"
+#include "meatpack.h"
 #include "millis.h"
+#include "multipart.h"
+#include "profile.h"
+#include "retention.h"
+#include "scheduler.h"
+#include "sequences.h"
+#include "timerwheel.h"
 
 using gcode::Line;
 using std::unique_ptr;
@@ -50,14 +65,29 @@ enum optionIndex
     VERBOSE,
     PORT,
     LOCALHOST,
-    API
+    API,
+    PRINTER,
+    JOURNAL,
+    RESUME,
+    COMPRESS,
+    RETAIN,
+    MEATPACK,
+    SD,
+    BUFSIZE,
+    PROFILES,
+    BAUD,
+    LOWLATENCY
 };
 const option::Descriptor usage[] = {
     {UNKNOWN, 0, "", "", Arg::Unknown,
-     "USAGE: marlinfeed [options] [<infile> ...] <printdev>\n\n"
+     "USAGE: marlinfeed [options] [<infile> ...] <printdev>\n"
+     "       marlinfeed [options] --api=<base-url> --printer=<printdev> ... [<dir>]\n\n"
      "Reads all <infile> in order and sends the contained GCODE to device <printdev> "
      "which must be compatible with Marlin's serial port protocol.\n"
-     "<printdev> can be either a TTY or a Unix Domain Socket.\n"
+     "<printdev> can be either a TTY or a Unix Domain Socket. A printer whose TTY changes its name (e.g. "
+     "ttyUSB1 instead of ttyUSB0 after a reset) can be specified as a directory (usually under /sys) to search for the "
+     "first ttyUSB* or ttyACM* (e.g. /sys/bus/usb-serial), as usb:<vendor>:<product> or as usb:<serial>. "
+     "marlinfeed reconnects as soon as the printer's device (re)appears.\n"
      "Pass '-' or '/dev/stdin' as <infile> to read from stdin.\n"
      "If an <infile> is a directory, it will be watched for "
      "new/modified gcode files that will automatically be printed. Files with a timestamp "
@@ -71,6 +101,12 @@ const option::Descriptor usage[] = {
      "directory in the <infile> ... list. If no directories are listed, a temporary directory under /tmp "
      "will be created and used.\n"
      "\n"
+     "Multiple printers:\n"
+     "If --printer is used, a single Marlinfeed serves all printers passed with --printer on one API port. "
+     "The printers are numbered in order starting with 1 and the API of printer <n> is <base-url>/<n>/api . "
+     "Each printer is driven by its own process. If a <dir> is passed, printer <n> watches and uploads to "
+     "the subdirectory <dir>/<n>, which is created if necessary.\n"
+     "\n"
      "Security:\n"
      "Marlinfeed offers no access control features other than the --localhost switch. To make Marlinfeed "
      "available over an insecure network, use something like haproxy(1). A very good authentication "
@@ -99,6 +135,53 @@ const option::Descriptor usage[] = {
      "  \tHow to handle an error on <infile> or <printdev>.\v'next' reinitializes communication with"
      " the printer and then tries to print the next <infile> in order.\v"
      "'quit' terminates the program.\vThe default is 'quit' if not listening on a port and 'next' if listening."},
+    {PRINTER, 0, "", "printer", Arg::Required,
+     " \t--printer=<printdev>  \tAdd <printdev> to the printers served via --api (see \"Multiple printers\" above). "
+     "Can be used multiple times. No <printdev> is passed as non-option argument in this mode."},
+    {JOURNAL, 0, "", "journal", Arg::Required,
+     " \t--journal=<file>  \tRecord the queue of print jobs in <file> so that it survives a restart. Defaults to "
+     "<dir>/.marlinfeed-journal where <dir> is the upload directory. With --printer, printer <n> uses <file>.<n> ."},
+    {RESUME, 0, "", "resume", Arg::None,
+     " \t--resume  \tIf a print was interrupted because Marlinfeed died or the connection to the printer was lost, "
+     "continue it where it stopped. The printer is heated up again and X and Y are re-homed. Requires a journal "
+     "(see --journal). The progress of prints is recorded in the journal file name with '.checkpoint' appended."},
+    {COMPRESS, 0, "", "compress", Arg::Compression,
+     " \t--compress=<prog>  \tStore uploaded files compressed with <prog>, which is either 'gzip' or 'zstd'. "
+     "Files that are uploaded already compressed are stored as they are. Files ending in .gcode.gz and "
+     ".gcode.zst are always decompressed on the fly while printing."},
+    {RETAIN, 0, "", "retain", Arg::NumberPair,
+     " \t--retain=<megabytes>,<files>  \tLimit the upload directory to <megabytes> MiB and <files> GCODE files "
+     "(0 means no limit) by deleting the files that have gone unprinted for the longest time. The file being "
+     "printed, queued files and the last printed file are never deleted. The directory is checked every few seconds."},
+    {MEATPACK, 0, "", "meatpack", Arg::None,
+     " \t--meatpack  \tCompress the GCODE sent to the printer with the MeatPack protocol if the firmware supports "
+     "it (Marlin built with MEATPACK). This almost doubles the number of commands per second a slow serial link "
+     "can carry."},
+    {SD, 0, "", "sd", Arg::None,
+     " \t--sd  \tIf the firmware supports it (Marlin built with BINARY_FILE_TRANSFER), transfer each job to the "
+     "printer's SD card with the binary protocol (compressed if possible) and print it from there, so that the "
+     "serial link no longer limits the speed. The printer heats up during the transfer. The files on the SD card "
+     "are named MFxxxxxx.GCO and deleted after the print."},
+    {BUFSIZE, 0, "", "bufsize", Arg::Numeric,
+     " \t--bufsize=<bytes>  \tThe size of the printer's serial receive buffer (Marlin's RX_BUFFER_SIZE plus "
+     "what the USB interface buffers). Defaults to 128, which is safe for every printer. A larger value lets more "
+     "commands be on their way to a fast board. With this option lines are numbered continuously instead of "
+     "starting over at 0 after every 99 lines. The value is remembered in the printer's profile (see --profiles)."},
+    {PROFILES, 0, "", "profiles", Arg::Required,
+     " \t--profiles=<dir>  \tStore what marlinfeed learns about each printer in a file in <dir> named after the "
+     "printer's USB serial number (or the device path). The capabilities the printer reports in its reply to M115 "
+     "are checked on every connection and decide which protocol features are used. Defaults to "
+     "<dir>/.marlinfeed-profiles where <dir> is the upload directory."},
+    {BAUD, 0, "", "baud", Arg::Baud,
+     " \t--baud=<rate>|auto  \tThe speed of the serial line to the printer in bits/s. Any rate the serial "
+     "driver supports can be used, including 250000 and 1000000. 'auto' tries common rates until the printer "
+     "answers. The rate is remembered in the printer's profile. Without this option the remembered rate is used or, "
+     "if there is none, the rate is detected automatically."},
+    {LOWLATENCY, 0, "", "low-latency", Arg::None,
+     " \t--low-latency  \tPut the serial port into low latency mode and set the latency timer of USB serial "
+     "adapters that have one (e.g. FTDI, which by default hold back received data for up to 16ms) to 1ms, so "
+     "that each 'ok' arrives without delay. Changing the latency timer usually requires root. The time the "
+     "printer takes to answer is measured and reported before and after."},
     {UNKNOWN, 0, "", "", Arg::None,
      "\nExamples:\n"
      "  marlinfeed gcode/init.gcode gcode/benchy.gcode /dev/ttyUSB0 \n"
@@ -109,28 +192,16 @@ const option::Descriptor usage[] = {
      "  marlinfeed --localhost --api=https://my-printer /dev/ttyUSB0 \n"
      "      listens for localhost connections on port 8080. Needs some form of proxy to implement TLS.\n\n"
      "  marlinfeed -p 6000 --api=https://my-printer:443/ /var/cache/marlinfeed /dev/ttyUSB0 \n"
-     "      listens for connections on port 6000. Needs some form of proxy.\n"
+     "      listens for connections on port 6000. Needs some form of proxy.\n\n"
+     "  marlinfeed --api=http://my-farm:8080 --printer=/dev/ttyUSB0 --printer=/dev/ttyUSB1 /var/cache/marlinfeed\n"
+     "      serves printer 1 as http://my-farm:8080/1 and printer 2 as http://my-farm:8080/2 .\n"
      "\n"},
     {0, 0, 0, 0, 0, 0}};
 
 const char* NEW_SOCKET_CONNECTION = "New socket connection => Handled by child with PID %d\n";
 
-// Cooldown code sent to the printer when a print is aborted or when a shutdown is
-// scheduled. The nozzle needs to be cooled down before turning off the printer
-// because otherwise heat creep can cause filament above the heat break to melt
-// which can clog the nozzle if the fan is turned off suddenly.
-// The bed temperature is intentionally not touched in this code because it is
-// not relevant to the safety of turning off the power and keeping the bed warm
-// between prints reduces the startup time significantly on printers with weak
-// heaters.
-const char* COOLDOWN_GCODE = "M108\nM104 S0\nM105\n";
-
-// Code sent when hard reconnecting to printer to stop any pending SD card print.
-const char* STOP_SD_PRINT_GCODE = "M524\n";
-
-// Code to lift the nozzle a bit sent after a print is aborted to prevent the
-// hot nozzle melting into the aborted print.
-const char* LIFT_NOZZLE_GCODE = "G91\nG0 Z10\nG90\n";
+// Start of the names of the files that --sd puts on the printer's SD card.
+const char* SD_PREFIX = "MF";
 
 // We use this as dummy infile if we want to run through the print loop to process
 // injected commands. Reading from /dev/null always gives EOF.
@@ -151,8 +222,54 @@ const int MAX_TIME_SILENCE = 120000;
 // Stalled. This indicates a long running command like G28.
 const int STALL_TIME = 2000;
 
+// After an Error or Resend from the printer we hold back further commands for this
+// number of milliseconds to give the printer time to send more errors if any, so
+// that we don't start sending too early and trigger more errors.
+const int ERROR_SETTLE_TIME = 100;
+
+// While no print is active, the temperatures are polled every TEMP_POLL_FAST
+// milliseconds if the API has been used within the last API_ACTIVE_TIME
+// milliseconds and every TEMP_POLL_SLOW milliseconds if it has been used within
+// API_IDLE_TIME. If nobody has used the API for longer, the printer is left alone.
+const int TEMP_POLL_FAST = 2000;
+const int TEMP_POLL_SLOW = 10000;
+const int API_ACTIVE_TIME = 10000;
+const int API_IDLE_TIME = 60000;
+
+// Interval in seconds of the temperature auto-reporting (M155) enabled when a
+// job starts.
+const int PRINT_AUTOREPORT_SECONDS = 2;
+
+// Interval in milliseconds in which the print progress checkpoint is flushed to disk.
+const int CHECKPOINT_INTERVAL = 1000;
+
+// Number of lines handle() remembers the checkpoint record for. Must be larger
+// than the number of lines that can be waiting for ack in MarlinBuf, which is
+// less than its buffer size. See checkpoint_ring().
+const int CHECKPOINT_RING = 128;
+
+// Smallest --bufsize accepted. Lines longer than what fits into the buffer can
+// not be sent at all.
+const int MIN_BUFSIZE = 64;
+
+// Ids of the timers used by handle().
+enum TimerId
+{
+    ERROR_TIMEOUT,     // MAX_TIME_WITH_ERROR passed without a non-error reply
+    SILENCE_TIMEOUT,   // MAX_TIME_SILENCE passed without a message while waiting for ack
+    STALL_TIMEOUT,     // STALL_TIME passed without an ok
+    ERROR_SETTLE,      // ERROR_SETTLE_TIME passed since the last Error or Resend
+    ABORT_DONE,        // the abort sequence has been sent and the printer had time to process it
+    SCHEDULED_COMMAND, // timer of a CommandScheduler entry
+    TEMP_POLL,         // time for the next idle temperature poll
+    JOURNAL_SYNC,      // time to write the job journal to disk
+    CHECKPOINT_FLUSH,  // time to write the print progress checkpoint to disk
+    RETENTION_CHECK    // time to check the upload directory against the --retain budget
+};
+
 bool ioerror_next;
 char* lastPrintedFile = 0;
+int64_t job_bytes_read = 0; // number of bytes handle() has read from the current infile
 int verbosity = 0;
 
 // 0: normal operation
@@ -163,8 +280,9 @@ int verbosity = 0;
 // 3: immediate shutdown
 volatile sig_atomic_t shutdown_level = 0;
 
-bool handle(File& out, File& serial, const char* infile, File* sock, const char** e, int* iop);
+bool handle(File& out, File& serial, const char* infile, File* sock, const char** e, int* iop, bool resume = false);
 void handle_socket_connection(int fd);
+void api_not_found(int fd);
 void socketTest();
 
 // FIFO::filter() for removing file names with no known GCODE extension
@@ -172,12 +290,8 @@ struct GCodeExtension
 {
     bool operator()(char* s)
     {
-        char* ext = strrchr(s, '.');
-        if (ext != 0)
-        {
-            if (strcmp(".gcode", ext) == 0)
-                return true;
-        }
+        if (Codec::isGCodeName(s))
+            return true;
         free(s);
         return false;
     }
@@ -523,15 +637,66 @@ bool isPrintLastFileRequested() { return (interrupt & 8) != 0; }
 
 File out("stdout", 1);
 
+// All timeouts of the main process are scheduled on this wheel. Every poll()
+// uses timers.timeout() so that no timeout needs to be checked in a busy loop.
+TimerWheel timers(millis());
+
+// GCODE the main process sends to the printer by itself (e.g. the cooldown
+// before shutdown) is scheduled here rather than injected by helper processes.
+CommandScheduler scheduler(timers, SCHEDULED_COMMAND);
+
+// Files waiting to be printed. API child processes add to it via the journal.
+JobQueue jobs(timers, JOURNAL_SYNC);
+
+// Progress of the current print. Only recorded if there is a journal.
+Checkpoint checkpoint;
+
+// The files in upload_dir for GET /api/files.
+FileIndex files;
+
+// Enforces --retain on upload_dir.
+Retention retention(timers, RETENTION_CHECK);
+
+// Returns true if the contents of the file at path must not change because
+// it is printing, queued or the file an interrupted print would resume.
+bool file_pinned(const char* path)
+{
+    if (checkpoint.interrupted() && strcmp(checkpoint.path(), path) == 0)
+        return true;
+    return jobs.references(path);
+}
+
+// Retention::InUse: the pinned files and the last one printed (which SIGHUP reprints).
+bool file_in_use(const char* path)
+{
+    if (lastPrintedFile != 0 && strcmp(lastPrintedFile, path) == 0)
+        return true;
+    return file_pinned(path);
+}
+
+// true if --resume is in effect.
+bool resume_enabled = false;
+
+// Returns true if an interrupted print should be continued before anything else.
+bool resume_pending() { return resume_enabled && shutdown_level == 0 && checkpoint.interrupted(); }
+
 const char* api_base_url = 0;
 const char* upload_dir = 0;
+
+// Compression for storing uploaded files (--compress).
+Codec::Type upload_compression = Codec::NONE;
 int cmd_inject[2]; // socketpair, cmd_inject[0] is the write end for child processes
 gcode::Reader* inject_in;
 
+// Commands read from inject_in that wait for their turn to go into MarlinBuf.
+// Emergency commands skip the queue (see next_emergency()).
+FIFO<gcode::Line> injected;
+
 pid_t MainProcess = getpid();
 
 int injecting_cooldown = 0;
-// Fork a process that continually injects COOLDOWN_GCODE in 1s intervals.
+int cooldown_id = 0; // scheduler id of the periodic COOLDOWN_GCODE
+// Schedule COOLDOWN_GCODE to be sent to the printer in 1s intervals.
 // This serves the dual purpose of updating the temperature readings so
 // that printerState.readyForShutdown() knows if the printer is cooled off.
 void inject_cooldown()
@@ -539,20 +704,1012 @@ void inject_cooldown()
     if (verbosity > 0)
         fprintf(stdout, "Waiting for printer to cool down\n");
     injecting_cooldown = 1;
-    if (fork() == 0)
+    cooldown_id = schedule_cooldown(scheduler, millis());
+}
+
+// Passes all expired timers to the scheduler and the job queue. Only to be used
+// outside of handle() because handle() has timers of its own. The only other timer
+// that can expire here is temp_poll_timer, which poll_temperature_idle() checks by itself.
+void fire_idle_timers()
+{
+    for (TimerWheel::Timer* t; 0 != (t = timers.expire(millis()));)
+        if (!scheduler.fire(t, millis()) && !retention.fire(t))
+            jobs.fire(t);
+}
+
+int64_t last_api_request = 0; // millis() when the last API connection was accepted; 0 if none, yet
+
+// true if the printer has reported Cap:AUTOREPORT_TEMP:1 in response to M115,
+// i.e. it supports M155.
+bool autoreport_temp = false;
+
+// true if M115 has been sent to the printer since the connection was established.
+bool capabilities_queried = false;
+
+// The M155 interval in seconds last sent to the printer. 0 if auto-reporting is off.
+int autoreport_seconds = 0;
+
+// Scheduled while waiting for the next idle temperature poll.
+TimerWheel::Timer temp_poll_timer(TEMP_POLL);
+
+// true if --meatpack is in effect.
+bool meatpack_enabled = false;
+
+// 1 if the printer has answered a MeatPack query since the connection was
+// established, -1 if it has not, 0 if it hasn't been asked, yet.
+int meatpack_support = 0;
+
+// Milliseconds to wait for the printer's reply to a MeatPack command.
+const int MEATPACK_TIMEOUT = 1000;
+
+// true if --sd is in effect.
+bool sd_enabled = false;
+
+// The argument of --bufsize or the buffer size from the profile; 0 if neither.
+int printer_bufsize = 0;
+
+// Finds the printer's device.
+DeviceFinder finder;
+
+// The line number the printer expects next if handle() has left the link to
+// the printer in sync (all lines acknowledged, no reset since), so that the
+// next handle() can continue numbering without a handshake. -1 otherwise.
+int32_t link_line = -1;
+
+// Number of oks the printer still owes for commands sent without line number
+// (queries, temperature polls, the handshake). See await_oks().
+int oks_owed = 0;
+
+// What we know about the printer. See --profiles.
+PrinterProfile profile;
+
+// Speed of the serial line. 0 means it needs to be detected. See --baud.
+int baud_rate = 0;
+
+// The argument of --bufsize; 0 if not given.
+int bufsize_arg = 0;
+
+// The argument of --baud; 0 for "auto", -1 if not given.
+int baud_arg = -1;
+
+// Sets printer_bufsize and baud_rate from the profile, except for those given
+// on the command line, which are stored in the profile instead.
+void use_profile()
+{
+    if (bufsize_arg > 0)
+    {
+        printer_bufsize = bufsize_arg;
+        if (profile.setBufSize(printer_bufsize))
+            profile.save();
+    }
+    else
+        printer_bufsize = (profile.bufSize() >= MIN_BUFSIZE) ? profile.bufSize() : 0;
+
+    if (baud_arg > 0)
+    {
+        baud_rate = baud_arg;
+        if (profile.setBaud(baud_rate))
+            profile.save();
+    }
+    else
+        baud_rate = (baud_arg == 0) ? 0 : profile.baud();
+}
+
+// true if --low-latency has been passed.
+bool low_latency = false;
+
+// Number of commands sent by ok_latency().
+const int OK_LATENCY_PINGS = 5;
+
+// Baud rate used if detection fails.
+const int DEFAULT_BAUD_RATE = 115200;
+
+// The rates tried by detect_baud(), most common first.
+const int BAUD_CANDIDATES[] = {115200, 250000, 1000000, 500000, 230400, 2000000, 57600};
+
+// Milliseconds to wait for an answer at each candidate rate. Boards that reset
+// when the port is opened need most of this to greet us.
+const int BAUD_PROBE_TIMEOUT = 2500;
+
+// 1 if the printer has reported Cap:BINARY_FILE_TRANSFER:1 since the connection
+// was established, -1 if it has not, 0 if it hasn't been asked, yet.
+int binary_transfer_support = 0;
+
+// Milliseconds to wait for the printer's reply to M115.
+const int QUERY_TIMEOUT = 1000;
+
+// Milliseconds to wait for the printer's reply to M27 C. A printer that is
+// printing from SD card only answers after the moves it has already buffered.
+const int SD_QUERY_TIMEOUT = 10000;
+
+// Maximum number of lines at the start of a file searched for the temperatures
+// that the printer heats up to while the file is transferred to the SD card.
+const int PREHEAT_SCAN_LINES = 1000;
+
+// Must be called after the printer has been (re)connected in a way that may have
+// reset it.
+void forget_printer_capabilities()
+{
+    autoreport_temp = false;
+    capabilities_queried = false;
+    autoreport_seconds = 0;
+    meatpack_support = 0;
+    binary_transfer_support = 0;
+}
+
+// Sends MeatPack command c to the printer and waits for the state report.
+// Returns false if there is none. Otherwise *active tells if packing is on
+// according to the last report (an earlier one may be left over from a
+// previous command). Must only be called while the printer owes us no reply.
+bool meatpack_command(File& serial, MeatPack::Command c, bool* active)
+{
+    // The '\n' terminates the garbage line a printer without MeatPack sees. It
+    // must not follow commands that switch packing on.
+    char cmd[4];
+    MeatPack::command(c, cmd);
+    cmd[3] = '\n';
+    serial.action("sending MeatPack command");
+    serial.setNonBlock(false);
+    if (!serial.writeAll(cmd, (c == MeatPack::QUERY_CONFIG) ? 4 : 3))
+        return false;
+    serial.setNonBlock(true);
+
+    // Read until a report is complete. A printer without MeatPack has said
+    // what it has to say once it has been quiet for 100ms.
+    char buf[1024];
+    int n = 0;
+    char* report = 0; // e.g. "[MP] PV01 ON ESP"
+    int64_t deadline = millis() + MEATPACK_TIMEOUT;
+    for (;;)
+    {
+        int left = deadline - millis();
+        if (left <= 0)
+            break;
+        if (n == sizeof(buf) - 1) // full => keep the incomplete line only
+        {
+            char* eol = strrchr(buf, '\n');
+            int keep = (eol == 0) ? 0 : buf + n - (eol + 1);
+            memmove(buf, buf + n - keep, keep);
+            n = keep;
+        }
+        int got = serial.tail(buf + n, sizeof(buf) - 1 - n, 0, left, (n == 0) ? left : 100);
+        if (got < 0)
+            return false;
+        buf[n + got] = 0;
+        if (verbosity > 1)
+            out.writeAll(buf + n, got);
+        n += got;
+        for (char* r = strstr(buf, "[MP] "); r != 0; r = strstr(r + 1, "[MP] "))
+            if (strchr(r, '\n') != 0)
+                report = r;
+        if (report != 0 || got == 0)
+            break;
+    }
+    if (report == 0)
+        return false;
+    *strchr(report, '\n') = 0;
+    *active = strstr(report, " ON") != 0;
+    return true;
+}
+
+// Switches the printer to MeatPack if --meatpack is in effect and the printer
+// supports it. Returns true if everything sent to the printer from now on has
+// to be packed.
+bool start_meatpack(File& serial)
+{
+    if (!meatpack_enabled || meatpack_support < 0)
+        return false;
+    bool active = false;
+    if (meatpack_support == 0)
+    {
+        meatpack_support = meatpack_command(serial, MeatPack::QUERY_CONFIG, &active) ? 1 : -1;
+        if (meatpack_support < 0)
+        {
+            fprintf(stderr, "Printer does not support MeatPack\n");
+            return false;
+        }
+    }
+    if (!active && !meatpack_command(serial, MeatPack::ENABLE_PACKING, &active))
+        return false;
+    if (verbosity > 0 && active)
+        fprintf(stdout, "MeatPack enabled\n");
+    return active;
+}
+
+// Switches MeatPack off again when handle() returns, so that the printer gets
+// plain text between prints (e.g. temperature polls). If handle() leaves the
+// link in sync, the printer's state report is read, so that the next handle()
+// does not take it for the reply to its own MeatPack command. If that fails,
+// the next handle() does a handshake, which discards it.
+struct MeatPackGuard
+{
+    File& serial;
+    bool active;
+    ~MeatPackGuard()
+    {
+        if (!active)
+            return;
+        if (link_line < 0)
+        {
+            char cmd[3];
+            MeatPack::command(MeatPack::DISABLE_PACKING, cmd);
+            serial.setNonBlock(false);
+            serial.writeAll(cmd, 3);
+        }
+        else if (!meatpack_command(serial, MeatPack::DISABLE_PACKING, &active) || active)
+            link_line = -1;
+    }
+};
+
+// Writes len bytes of gcode to the printer, packed if packing is true.
+// Returns the number of bytes that went over the wire.
+int send_gcode(File& serial, const char* gcode, int len, bool packing)
+{
+    if (!packing)
+    {
+        serial.writeAll(gcode, len);
+        return len;
+    }
+    char buf[1024];
+    int max = MeatPack::maxPackedLength(len);
+    char* packed = (max <= (int)sizeof(buf)) ? buf : (char*)malloc(max);
+    int n = MeatPack::pack(gcode, len, packed);
+    serial.writeAll(packed, n);
+    if (packed != buf)
+        free(packed);
+    return n;
+}
+
+// Writes the emergency command of len bytes at gcode to the printer. Firmware
+// with EMERGENCY_PARSER looks for it before MeatPack unpacks the data, so it
+// goes over the wire as plain text even if packing is true.
+void send_emergency(File& serial, const char* gcode, int len, bool packing)
+{
+    if (!packing)
+    {
+        serial.writeAll(gcode, len);
+        return;
+    }
+    char buf[1024];
+    int max = len + MeatPack::PLAIN_OVERHEAD;
+    char* plain = (max <= (int)sizeof(buf)) ? buf : (char*)malloc(max);
+    serial.writeAll(plain, MeatPack::plain(gcode, len, plain));
+    if (plain != buf)
+        free(plain);
+}
+
+// Reads the commands available from inject_in and queues them in injected,
+// except for the next emergency command (M112, M108, M410), which is returned
+// instead (0 if there is none). Emergency commands are to be written to the
+// printer right away without line number, so that firmware with
+// EMERGENCY_PARSER acts on them even while its buffer is full of moves. buf
+// is told about them so that their ok does not release a line that is still
+// waiting for it.
+gcode::Line* next_emergency(MarlinBuf& buf)
+{
+    for (gcode::Line* line; 0 != (line = inject_in->next());)
+    {
+        if (line->isEmergency() && profile.capability(PrinterProfile::EMERGENCY_PARSER) >= 0 &&
+            buf.outOfBand(line->length()))
+            return line;
+        injected.put(line);
+    }
+    return 0;
+}
+
+// Sets up buf for the printer according to --bufsize.
+void configure(MarlinBuf& buf)
+{
+    if (printer_bufsize > 0)
+    {
+        buf.setBufSize(printer_bufsize);
+        buf.setWideNumbers(true);
+    }
+}
+
+// The longest command that can be sent to the printer. See MarlinBuf::maxCommandLen().
+int max_command_len()
+{
+    MarlinBuf buf;
+    configure(buf);
+    return buf.maxCommandLen();
+}
+
+// The number of entries handle() needs for remembering checkpoint records.
+int checkpoint_ring() { return (printer_bufsize > CHECKPOINT_RING) ? printer_bufsize : CHECKPOINT_RING; }
+
+// Returns the number of complete lines in text that start with "ok".
+int count_oks(const char* text)
+{
+    int oks = 0;
+    for (const char* line = text; *line != 0;)
+    {
+        const char* eol = strchr(line, '\n');
+        if (eol == 0)
+            break;
+        if (line[0] == 'o' && line[1] == 'k' && line[2] <= ' ')
+            oks++;
+        line = eol + 1;
+    }
+    return oks;
+}
+
+// Counts the oks in the complete lines of text against oks_owed.
+void got_oks(const char* text)
+{
+    oks_owed -= count_oks(text);
+    if (oks_owed < 0)
+        oks_owed = 0;
+}
+
+// Reads the printer's reply to the connection handshake into buf (size bytes,
+// 0-terminated, older data discarded if it gets full) and sets *n to its length.
+// Returns 1 as soon as a line starting with "ok" is complete, 2 for a line
+// "start" (the printer has just reset and probably lost what we sent), 0 if
+// deadline (see millis()) passes first and -1 on error.
+int read_handshake(File& serial, char* buf, int size, int* n, int64_t deadline)
+{
+    *n = 0;
+    buf[0] = 0;
+    int scan = 0; // start of the first line not checked, yet
+    for (;;)
+    {
+        int left = deadline - millis();
+        if (left <= 0)
+            return 0;
+        if (*n == size - 1) // full => keep the incomplete line only
+        {
+            *n -= scan;
+            memmove(buf, buf + scan, *n);
+            scan = 0;
+            if (*n == size - 1)
+                *n = 0;
+        }
+        int got = serial.tail(buf + *n, size - 1 - *n, 0, left, left);
+        if (got < 0)
+            return -1;
+        *n += got;
+        buf[*n] = 0;
+        for (char* eol; 0 != (eol = strchr(buf + scan, '\n')); scan = eol + 1 - buf)
+        {
+            const char* line = buf + scan;
+            if (line[0] == 'o' && line[1] == 'k' && line[2] <= ' ')
+                return 1;
+            if (strncmp(line, "start", 5) == 0 && line[5] <= ' ')
+                return 2;
+        }
+        if (got == 0 && serial.EndOfFile())
+            return 0;
+    }
+}
+
+// Waits until the printer has sent the oks it owes for commands without line
+// number (see oks_owed), so that none of them is taken for the ack of a
+// numbered line. Returns false if the printer resets or does not send one of
+// them within QUERY_TIMEOUT. oks_owed is 0 afterwards in any case.
+bool await_oks(File& serial)
+{
+    serial.action("waiting for printer to acknowledge");
+    while (oks_owed > 0)
+    {
+        char buf[2048];
+        int n;
+        int reply = read_handshake(serial, buf, sizeof(buf), &n, millis() + QUERY_TIMEOUT);
+        if (verbosity > 1)
+            out.writeAll(buf, n);
+        if (reply != 1)
+        {
+            oks_owed = 0;
+            return false;
+        }
+        got_oks(buf);
+    }
+    return true;
+}
+
+// Sends query to the printer and returns what the printer replies (malloc()ed).
+// The reply is read until it contains an ok and, if until is not 0, a complete
+// line containing until. This is for queries that a busy printer only answers
+// after the commands that are already in its buffer. query is one command
+// without line number. If its ok does not arrive in time, it is counted in
+// oks_owed.
+char* query_printer(File& serial, const char* query, const char* until = 0, int timeout = QUERY_TIMEOUT)
+{
+    serial.action("querying printer");
+    serial.setNonBlock(false);
+    if (!serial.writeAll(query, strlen(query)))
+        return strdup("");
+    serial.setNonBlock(true);
+    oks_owed++;
+
+    char buf[4096];
+    int n = 0;
+    int scan = 0; // start of the first line that has not been checked for ok
+    bool ok = false;
+    int64_t deadline = millis() + timeout;
+    for (;;)
+    {
+        int left = deadline - millis();
+        if (left <= 0)
+            break;
+        int got = serial.tail(buf + n, sizeof(buf) - 1 - n, 100, left, left);
+        if (got < 0)
+            break;
+        n += got;
+        buf[n] = 0;
+        char* eol = strrchr(buf + scan, '\n');
+        if (eol != 0)
+        {
+            char c = eol[1];
+            eol[1] = 0;
+            ok |= count_oks(buf + scan) > 0;
+            got_oks(buf + scan);
+            eol[1] = c;
+            scan = eol + 1 - buf;
+        }
+        const char* found = (until == 0) ? buf : strstr(buf, until);
+        if (ok && found != 0 && (until == 0 || strchr(found + strlen(until), '\n') != 0))
+            break;
+        if (n > (int)sizeof(buf) / 2) // keep the most recent half (chatty printer)
+        {
+            int keep = sizeof(buf) / 4;
+            memmove(buf, buf + n - keep, keep);
+            scan = (scan > n - keep) ? scan - (n - keep) : 0;
+            n = keep;
+        }
+    }
+    buf[n] = 0;
+    if (verbosity > 1)
+        out.writeAll(buf, n);
+    return strdup(buf);
+}
+
+// Tries the BAUD_CANDIDATES on the TTY serial until the printer answers M110
+// with "ok" or greets us with "start" after a reset. On success the rate is
+// stored in baud_rate and the profile. Otherwise serial is left at
+// DEFAULT_BAUD_RATE.
+void detect_baud(File& serial)
+{
+    for (unsigned i = 0; i < sizeof(BAUD_CANDIDATES) / sizeof(BAUD_CANDIDATES[0]); i++)
+    {
+        int rate = BAUD_CANDIDATES[i];
+        if (!serial.setupTTY(rate))
+        {
+            if (verbosity > 1)
+                fprintf(stderr, "%s\n", serial.error());
+            serial.clearError();
+            continue;
+        }
+        if (verbosity > 1)
+            fprintf(stdout, "Trying %d baud\n", rate);
+
+        // At the wrong rate we get garbage, which won't have lines starting like this.
+        char* reply = query_printer(serial, "\nM110 N0\n", "ok", BAUD_PROBE_TIMEOUT);
+        bool found = false;
+        for (const char* line = reply; !found && line != 0; line = strchr(line, '\n'))
+        {
+            line += (*line == '\n');
+            found = (strncmp(line, "ok", 2) == 0 || strncmp(line, "start", 5) == 0);
+        }
+        free(reply);
+        if (found)
+        {
+            if (verbosity > 0)
+                fprintf(stdout, "Printer answers at %d baud\n", rate);
+            baud_rate = rate;
+            if (profile.setBaud(rate))
+                profile.save();
+            return;
+        }
+    }
+
+    fprintf(stderr, "Could not detect the printer's baud rate => Using %d\n", DEFAULT_BAUD_RATE);
+    serial.setupTTY(DEFAULT_BAUD_RATE);
+}
+
+// Sends OK_LATENCY_PINGS harmless commands to the printer, each after the
+// previous one has been acknowledged, and returns the shortest time in
+// microseconds from sending a command to receiving its "ok". Returns -1 if the
+// printer does not answer within QUERY_TIMEOUT, in which case the ok is
+// counted in oks_owed.
+int64_t ok_latency(File& serial)
+{
+    if (!await_oks(serial)) // an ok still on its way would spoil the measurement
+        return -1;
+    serial.action("measuring printer latency");
+    int64_t best = -1;
+    for (int i = 0; i < OK_LATENCY_PINGS; i++)
+    {
+        char buf[1024];
+        int n;
+        int64_t start = micros();
+        if (!serial.writeAll("M105\n", 5))
+            return -1;
+        oks_owed++;
+        int reply = read_handshake(serial, buf, sizeof(buf), &n, millis() + QUERY_TIMEOUT);
+        if (reply == 2) // the printer has reset and owes us nothing
+            oks_owed = 0;
+        if (reply != 1)
+            return -1;
+        got_oks(buf);
+        int64_t latency = micros() - start;
+        if (best < 0 || latency < best)
+            best = latency;
+    }
+    return best;
+}
+
+// Switches the TTY serial to low latency mode and reports the effect.
+// Must only be called while the printer owes us no reply.
+void reduce_latency(File& serial)
+{
+    int64_t before = ok_latency(serial);
+    bool changed = serial.setLowLatency();
+    int64_t after = ok_latency(serial);
+    serial.clearError();
+    if (!changed)
+        fprintf(stderr, "Could not switch the serial port to low latency mode\n");
+    if (verbosity > 0 && before >= 0 && after >= 0)
+        fprintf(stdout, "Printer answers in %.1fms (before low latency mode: %.1fms)\n", after / 1000.0,
+                before / 1000.0);
+}
+
+// Returns true if the printer supports Marlin's binary file transfer. Must only
+// be called while the printer owes us no reply.
+bool binary_transfer_available(File& serial)
+{
+    if (binary_transfer_support == 0)
+    {
+        char* reply = query_printer(serial, "M115\n");
+        binary_transfer_support = (strstr(reply, "Cap:BINARY_FILE_TRANSFER:1") != 0) ? 1 : -1;
+        free(reply);
+    }
+    if (binary_transfer_support < 0)
+        fprintf(stderr, "Printer does not support binary file transfer => Streaming instead of printing from SD\n");
+    return binary_transfer_support > 0;
+}
+
+// Stores in name (at least 13 bytes) the 8.3 name under which --sd puts infile
+// with st_mtime mtime on the SD card. A changed file gets a different name.
+void sd_file_name(const char* infile, int64_t mtime, char* name)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const char* p = infile; *p != 0; p++)
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    for (int i = 0; i < 8; i++)
+        h = (h ^ (uint8_t)(mtime >> (8 * i))) * 16777619u;
+    snprintf(name, 13, "%s%06X.GCO", SD_PREFIX, (unsigned)(h & 0xFFFFFF));
+}
+
+// Returns true if the printer has file name open for printing from SD card.
+// Must only be called while the printer owes us no reply.
+bool sd_printing_file(File& serial, const char* name)
+{
+    char* reply = query_printer(serial, "M27 C\n", "Current file:", SD_QUERY_TIMEOUT);
+    const char* cur = strstr(reply, "Current file: ");
+    bool printing = cur != 0 && strncasecmp(cur + 14, name, strlen(name)) == 0;
+    free(reply);
+    return printing;
+}
+
+// Returns the state at the first move of infile, i.e. the temperatures that its
+// start GCODE sets.
+ModalState preheat_state(const char* infile)
+{
+    ModalState state;
+    File f(infile);
+    if (!f.open(O_RDONLY))
+        return state;
+    Codec::Type codec = Codec::fromName(infile);
+    if (codec != Codec::NONE && !Codec::decompress(f, codec))
+        return state;
+    f.setNonBlock(false);
+    gcode::Reader reader(f);
+    reader.whitespaceCompression(1);
+    for (int i = 0; i < PREHEAT_SCAN_LINES; i++)
+    {
+        gcode::Line* line = reader.next();
+        if (line == 0)
+            break;
+        bool move = line->startsWith("G0\b") || line->startsWith("G1\b");
+        state.update(*line);
+        delete line;
+        if (move)
+            break;
+    }
+    return state;
+}
+
+// Transfers infile to the printer's SD card as name with Marlin's binary
+// protocol. Before that the printer is told to heat up to the temperatures of
+// infile's start GCODE without waiting for them, so heating and transfer overlap.
+// Returns 0 on success or an error message. Must only be called while the
+// printer owes us no reply.
+const char* sd_upload(File& serial, gcode::Reader& serial_in, const char* infile, const char* name)
+{
+    ModalState preheat = preheat_state(infile);
+    char heat[64];
+    int n = 0;
+    heat[0] = 0;
+    if (preheat.bed > 0)
+        n += snprintf(heat + n, sizeof(heat) - n, "M140 S%g\n", preheat.bed);
+    if (preheat.hotend > 0)
+        snprintf(heat + n, sizeof(heat) - n, "M104 S%g\n", preheat.hotend);
+
+    File src(infile);
+    src.action("reading source gcode");
+    if (!src.open(O_RDONLY))
+        return "Cannot open file for transfer to SD card";
+    Codec::Type codec = Codec::fromName(infile);
+    if (codec != Codec::NONE && !Codec::decompress(src, codec))
+        return "Cannot start decompressor";
+    src.setNonBlock(false);
+
+    int64_t start = millis();
+    int64_t size = 0;
+    BinaryTransfer transfer(serial, serial_in);
+    serial.action("transferring file to SD card");
+    if (!transfer.connect(heat) || !transfer.open(name, true))
+        return transfer.error();
+    char buf[16384];
+    for (;;)
+    {
+        n = src.read(buf, sizeof(buf));
+        if (n < 0)
+        {
+            static char err[512]; // src goes away
+            snprintf(err, sizeof(err), "%s", src.error());
+            return err;
+        }
+        if (n == 0)
+            break;
+        if (!transfer.write(buf, n))
+            return transfer.error();
+        size += n;
+    }
+    if (!transfer.close() || !transfer.disconnect())
+        return transfer.error();
+
+    if (verbosity > 0)
+    {
+        int64_t dt = millis() - start;
+        fprintf(stdout, "Transferred '%s' to SD card as %s: %lld bytes (%lld over the wire%s) in %.1fs\n", infile,
+                name, (long long)size, (long long)transfer.wireBytes(), transfer.compressed() ? ", compressed" : "",
+                dt / 1000.0);
+    }
+    return 0;
+}
+
+// Asks the printer for its capabilities with M115 right after connecting,
+// updates the profile and sets up the features the printer supports. If the
+// printer doesn't answer properly, the stored profile is used.
+// Must only be called while the printer owes us no reply.
+void query_capabilities(File& serial)
+{
+    char* reply = query_printer(serial, "M115\n", "\nok");
+    if (profile.update(reply))
+    {
+        profile.save();
+        if (verbosity > 0)
+        {
+            fprintf(stdout, "Printer profile updated: %s,", profile.firmware());
+            for (int i = 0; i < PrinterProfile::CAPABILITIES; i++)
+                if (profile.capability((PrinterProfile::Capability)i) > 0)
+                    fprintf(stdout, " %s", PrinterProfile::CAPABILITY_NAMES[i]);
+            fprintf(stdout, "\n");
+        }
+    }
+    free(reply);
+
+    capabilities_queried = true;
+    autoreport_temp = profile.capability(PrinterProfile::AUTOREPORT_TEMP) > 0;
+    binary_transfer_support = profile.capability(PrinterProfile::BINARY_FILE_TRANSFER);
+}
+
+// Checks a line received from the printer for information we're interested in
+// while the printer is idle.
+void check_capabilities(gcode::Line& input)
+{
+    if (input.startsWith("Cap:AUTOREPORT_TEMP:1"))
+        autoreport_temp = true;
+}
+
+// Returns the number of milliseconds between temperature polls while no print is
+// active, based on how recently the API has been used. Returns 0 if there's no need
+// to poll.
+int temp_poll_interval()
+{
+    if (last_api_request == 0)
+        return 0;
+    int64_t quiet = millis() - last_api_request;
+    if (quiet < API_ACTIVE_TIME)
+        return TEMP_POLL_FAST;
+    if (quiet < API_IDLE_TIME)
+        return TEMP_POLL_SLOW;
+    return 0;
+}
+
+// Called from the main loop while no print is active to keep the temperatures
+// in printerState fresh for API clients. Reads everything the printer has to say
+// (e.g. responses to M105 or M155 auto-reports) and sends an M105 whenever
+// temp_poll_timer is not scheduled. If the printer supports M155, the
+// auto-report interval is adjusted instead. The commands are sent without line
+// number. Their oks are counted in oks_owed, so that the next handle() waits for
+// them before it sends numbered lines.
+// Does nothing if no connection to the printer has been established.
+void poll_temperature_idle(File& serial, gcode::Reader& serial_in)
+{
+    if (serial.isClosed() || serial.EndOfFile() || serial.hasError())
+        return;
+
+    serial.action("reading printer response");
+    serial.setNonBlock(true);
+    for (gcode::Line* input; 0 != (input = serial_in.next());)
     {
-        close(cmd_inject[1]);
-        File injector("Command Injector", cmd_inject[0]);
-        while (injector.writeAll(COOLDOWN_GCODE, strlen(COOLDOWN_GCODE)))
+        int idx = input->startsWith("ok\b");
+        if (idx != 0)
         {
-            sleep(1);
+            input->slice(idx);
+            if (oks_owed > 0)
+                oks_owed--;
         }
+        if (input->startsWith("T:"))
+            printerState.parseTemperatureReport(input->data());
+        else if (input->startsWith("start\b")) // the printer has reset its line counter
+        {
+            link_line = -1;
+            oks_owed = 0;
+        }
+        else
+            check_capabilities(*input);
+        if (verbosity > 1 && input->length() > 0)
+            out.writeAll(input->data(), input->length());
+        delete input;
+    }
+    if (serial.hasError())
+        return;
+
+    int interval = temp_poll_interval();
+    const char* cmd = 0;
+    char buf[32];
+
+    if (interval > 0 && !capabilities_queried)
+    {
+        capabilities_queried = true;
+        cmd = "M115\n";
+    }
+    else if (autoreport_temp || (autoreport_seconds > 0 && interval == 0)) // turn off what handle() enabled
+    {
+        timers.cancel(temp_poll_timer);
+        if (interval / 1000 != autoreport_seconds)
+        {
+            autoreport_seconds = interval / 1000;
+            snprintf(buf, sizeof(buf), "M155 S%d\n", autoreport_seconds);
+            cmd = buf;
+        }
+    }
+    else if (interval == 0)
+        timers.cancel(temp_poll_timer);
+    else
+    {
+        // Poll right away if the interval has become shorter than the remaining wait.
+        if (temp_poll_timer.scheduled() && temp_poll_timer.dueTime() > millis() + interval)
+            timers.cancel(temp_poll_timer);
+        if (!temp_poll_timer.scheduled())
+        {
+            timers.start(temp_poll_timer, millis(), interval);
+            cmd = "M105\n";
+        }
+    }
+
+    if (cmd != 0)
+    {
+        serial.action("polling printer temperature");
+        serial.setNonBlock(false);
+        if (serial.writeAll(cmd, strlen(cmd)))
+            oks_owed++;
         if (verbosity > 2)
-            fprintf(stdout, "Cooldown injector terminating\n");
-        _exit(0);
+            out.writeAll(cmd, strlen(cmd));
     }
 }
 
+// In multi-printer mode, API connections are accepted by a front-end process and
+// passed to the process of the printer they're meant for. The latter reads them
+// from its end of a socketpair() instead of accepting them on a listening socket.
+bool api_via_frontend = false;
+
+// In multi-printer mode, "/<n>/" where <n> is the printer id. Request paths start with this.
+char* api_path_prefix = 0;
+
+// The processes driving the printers in multi-printer mode. Only used by the front-end.
+pid_t* printer_pids = 0;
+int printer_count = 0;
+
+// How long the front-end waits for a new API connection to send its request line.
+const int API_ROUTE_TIMEOUT = 2000;
+
+// Returns the next pending API connection or -1. See api_via_frontend.
+int accept_api_connection(File* sock)
+{
+    if (api_via_frontend)
+        return sock->receiveFd();
+    return sock->accept();
+}
+
+// Signal handler of the front-end. The printer processes do the actual work.
+void forward_signal(int signum)
+{
+    for (int i = 0; i < printer_count; i++)
+        if (printer_pids[i] > 0)
+            kill(printer_pids[i], signum);
+}
+
+// Peeks at the request line of the API connection connfd without consuming it and
+// returns the printer id from the first path component. Returns 0 if there is none.
+// If the request line has not arrived completely and wait is true, returns -1.
+int api_printer_id(int connfd, bool wait)
+{
+    char buf[256];
+    int n = recv(connfd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        n = 0;
+    else if (n <= 0)
+        return 0; // EOF or error
+    buf[n] = 0;
+    if (wait && n < (int)sizeof(buf) - 1 && strchr(buf, '\n') == 0)
+        return -1;
+
+    char* p = strchr(buf, ' '); // skip method
+    if (p == 0 || p[1] != '/')
+        return 0;
+    char* endptr;
+    long id = strtol(p + 2, &endptr, 10);
+    if (endptr == p + 2 || *endptr != '/' || id < 1 || id > printer_count)
+        return 0;
+    return id;
+}
+
+// Multi-printer mode: forks one process per --printer. Each of them runs the normal
+// main loop for one printer with its own API connections which the calling process
+// accepts on sock and passes on based on api_printer_id(). The calling process never
+// returns from this function. It terminates when all printer processes have.
+// In the printer processes the function returns the printer's end of the connection
+// to the front-end and sets *printdev and *id.
+File* spawn_printers(option::Option* printer, File* sock, const char** printdev, int* id)
+{
+    printer_count = printer->count();
+    printer_pids = (pid_t*)malloc(printer_count * sizeof(pid_t));
+    File** link = (File**)malloc(printer_count * sizeof(File*));
+
+    int n = 0;
+    for (option::Option* opt = printer; opt != 0; opt = opt->next(), n++)
+    {
+        int sv[2];
+        assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv));
+        printer_pids[n] = fork();
+        if (printer_pids[n] < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (printer_pids[n] == 0)
+        {
+            MainProcess = getpid();
+            for (int i = 0; i < n; i++)
+                link[i]->close();
+            close(sv[0]);
+            sock->close();
+            *printdev = opt->arg;
+            *id = n + 1;
+            api_via_frontend = true;
+            assert(0 <= asprintf(&api_path_prefix, "/%d/", *id));
+            File* frontend = new File("front-end connection", sv[1]);
+            frontend->action("receiving API connection from");
+            frontend->setNonBlock(true);
+            return frontend;
+        }
+        close(sv[1]);
+        link[n] = new File("printer process connection", sv[0]);
+        link[n]->action("passing API connection to");
+    }
+
+    signal(SIGUSR1, forward_signal);
+    signal(SIGHUP, forward_signal);
+    signal(SIGQUIT, forward_signal);
+    signal(SIGINT, forward_signal);
+    signal(SIGTERM, forward_signal);
+
+    // Connections whose request line has not arrived, yet, and the millis() when
+    // they are routed nonetheless. They wait in the poll set, so that a slow client
+    // does not hold up the others.
+    int* pending = 0;
+    int64_t* deadline = 0;
+    int pending_count = 0;
+
+    int running = printer_count;
+    while (running > 0)
+    {
+        int nfds = printer_count + 1 + pending_count;
+        pollfd fds[nfds];
+        fds[0].fd = sock->fileDescriptor();
+        fds[0].events = POLLIN;
+        for (int i = 0; i < printer_count; i++)
+        {
+            fds[i + 1].fd = link[i]->fileDescriptor(); // -1 once the printer process is gone
+            fds[i + 1].events = 0;                     // POLLHUP is reported regardless
+        }
+        int timeout = -1;
+        for (int i = 0; i < pending_count; i++)
+        {
+            fds[printer_count + 1 + i].fd = pending[i];
+            fds[printer_count + 1 + i].events = POLLIN;
+            int64_t t = deadline[i] - millis();
+            if (t < 0)
+                t = 0;
+            if (timeout < 0 || t < timeout)
+                timeout = t;
+        }
+        poll(fds, nfds, timeout);
+
+        for (int i = 0; i < printer_count; i++)
+            if (fds[i + 1].revents != 0 && !link[i]->isClosed())
+            {
+                link[i]->close();
+                printer_pids[i] = 0;
+                --running;
+            }
+
+        int connfd = sock->accept();
+        if (connfd >= 0)
+        {
+            pending = (int*)realloc(pending, (pending_count + 1) * sizeof(int));
+            deadline = (int64_t*)realloc(deadline, (pending_count + 1) * sizeof(int64_t));
+            pending[pending_count] = connfd;
+            deadline[pending_count] = millis() + API_ROUTE_TIMEOUT;
+            pending_count++;
+        }
+        else if (sock->errNo() == EWOULDBLOCK)
+            sock->clearError();
+        else if (sock->hasError())
+        {
+            fprintf(stderr, "%s\n", sock->error());
+            forward_signal(SIGTERM);
+            exit(1);
+        }
+
+        for (int i = 0; i < pending_count;)
+        {
+            connfd = pending[i];
+            int target = api_printer_id(connfd, millis() < deadline[i]);
+            if (target < 0)
+            {
+                i++;
+                continue;
+            }
+            pending[i] = pending[--pending_count];
+            deadline[i] = deadline[pending_count];
+
+            if (target > 0 && !link[target - 1]->isClosed())
+            {
+                link[target - 1]->sendFd(connfd);
+                if (link[target - 1]->hasError())
+                {
+                    fprintf(stderr, "%s\n", link[target - 1]->error());
+                    link[target - 1]->clearError();
+                }
+            }
+            else if (fork() == 0) // answer with an error page
+            {
+                sock->close();
+                api_not_found(connfd);
+            }
+            close(connfd);
+        }
+    }
+
+    exit(0);
+}
+
 void call_poweroff()
 {
     if (fork() == 0)
@@ -603,12 +1760,20 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    if (parse.nonOptionsCount() == 0)
+    bool multi_printer = options[PRINTER];
+
+    if (parse.nonOptionsCount() == 0 && !multi_printer)
     {
         fprintf(stderr, "%s\n", "You must provide a path to your printer device!");
         exit(1);
     }
 
+    if (multi_printer && !options[API])
+    {
+        fprintf(stderr, "%s\n", "--printer doesn't work without --api!");
+        exit(1);
+    }
+
     assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, cmd_inject));
     File injector("Command Injector", cmd_inject[1]);
     injector.setNonBlock(true);
@@ -620,15 +1785,17 @@ int main(int argc, char* argv[])
     out.setNonBlock(true);
     // We don't exit for errors on stdout. It's just used for echoing.
 
-    File serial(parse.nonOption(parse.nonOptionsCount() - 1));
+    const char* printdev = multi_printer ? 0 : parse.nonOption(parse.nonOptionsCount() - 1);
+    const char* watch_root = 0; // the <dir> in multi-printer mode
+    int printer_id = 0;
 
     File* sock = 0;
 
-    FIFO<char> infile_queue;
+    FIFO<char> new_files; // temporary storage for the results of dirScanner
     DirScanner dirScanner;
     // Set last scan time to now so that we only detect new files and not
     // whatever is currently in the upload directories.
-    dirScanner.refill(infile_queue);
+    dirScanner.refill(new_files);
 
     long port = 8080;
     if (options[API])
@@ -663,12 +1830,24 @@ int main(int argc, char* argv[])
         }
     }
 
-    for (int i = 0; i < parse.nonOptionsCount() - 1; ++i)
+    for (int i = 0; i < parse.nonOptionsCount() - (multi_printer ? 0 : 1); ++i)
     {
         const char* inf = parse.nonOption(i);
+        if (multi_printer)
+        {
+            struct stat statbuf;
+            if (i > 0 || 0 > stat(inf, &statbuf) || !S_ISDIR(statbuf.st_mode))
+            {
+                fprintf(stderr, "With --printer only a single directory may be passed: %s\n", inf);
+                exit(1);
+            }
+            watch_root = inf;
+            continue;
+        }
+
         if (inf[0] == '-' && inf[1] == 0)
         {
-            infile_queue.put(strdup(inf));
+            jobs.add(inf, false);
             continue;
         }
 
@@ -687,7 +1866,7 @@ int main(int argc, char* argv[])
                 upload_dir = strdup(inf);
         }
         else
-            infile_queue.put(strdup(inf));
+            jobs.add(inf, false);
     }
 
     if (api_base_url != 0)
@@ -708,6 +1887,31 @@ int main(int argc, char* argv[])
         }
         sock->action("accepting connections on");
 
+        if (multi_printer)
+        {
+            fprintf(stdout, "Listening on port %ld for %d printers. API base: %s/<n>\n", port,
+                    options[PRINTER].count(), api_base_url);
+
+            sock = spawn_printers(options[PRINTER], sock, &printdev, &printer_id);
+
+            char* base;
+            assert(0 <= asprintf(&base, "%s/%d", api_base_url, printer_id));
+            api_base_url = base;
+
+            if (watch_root != 0)
+            {
+                char* dir;
+                assert(0 <= asprintf(&dir, "%s/%d", watch_root, printer_id));
+                if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+                {
+                    perror(dir);
+                    exit(1);
+                }
+                dirScanner.addDir(dir);
+                upload_dir = dir;
+            }
+        }
+
         if (upload_dir == 0)
         {
             // Create temporary directory
@@ -720,13 +1924,18 @@ int main(int argc, char* argv[])
             dirScanner.addDir(upload_dir);
         }
 
-        fprintf(stdout, "Listening on port %ld. Uploading to %s. API base: %s\n", port, upload_dir, api_base_url);
+        if (multi_printer)
+            fprintf(stdout, "Printer %d: %s. Uploading to %s. API base: %s\n", printer_id, printdev, upload_dir,
+                    api_base_url);
+        else
+            fprintf(stdout, "Listening on port %ld. Uploading to %s. API base: %s\n", port, upload_dir,
+                    api_base_url);
     }
     else // If we're not listening
     {
         // If we don't have any infile arguments, assume "-" (i.e. stdin)
         if (parse.nonOptionsCount() == 1)
-            infile_queue.put(strdup("-"));
+            jobs.add("-", false);
     }
 
     ioerror_next = false; // default
@@ -735,18 +1944,94 @@ int main(int argc, char* argv[])
     if (options[IOERROR] && options[IOERROR].arg[0] == 'q')
         ioerror_next = false; // override default if --ioerror=quit on command line
 
+    const char* journal = 0;
+    if (options[JOURNAL])
+    {
+        journal = options[JOURNAL].last()->arg;
+        if (multi_printer)
+            assert(0 <= asprintf((char**)&journal, "%s.%d", journal, printer_id));
+    }
+    else if (upload_dir != 0)
+        assert(0 <= asprintf((char**)&journal, "%s/.marlinfeed-journal", upload_dir));
+    if (journal != 0 && jobs.open(journal) && verbosity > 0 && !jobs.empty())
+        fprintf(stdout, "Restored %d queued job(s) from %s\n", jobs.size(), journal);
+
+    if (journal != 0)
+    {
+        char* cp;
+        assert(0 <= asprintf(&cp, "%s.checkpoint", journal));
+        checkpoint.open(cp);
+        free(cp);
+    }
+    else if (options[RESUME])
+        fprintf(stderr, "--resume does nothing without a journal (see --journal)\n");
+
+    resume_enabled = options[RESUME];
+    meatpack_enabled = options[MEATPACK];
+    sd_enabled = options[SD];
+    low_latency = options[LOWLATENCY];
+    const char* profiles = 0;
+    if (options[PROFILES])
+        profiles = options[PROFILES].last()->arg;
+    else if (upload_dir != 0)
+        assert(0 <= asprintf((char**)&profiles, "%s/.marlinfeed-profiles", upload_dir));
+    finder.open(printdev);
+    if (profiles != 0)
+        profile.open(profiles, finder.resolve());
+    if (options[BUFSIZE])
+    {
+        bufsize_arg = atoi(options[BUFSIZE].last()->arg);
+        if (bufsize_arg < MIN_BUFSIZE)
+        {
+            fprintf(stderr, "--bufsize must be at least %d\n", MIN_BUFSIZE);
+            exit(1);
+        }
+    }
+    if (options[BAUD])
+        baud_arg = (strcmp(options[BAUD].last()->arg, "auto") == 0) ? 0 : atoi(options[BAUD].last()->arg);
+    use_profile();
+    if (options[COMPRESS])
+        upload_compression = Codec::fromEncoding(options[COMPRESS].last()->arg);
+    if (checkpoint.interrupted())
+    {
+        if (resume_enabled)
+            fprintf(stdout, "Resuming print of '%s'\n", checkpoint.path());
+        else
+            checkpoint.finish();
+    }
+
+    File serial(printdev);
+    gcode::Reader serial_in(serial); // only used while no print is active
+    serial_in.whitespaceCompression(1);
+
     printerState = PrinterState::Disconnected;
 
     if (api_base_url != 0 && strcmp(api_base_url, "Debug") == 0)
         socketTest();
 
+    if (sock != 0 && upload_dir != 0)
+        files.open(upload_dir, api_base_url);
+
+    if (options[RETAIN])
+    {
+        if (upload_dir == 0)
+            fprintf(stderr, "--retain does nothing without an upload directory\n");
+        else
+        {
+            char* files_arg;
+            int64_t megabytes = strtoll(options[RETAIN].last()->arg, &files_arg, 10);
+            int max_files = atoi(files_arg + 1);
+            retention.open(upload_dir, megabytes * 1024 * 1024, max_files, file_in_use, verbosity > 0);
+        }
+    }
+
     int hard_error_count = 0;
 
     for (;;)
     {
         // If we're done with all infiles and there is no chance of any additional
         // infiles coming in, then exit.
-        if (infile_queue.empty() && (sock == 0 || sock->hasError()) && dirScanner.empty())
+        if (jobs.empty() && !resume_pending() && (sock == 0 || sock->hasError()) && dirScanner.empty())
             break;
 
         if (shutdown_level == 3) // SIGINT => immediate terminate, if job was aborted a cooldown code was sent
@@ -754,14 +2039,9 @@ int main(int argc, char* argv[])
 
         if (shutdown_level > 0 && injecting_cooldown == 0)
         {
-            // Clear infile queue so that only our injection is processed
-            for (;;)
-            {
-                auto infile = infile_queue.get();
-                if (infile == 0)
-                    break;
-                free(infile);
-            }
+            // Clear infile queue so that only our injection is processed. The
+            // journal keeps the jobs for the next start.
+            jobs.forget();
             inject_cooldown();
         }
 
@@ -780,6 +2060,7 @@ int main(int argc, char* argv[])
                 injector.close();
                 sock->close();
                 sock = 0;
+                scheduler.cancel(cooldown_id);
             }
             injecting_cooldown = 2;
         }
@@ -790,7 +2071,8 @@ int main(int argc, char* argv[])
             exit(0);
         }
 
-        if (infile_queue.empty())
+        jobs.update();
+        if (jobs.empty() && !resume_pending())
         {
             if (shutdown_level == 0 && isPowerOffWhenIdleRequested())
             {
@@ -801,12 +2083,13 @@ int main(int argc, char* argv[])
             {
                 if (sock)
                 {
-                    sock->poll(POLLIN, 250);
                     // Accept as socket connection if any is pending, then fork
                     // and handle it in a child process.
-                    int connfd = sock->accept();
+                    int connfd = accept_api_connection(sock);
                     if (connfd >= 0)
                     {
+                        jobs.update(); // so that the child sees the current queue
+                        files.refresh();
                         pid_t childpid = fork();
                         if (childpid < 0)
                             perror("fork");
@@ -818,6 +2101,7 @@ int main(int argc, char* argv[])
                             _exit(0);
                         }
                         close(connfd);
+                        last_api_request = millis();
                         if (verbosity > 1)
                             fprintf(stdout, NEW_SOCKET_CONNECTION, childpid);
                     }
@@ -828,20 +2112,53 @@ int main(int argc, char* argv[])
                     }
                 }
 
-                dirScanner.refill(infile_queue);
-                infile_queue.filter(gcode_extension);
+                dirScanner.refill(new_files);
+                new_files.filter(gcode_extension);
+                while (!new_files.empty())
+                {
+                    char* f = new_files.get();
+                    files.update(f);
+                    jobs.add(f);
+                    free(f);
+                }
 
-                if (infile_queue.empty() && isPrintLastFileRequested())
+                if (jobs.empty() && isPrintLastFileRequested())
                 {
                     interrupt = 0;
                     if (lastPrintedFile != 0)
-                        infile_queue.put(strdup(lastPrintedFile));
+                        jobs.add(lastPrintedFile, false);
                 }
             }
 
-            if (infile_queue.empty() && !inject_in->hasNext())
+            if (jobs.empty() && !resume_pending() && injected.empty() && !inject_in->hasNext() &&
+                !scheduler.hasReady())
             {
-                usleep(250000); // to make sure we don't burn cycles waiting for files
+                poll_temperature_idle(serial, serial_in);
+
+                // Wait for an API connection, an injected command, a message from the
+                // printer or the next timer, but no more than 250ms so that we don't
+                // miss new files for long (and don't burn cycles waiting for them).
+                pollfd fds[3];
+                int nfds = 0;
+                fds[nfds].fd = injector.fileDescriptor(); // -1 after close() => ignored by poll()
+                fds[nfds].events = POLLIN;
+                if (shutdown_level == 0 && sock != 0 && !sock->hasError())
+                {
+                    fds[++nfds].fd = sock->fileDescriptor();
+                    fds[nfds].events = POLLIN;
+                }
+                if (!serial.isClosed() && !serial.EndOfFile() && !serial.hasError())
+                {
+                    fds[++nfds].fd = serial.fileDescriptor();
+                    fds[nfds].events = POLLIN;
+                }
+                ++nfds;
+
+                int timeout = timers.timeout(millis());
+                if (timeout < 0 || timeout > 250)
+                    timeout = 250;
+                poll(fds, nfds, timeout);
+                fire_idle_timers();
                 continue;
             }
         }
@@ -853,16 +2170,43 @@ int main(int argc, char* argv[])
                                  // 3: error occurred on printer device, try reconnecting
                                  // 4: print aborted by signal
 
-        char* infile = infile_queue.get();
-        if (infile == 0) // can only happen if we have something in inject_in
+        char* infile;
+        bool resume = resume_pending();
+        if (resume)
+        {
+            struct stat statbuf;
+            if (stat(checkpoint.path(), &statbuf) != 0 ||
+                statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec != checkpoint.mtime())
+            {
+                fprintf(stderr, "Not resuming print of '%s' because the file has changed\n", checkpoint.path());
+                checkpoint.finish();
+                continue;
+            }
+        }
+
+        JobQueue::Job* job = resume ? 0 : jobs.start();
+        if (resume)
+            infile = strdup(checkpoint.path());
+        else if (job == 0) // can only happen if we have something in inject_in or scheduler
             infile = strdup(DEV_NULL);
         else
         {
+            infile = strdup(job->path);
             free(lastPrintedFile);
             lastPrintedFile = strdup(infile);
+            retention.touch(infile);
         }
 
-        if (handle(out, serial, infile, sock, &error, &in_out_printer))
+        serial_in.discard(); // handle() does its own reading
+        timers.cancel(temp_poll_timer);
+        job_bytes_read = 0;
+        bool ok = handle(out, serial, infile, sock, &error, &in_out_printer, resume);
+        if (job != 0)
+            jobs.finish(ok, job_bytes_read);
+        // Keep the checkpoint only if the printer connection broke down.
+        if ((job != 0 || resume) && (ok || !resume_enabled || (in_out_printer != 2 && in_out_printer != 3)))
+            checkpoint.finish();
+        if (ok)
             hard_error_count = 0;
         else
         {
@@ -885,9 +2229,10 @@ int main(int argc, char* argv[])
             {
                 if (hard_error_count < 4)
                     hard_error_count++;
-                fprintf(stderr, "Suspending operation for %ds in hopes hard error will disappear\n",
-                        5 * hard_error_count);
-                sleep(5 * hard_error_count); // wait for it to go away (e.g. USB cable to be replugged)
+                fprintf(stderr, "Waiting up to %ds for the printer device to come back\n", 5 * hard_error_count);
+                // wait for it to go away (e.g. USB cable to be replugged)
+                if (finder.wait(5000 * hard_error_count) && verbosity > 0)
+                    fprintf(stdout, "Printer device has appeared\n");
             }
         }
         else
@@ -904,7 +2249,7 @@ bool handle_error(const char** e, const char* err_msg, int* iop, int which)
     return false;
 }
 
-bool handle(File& out, File& serial, const char* infile, File* sock, const char** e, int* iop)
+bool handle(File& out, File& serial, const char* infile, File* sock, const char** e, int* iop, bool resume)
 {
     interrupt = 0;
 
@@ -913,16 +2258,36 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
     if (verbosity > 0 && !dummy)
         fprintf(stdout, "Started print '%s'\n", infile);
 
+    // With --sd, a job from a file is printed from the printer's SD card. infile
+    // is then only read as far as the printer has got, to keep the checkpoint.
+    bool sd_job = sd_enabled && !dummy && !(infile[0] == '-' && infile[1] == 0);
+    char sd_name[16];
+    if (sd_job)
+    {
+        struct stat statbuf;
+        sd_job = (stat(infile, &statbuf) == 0);
+        if (sd_job)
+            sd_file_name(infile, statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec, sd_name);
+    }
+
     // (Re-)connect to printer if necessary.
     bool hard_reconnect = (serial.isClosed() || serial.EndOfFile() || serial.hasError());
+    bool tty = false;
 
     if (hard_reconnect)
     {
     do_hard_reconnect:
         hard_reconnect = true;
+        forget_printer_capabilities();
         serial.close();
         serial.clearError();
         serial.action("opening printer device");
+        const char* dev = finder.resolve();
+        if (finder.isSearch() && strcmp(dev, serial.path()) != 0 && verbosity > 0)
+            fprintf(stdout, "Printer device is %s\n", dev);
+        serial.setPath(dev);
+        if (profile.follow(dev))
+            use_profile();
         struct stat statbuf;
         if (!serial.stat(&statbuf))
             return handle_error(e, serial.error(), iop, 2);
@@ -933,11 +2298,15 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
         }
         else
         { // not a socket? Treat it as a TTY.
+            tty = true;
             serial.open();
-            serial.setupTTY();
+            serial.setupTTY((baud_rate > 0) ? baud_rate : DEFAULT_BAUD_RATE);
+            if (baud_rate == 0 && !serial.hasError())
+                detect_baud(serial);
             if (serial.hasError())
                 return handle_error(e, serial.error(), iop, 2);
         }
+        oks_owed = 0; // whatever is owed from before (or from detect_baud()) is handled by the handshake
     }
 
     serial.action("connecting to printer");
@@ -950,49 +2319,62 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
     if (hard_reconnect)
         serial.poll(POLLIN, 3000);
 
-    for (; attempt <= MAX_ATTEMPTS; attempt++)
+    // If the printer is still printing this job from SD card (e.g. because
+    // marlinfeed has been restarted), we take over the print instead of stopping it.
+    bool sd_attach = hard_reconnect && sd_job && sd_printing_file(serial, sd_name);
+    if (sd_attach && verbosity > 0)
+        fprintf(stdout, "Printer is still printing '%s' from SD card => Taking over\n", infile);
+
+    // If the previous job has left the link in sync, there's no need for a handshake
+    // unless the printer has reset since, which it announces with "start", or
+    // does not acknowledge the commands sent without line number since (e.g. by
+    // poll_temperature_idle()).
+    int32_t first_line = hard_reconnect ? -1 : link_line;
+    link_line = -1;
+    if (!await_oks(serial))
+        first_line = -1;
+    if (first_line >= 0)
+    {
+        char pending[2048];
+        int n;
+        if (read_handshake(serial, pending, sizeof(pending), &n, millis() + 1) == 2)
+            first_line = -1;
+        if (verbosity > 1)
+            out.writeAll(pending, n);
+    }
+
+    for (; first_line < 0 && attempt <= MAX_ATTEMPTS; attempt++)
     {
         char buffy[2048];
-        int idx = serial.tail(buffy, sizeof(buffy) - 1 /* -1 for appending \n if nec. */, 500);
-        if (idx < 0)
+        int n;
+        if (attempt == 1)
         {
-            if (hard_reconnect)
-                return handle_error(e, serial.error(), iop, 2);
-            else
-                goto do_hard_reconnect;
+            // Whatever the printer has to say before we have sent anything is
+            // unrelated (e.g. the greeting after a reset).
+            n = serial.tail(buffy, sizeof(buffy) - 1, 500);
+            if (n < 0)
+            {
+                if (hard_reconnect)
+                    return handle_error(e, serial.error(), iop, 2);
+                else
+                    goto do_hard_reconnect;
+            }
+            if (verbosity > 1)
+                out.writeAll(buffy, n);
         }
 
-        int n = idx;
-        if (idx > 0 && buffy[idx - 1] == '\n')
-            idx--; // make sure buffy[idx-1] is not the \n terminating the buffer
-        else
-            buffy[n++] = '\n'; // make sure buffy ends in a \n
-
-        // Put idx at start of last line
-        while (idx > 0 && buffy[idx - 1] != '\n')
-            --idx;
-
-        // buffy[idx] is the first character of the last line
-        // buffy[n-1] is \n terminating the last line
-        // buffy[n] is out of bounds
-
-        if (verbosity > 1)
-            out.writeAll(buffy, n);
-
-        // When we get here for attempt 0, we haven't yet sent WRAP_AROUND_STRING, so any ok
-        // we may see is unrelated. Therefore we don't break for attempt == 0.
-        if (attempt > 1 && (buffy[idx] == 'o' && buffy[idx + 1] == 'k' && buffy[idx + 2] <= ' '))
-            break;
-
         if (verbosity > 1)
         {
-            if (hard_reconnect)
+            if (hard_reconnect && !sd_attach)
                 out.writeAll(STOP_SD_PRINT_GCODE, strlen(STOP_SD_PRINT_GCODE));
             out.writeAll(MarlinBuf::WRAP_AROUND_STRING, MarlinBuf::WRAP_AROUND_STRING_LENGTH);
         }
 
-        if (hard_reconnect)
-            serial.writeAll(STOP_SD_PRINT_GCODE, strlen(STOP_SD_PRINT_GCODE));
+        // What we sent in earlier attempts has not been answered and is
+        // assumed to be lost.
+        oks_owed = 0;
+        if (hard_reconnect && !sd_attach && serial.writeAll(STOP_SD_PRINT_GCODE, strlen(STOP_SD_PRINT_GCODE)))
+            oks_owed++;
 
         if (!serial.writeAll(MarlinBuf::WRAP_AROUND_STRING, MarlinBuf::WRAP_AROUND_STRING_LENGTH))
         {
@@ -1002,11 +2384,30 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                 goto do_hard_reconnect;
         }
 
-        // give the printer some time to reset itself
-        if (hard_reconnect)
-            usleep(1500000 << attempt); // give the printer some time to reset itself
-        else
-            usleep(100000 * attempt);
+        // Wait for the ok, giving the printer some time to reset itself.
+        int64_t deadline = millis() + (hard_reconnect ? (1500 << attempt) : 600 * attempt);
+        int reply = read_handshake(serial, buffy, sizeof(buffy), &n, deadline);
+        if (verbosity > 1)
+            out.writeAll(buffy, n);
+        if (reply < 0)
+        {
+            if (hard_reconnect)
+                return handle_error(e, serial.error(), iop, 2);
+            else
+                goto do_hard_reconnect;
+        }
+        if (reply == 1)
+        {
+            oks_owed++; // for WRAP_AROUND_STRING
+            got_oks(buffy);
+            break;
+        }
+        if (reply == 2) // The printer has just reset. Let it finish its greeting, then try again.
+        {
+            n = serial.tail(buffy, sizeof(buffy) - 1, 500);
+            if (verbosity > 1 && n > 0)
+                out.writeAll(buffy, n);
+        }
     }
 
     if (out.hasError())
@@ -1032,7 +2433,29 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
     if (hard_reconnect && verbosity > 0)
         fprintf(stdout, "Successfully established printer connection\n");
 
-    printerState = PrinterState::Idle;
+    // A printer that is busy printing from SD might answer too late.
+    if (hard_reconnect && !sd_attach)
+        query_capabilities(serial);
+
+    if (tty && low_latency && !sd_attach)
+        reduce_latency(serial);
+
+    printerState = PrinterState::Idle;
+
+    // An interrupted print that the printer is not continuing by itself is
+    // resumed by streaming, because the printer can't do the resume GCODE.
+    // Without M27 auto-reports we wouldn't know how the print is going.
+    if (sd_job && !sd_attach &&
+        (resume || !binary_transfer_available(serial) || profile.capability(PrinterProfile::AUTOREPORT_SD_STATUS) < 0))
+        sd_job = false;
+
+    // An ok still on its way for one of the commands without line number sent
+    // above would be taken for the ack of the first numbered line.
+    if (!await_oks(serial))
+        fprintf(stderr, "Printer has not acknowledged all queries => Line numbers may be out of step\n");
+
+    bool packing = !sd_job && start_meatpack(serial);
+    MeatPackGuard meatpack_guard{serial, packing};
 
     gcode::Reader gcode_serial(serial);
     gcode_serial.whitespaceCompression(1);
@@ -1051,11 +2474,88 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
 
     in->setNonBlock(true);
     struct stat statbuf;
+    bool regular_file = false;
     if (in->stat(&statbuf))
+    {
         printerState.setPrintSize(statbuf.st_size);
+        regular_file = S_ISREG(statbuf.st_mode);
+    }
     if (in->hasError())
         return handle_error(e, in->error(), iop, 0);
 
+    Codec::Type codec = Codec::fromName(infile);
+    if (codec != Codec::NONE)
+    {
+        printerState.setPrintSize(Codec::uncompressedSize(*in, codec)); // -1 => no percentage
+        if (!Codec::decompress(*in, codec))
+            return handle_error(e, "Cannot start decompressor", iop, 0);
+        in->setNonBlock(true);
+        regular_file = false; // no seeking => no checkpoint/resume
+    }
+
+    if (sd_job && !sd_attach)
+    {
+        const char* err = sd_upload(serial, gcode_serial, infile, sd_name);
+        if (err != 0)
+            return handle_error(e, err, iop, 3);
+    }
+
+    // The file offset and modal state after the last line from the infile that
+    // has been put into marlinbuf.
+    Checkpoint::Record progress;
+    progress.offset = 0;
+
+    // The GCODE that prepares the printer for continuing an interrupted print.
+    FIFO<gcode::Line> resume_lines;
+
+    if (resume)
+    {
+        progress = checkpoint.last();
+        in->action("seeking to resume position");
+        if (lseek(in->fileDescriptor(), progress.offset, SEEK_SET) < 0)
+            return handle_error(e, "Cannot seek to resume position", iop, 0);
+        if (!sd_job) // the printer is still printing from SD
+        {
+            char* gcode = Checkpoint::resumeGCode(progress.state);
+            for (char* p = gcode; *p != 0;)
+            {
+                char* nl = strchr(p, '\n');
+                *nl = 0; // resumeGCode() terminates every line with '\n'
+                resume_lines.put(new gcode::Line(p));
+                p = nl + 1;
+            }
+            free(gcode);
+            if (verbosity > 0)
+                fprintf(stdout, "Resuming print at byte %lld\n", (long long)progress.offset);
+        }
+    }
+    else if (regular_file)
+        checkpoint.begin(infile, statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec);
+
+    if (sd_job)
+    {
+        char gcode[64];
+        if (!sd_attach)
+        {
+            snprintf(gcode, sizeof(gcode), "M23 %s", sd_name);
+            resume_lines.put(new gcode::Line(gcode));
+            resume_lines.put(new gcode::Line("M24"));
+        }
+        snprintf(gcode, sizeof(gcode), "M27 S%d", PRINT_AUTOREPORT_SECONDS);
+        resume_lines.put(new gcode::Line(gcode));
+    }
+    bool sd_active = sd_job; // false after the printer has finished printing from SD
+    bool sd_paused = false;
+
+    const int64_t start_offset = progress.offset;
+
+    // progress for each line appended to marlinbuf, indexed by the line's tag modulo ring
+    const int ring = checkpoint_ring();
+    unique_ptr<Checkpoint::Record[]> inflight(new Checkpoint::Record[ring]);
+    int64_t next_tag = 0;
+    int64_t saved_tag = -1;        // tag of the line whose progress was last saved to the checkpoint
+    int64_t next_gcode_offset = -1; // file offset after next_gcode if it comes from the infile; -1 otherwise
+
     in->action("reading source gcode");
     gcode::Reader gcode_in(*in);
     gcode_in.whitespaceCompression(1); // CR-10's stock version of Marlin requires a space between command and params
@@ -1066,14 +2566,37 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
     FIFO<gcode::Line> stdoutbuf;
 
     MarlinBuf marlinbuf;
+    configure(marlinbuf);
+    marlinbuf.setPacking(packing);
+    if (first_line >= 0)
+        marlinbuf.continueAt(first_line);
+
+    // Have the printer report temperatures by itself. Firmware without M155
+    // support just complains about an unknown command, but if we know that it
+    // has none, we don't bother it.
+    if (autoreport_seconds != PRINT_AUTOREPORT_SECONDS && profile.capability(PrinterProfile::AUTOREPORT_TEMP) >= 0)
+    {
+        char m155[32];
+        snprintf(m155, sizeof(m155), "M155 S%d\n", PRINT_AUTOREPORT_SECONDS);
+        marlinbuf.append(m155);
+        autoreport_seconds = PRINT_AUTOREPORT_SECONDS;
+    }
     int idx;
 
     printerState = PrinterState::Printing;
-    int64_t last_ok_time = 0;
     bool have_time = false; // if we have extracted an estimated print time from slicer comments
     int resend_count = 0;
-    int64_t last_error = 0;
-    int64_t last_lifesign = 0; // 0 => we're not waiting for a lifesign
+    bool stalled = false; // STALL_TIME has passed without an ok
+
+    // The timers unschedule themselves when handle() returns.
+    TimerWheel::Timer error_timer(ERROR_TIMEOUT);     // scheduled while the printer replies with errors
+    TimerWheel::Timer silence_timer(SILENCE_TIMEOUT); // scheduled while waiting for an ack
+    TimerWheel::Timer stall_timer(STALL_TIMEOUT);     // restarted on every ok
+    TimerWheel::Timer settle_timer(ERROR_SETTLE);     // scheduled while we hold back after an error
+    TimerWheel::Timer abort_timer(ABORT_DONE);        // scheduled while the abort sequence is running
+    TimerWheel::Timer flush_timer(CHECKPOINT_FLUSH);  // always scheduled
+    timers.start(stall_timer, millis(), STALL_TIME);
+    timers.start(flush_timer, millis(), CHECKPOINT_INTERVAL);
 
     PrintStats stats;
     stats.startTime = millis();
@@ -1087,11 +2610,14 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
 
             fds[nfds].fd = serial.fileDescriptor();
             fds[nfds].events = POLLIN; // always interested in what the printer has to say
-            if (marlinbuf.hasNext())
+            if (marlinbuf.hasNext() && !settle_timer.scheduled() && !isAborted())
                 fds[nfds].events |= POLLOUT;
 
-            fds[++nfds].fd = cmd_inject[1]; // always interested in injections
-            fds[nfds].events = POLLIN;
+            if (!isAborted()) // interested in injections unless we're aborting
+            {
+                fds[++nfds].fd = cmd_inject[1];
+                fds[nfds].events = POLLIN;
+            }
 
             if (!out.hasError() && !stdoutbuf.empty())
             {
@@ -1099,34 +2625,71 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                 fds[nfds].events = POLLOUT;
             }
 
-            if (next_gcode == 0 && !isPaused())
+            if (next_gcode == 0 && !isPaused() && !isAborted() && !sd_job)
             {
                 fds[++nfds].fd = in->fileDescriptor();
                 fds[nfds].events = POLLIN;
             }
 
-            if (sock != 0)
+            if (sock != 0 && !sock->hasError())
             {
                 fds[++nfds].fd = sock->fileDescriptor();
                 fds[nfds].events = POLLIN;
             }
 
             ++nfds;
-            poll(fds, nfds, -1);
+            poll(fds, nfds, timers.timeout(millis()));
         }
 
-        if (isAborted())
+        for (TimerWheel::Timer* t; 0 != (t = timers.expire(millis()));)
         {
-            serial.action("sending cooldown request to printer");
-            serial.setNonBlock(false);
-            for (int i = 0; i < 3; i++)
+            switch (t->id)
             {
-                serial.writeAll(COOLDOWN_GCODE, strlen(COOLDOWN_GCODE));
-                usleep(10000);
+                case ERROR_TIMEOUT:
+                    return handle_error(e, "Persistent error state on printer => abort current job", iop, 3);
+                case SILENCE_TIMEOUT:
+                    return handle_error(e, "Printer timeout waiting for ack", iop, 3);
+                case STALL_TIMEOUT:
+                    stalled = true;
+                    break;
+                case ERROR_SETTLE:
+                    break; // settle_timer.scheduled() is now false, so sending resumes
+                case ABORT_DONE:
+                    return handle_error(e, "Print aborted", iop, 4);
+                case CHECKPOINT_FLUSH:
+                    checkpoint.flush();
+                    timers.start(flush_timer, millis(), CHECKPOINT_INTERVAL);
+                    break;
+                default:
+                    if (!scheduler.fire(t, millis()) && !retention.fire(t))
+                        jobs.fire(t);
             }
-            serial.writeAll(LIFT_NOZZLE_GCODE, strlen(LIFT_NOZZLE_GCODE));
-            usleep(250000);
-            return handle_error(e, "Print aborted", iop, 4);
+        }
+
+        if (isAborted() && !abort_timer.scheduled())
+        {
+            // From now on nothing goes into marlinbuf anymore. The abort sequence
+            // is written directly to the printer without line numbers.
+            schedule_abort(scheduler, timers, abort_timer, millis(), sd_active);
+        }
+
+        for (;;)
+        {
+            gcode::Line* urgent = scheduler.next(CommandScheduler::URGENT);
+            if (urgent == 0 && !isAborted())
+                urgent = next_emergency(marlinbuf);
+            if (urgent == 0)
+                break;
+            serial.action("sending urgent gcode to printer");
+            serial.setNonBlock(false);
+            if (urgent->isEmergency())
+                send_emergency(serial, urgent->data(), urgent->length(), packing);
+            else
+                send_gcode(serial, urgent->data(), urgent->length(), packing);
+            if (verbosity > 2)
+                stdoutbuf.put(urgent); // echo to stdout
+            else
+                delete urgent;
         }
 
         /*
@@ -1144,7 +2707,56 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
             bool ignore_ok = false;
             while (0 != (input = gcode_serial.next()))
             {
-                last_lifesign = millis();
+                // A temperature report that is not the reply to M105 is an M155
+                // auto-report, unless it has the W: of the progress reports during
+                // M109/M190. It is not related to our commands, so it does not count
+                // as traffic and does not keep the silence timeout from triggering.
+                if (input->startsWith("T:") && strstr(input->data(), " W:") == 0)
+                {
+                    printerState.parseTemperatureReport(input->data());
+                    if (verbosity > 1)
+                        stdoutbuf.put(input);
+                    else
+                        delete input;
+                    continue;
+                }
+
+                // The same goes for the M27 auto-reports of an --sd print. infile is
+                // read up to the reported position to keep the checkpoint.
+                if (sd_job && (idx = input->startsWith("SD printing byte\b")) != 0)
+                {
+                    int64_t pos = strtoll(input->data() + idx, 0, 10);
+                    for (gcode::Line* line; progress.offset < pos && 0 != (line = gcode_in.next());)
+                    {
+                        progress.state.update(*line);
+                        progress.offset = start_offset + gcode_in.consumedBytes();
+                        delete line;
+                    }
+                    checkpoint.save(progress);
+                    job_bytes_read = pos;
+                    if (verbosity > 1)
+                        stdoutbuf.put(input);
+                    else
+                        delete input;
+                    continue;
+                }
+                if (sd_job && input->startsWith("Not SD printing"))
+                {
+                    // Unless we have just sent M24, the print has been stopped on the printer.
+                    if (sd_active && !sd_paused && !marlinbuf.needsAck())
+                    {
+                        sd_active = false;
+                        stdoutbuf.put(new gcode::Line("SD print has been stopped on the printer\n"));
+                    }
+                    if (verbosity > 1)
+                        stdoutbuf.put(input);
+                    else
+                        delete input;
+                    continue;
+                }
+
+                if (silence_timer.scheduled())
+                    timers.start(silence_timer, millis(), MAX_TIME_SILENCE);
                 action_on_printer = true;
             reparse:
                 if (0 != (idx = input->startsWith("ok\b")))
@@ -1152,21 +2764,37 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                     if (verbosity > 2)
                         stdoutbuf.put(new gcode::Line("ok\n"));
 
-                    last_ok_time = millis();
+                    stalled = false;
+                    timers.start(stall_timer, millis(), STALL_TIME);
                     if (ignore_ok)
                         ignore_ok = false;
                     else
                     {
                         resend_count = 0;
-                        last_error = 0;
+                        timers.cancel(error_timer);
                         if (!marlinbuf.ack())
                             stdoutbuf.put( // Don't exit for this error. The user knows best.
                                 new gcode::Line(
                                     "WARNING! Spurious 'ok'! Is a user manually controlling the printer?\n"));
+                        else if (marlinbuf.ackedTag() != saved_tag)
+                        {
+                            saved_tag = marlinbuf.ackedTag();
+                            checkpoint.save(inflight[saved_tag % ring]);
+                        }
                     }
 
                     input->slice(idx);
-                    if (input->length() > 0)
+                    // ADVANCED_OK appends " N<line> P<planner> B<buffer>", which is of no interest.
+                    while (input->length() > 0 && strchr("NPB", input->data()[0]) != 0 && isdigit(input->data()[1]))
+                    {
+                        int k = 1;
+                        while (k < input->length() && !isspace(input->data()[k]))
+                            k++;
+                        while (k < input->length() && isspace(input->data()[k]) && input->data()[k] != '\n')
+                            k++;
+                        input->slice(k);
+                    }
+                    if (input->length() > 0 && input->data()[0] != '\n')
                         goto reparse; // in case something follows ok, such as an M105 temperature report
                     else
                         delete input;
@@ -1183,17 +2811,15 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                 else if (input->startsWith("Error:"))
                 {
                     ++stats.errors;
-                    if (last_error == 0)
-                        last_error = millis();
+                    if (!error_timer.scheduled())
+                        timers.start(error_timer, millis(), MAX_TIME_WITH_ERROR);
                     stdoutbuf.put(input); // echo to stdout
-                    // Give printer a little bit of time to send more errors if any, so that we
-                    // don't leave this loop too early, start sending and trigger more errors.
-                    usleep(100000);
+                    timers.start(settle_timer, millis(), ERROR_SETTLE_TIME);
                 }
                 else if (0 != (idx = input->startsWith("Resend:\b")))
                 {
-                    if (last_error == 0)
-                        last_error = millis();
+                    if (!error_timer.scheduled())
+                        timers.start(error_timer, millis(), MAX_TIME_WITH_ERROR);
                     ++resend_count;
                     ++stats.resends;
                     input->slice(idx);
@@ -1207,27 +2833,49 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                         return handle_error(e, "Illegal 'Resend' received from printer", iop, 3);
 
                     ignore_ok = true; // ignore the ok that accompanies the Resend
-
-                    // Give printer a little bit of time to send more errors if any, so that we
-                    // don't leave this loop too early, start sending and trigger more errors.
-                    usleep(100000);
+                    timers.start(settle_timer, millis(), ERROR_SETTLE_TIME);
+                }
+                else if (sd_active && input->startsWith("Done printing file"))
+                {
+                    sd_active = false;
+                    stdoutbuf.put(input);
+                    char gcode[64];
+                    snprintf(gcode, sizeof(gcode), "M30 %s", sd_name);
+                    resume_lines.put(new gcode::Line("M27 S0"));
+                    resume_lines.put(new gcode::Line(gcode));
                 }
                 else
                 {
-                    last_error = 0;
+                    timers.cancel(error_timer);
+                    check_capabilities(*input);
                     stdoutbuf.put(input); // echo to stdout
                 }
+            }
 
-                if (last_error > 0 && millis() - last_error > MAX_TIME_WITH_ERROR)
-                    return handle_error(e, "Persistent error state on printer => abort current job", iop, 3);
+            // An --sd print is paused on the printer.
+            if (sd_active && isPaused() != sd_paused)
+            {
+                sd_paused = !sd_paused;
+                resume_lines.put(new gcode::Line(sd_paused ? "M25" : "M24"));
             }
 
             for (;;)
             {
                 if (next_gcode == 0)
-                    next_gcode = inject_in->next(); // may still be null if no data available
-                if (next_gcode == 0 && !isPaused())
+                    next_gcode = resume_lines.get();
+                if (next_gcode == 0)
+                    next_gcode = scheduler.next(CommandScheduler::HIGH);
+                if (next_gcode == 0)
+                    next_gcode = injected.get(); // filled by next_emergency()
+                if (next_gcode == 0)
+                    next_gcode = scheduler.next(CommandScheduler::NORMAL);
+                if (next_gcode == 0 && !isPaused() && !sd_job)
+                {
                     next_gcode = gcode_in.next(); // may still be null if no data available
+                    job_bytes_read = start_offset + gcode_in.totalBytesRead();
+                    if (next_gcode != 0)
+                        next_gcode_offset = start_offset + gcode_in.consumedBytes();
+                }
 
                 if (!have_time)
                 {
@@ -1237,12 +2885,12 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                         printerState.setEstimatedPrintTime(gcode_in.estimatedPrintTime());
                     }
                     else
-                        printerState.setPrintedBytes(gcode_in.totalBytesRead());
+                        printerState.setPrintedBytes(start_offset + gcode_in.totalBytesRead());
                 }
 
                 if (next_gcode != 0)
                 {
-                    if (next_gcode->length() <= marlinbuf.maxAppendLen())
+                    if (marlinbuf.fits(next_gcode->data()))
                     {
                         if (next_gcode->startsWith("G28\b"))
                         {
@@ -1253,7 +2901,16 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                         }
 
                         action_on_printer = true;
-                        marlinbuf.append(next_gcode->data());
+                        if (next_gcode_offset >= 0)
+                        {
+                            progress.offset = next_gcode_offset;
+                            progress.state.update(*next_gcode);
+                            inflight[next_tag % ring] = progress;
+                            marlinbuf.append(next_gcode->data(), next_tag++);
+                            next_gcode_offset = -1;
+                        }
+                        else
+                            marlinbuf.append(next_gcode->data());
                         delete next_gcode;
                         next_gcode = 0;
                     }
@@ -1268,14 +2925,14 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
 
             serial.action("sending gcode to printer");
             serial.setNonBlock(false);
-            while (marlinbuf.hasNext() && !serial.hasError())
+            while (marlinbuf.hasNext() && !serial.hasError() && !settle_timer.scheduled())
             {
                 action_on_printer = true;
                 gcode::Line* gcode_to_send = new gcode::Line(marlinbuf.next());
-                serial.writeAll(gcode_to_send->data(), gcode_to_send->length());
+                int sent = send_gcode(serial, gcode_to_send->data(), gcode_to_send->length(), packing);
 
                 stats.gcodes++;
-                stats.bytes += gcode_to_send->length();
+                stats.bytes += sent; // what went over the wire
 
                 if (verbosity > 2)
                     stdoutbuf.put(gcode_to_send); // echo to stdout
@@ -1286,17 +2943,18 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
             if (isPaused())
                 printerState = PrinterState::Paused;
             else
-                printerState = (next_gcode != 0 && millis() - last_ok_time > STALL_TIME) ? PrinterState::Stalled
-                                                                                         : PrinterState::Printing;
+                printerState = (next_gcode != 0 && stalled) ? PrinterState::Stalled : PrinterState::Printing;
         } // while(action_on_printer)
 
         // Accept as socket connection if any is pending, then fork
         // and handle it in a child process.
         if (sock != 0)
         {
-            int connfd = sock->accept();
+            int connfd = accept_api_connection(sock);
             if (connfd >= 0)
             {
+                jobs.update(); // so that the child sees the current queue
+                files.refresh();
                 pid_t childpid = fork();
                 if (childpid < 0)
                 {
@@ -1312,6 +2970,7 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                     _exit(0);
                 }
                 close(connfd);
+                last_api_request = millis();
                 if (verbosity > 1)
                     fprintf(stdout, NEW_SOCKET_CONNECTION, childpid);
             }
@@ -1345,15 +3004,14 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
 
         if (marlinbuf.needsAck())
         {
-            if (last_lifesign == 0)
-                last_lifesign = millis();
-            if (millis() - last_lifesign > MAX_TIME_SILENCE)
-                return handle_error(e, "Printer timeout waiting for ack", iop, 3);
+            if (!silence_timer.scheduled())
+                timers.start(silence_timer, millis(), MAX_TIME_SILENCE);
         }
         else
         {
-            last_lifesign = 0;
-            if (in->EndOfFile() && next_gcode == 0)
+            timers.cancel(silence_timer);
+            bool done = sd_job ? !sd_active && resume_lines.empty() : in->EndOfFile();
+            if (done && next_gcode == 0 && !isAborted())
             {
                 if (!dummy)
                 {
@@ -1379,6 +3037,7 @@ bool handle(File& out, File& serial, const char* infile, File* sock, const char*
                 }
                 *iop = 0;
                 *e = "EOF on GCode source";
+                link_line = marlinbuf.nextNumber();
                 return true;
             }
         }
@@ -1448,7 +3107,10 @@ const char* HTTP_CREATED_JSON = "{\r\n"
                                 "  }\r\n"
                                 "}\r\n";
 
-int wait_empty_line(gcode::Reader& client_reader)
+// Reads the request headers up to and including the empty line that terminates
+// them. Returns the Content-Length. If encoding is not 0, the Content-Encoding
+// is stored there.
+int wait_empty_line(gcode::Reader& client_reader, Codec::Type* encoding = 0)
 {
     int contentlength = 0;
     for (;;)
@@ -1472,6 +3134,11 @@ int wait_empty_line(gcode::Reader& client_reader)
             line->slice(idx);
             contentlength = line->number();
         }
+        if (encoding != 0 && 0 < (idx = line->startsWith("Content-Encoding:\b")))
+        {
+            line->slice(idx);
+            *encoding = Codec::fromEncoding(line->data());
+        }
         delete line;
     }
     return contentlength;
@@ -1550,22 +3217,143 @@ void http_json(const char* json, File& client, gcode::Reader& client_reader, HTT
     _exit(1);
 }
 
+// Returns the path (malloc()ed) of the file that stores the GCodeAnalysis of
+// the file fpath, i.e. ".<name>.analysis" in the same directory.
+char* analysis_path(const char* fpath)
+{
+    const char* name = strrchr(fpath, '/');
+    char* path;
+    if (name == 0)
+        assert(0 < asprintf(&path, ".%s.analysis", fpath));
+    else
+        assert(0 < asprintf(&path, "%.*s/.%s.analysis", (int)(name - fpath), fpath, name + 1));
+    return path;
+}
+
+// Returns fname (malloc()ed) with "~<version>" inserted before the GCODE
+// extension, e.g. "cube~2.gcode.gz" for "cube.gcode.gz".
+char* versioned_name(const char* fname, int version)
+{
+    int len = strlen(fname);
+    Codec::Type t = Codec::fromName(fname);
+    if (t != Codec::NONE)
+        len -= strlen(Codec::suffix(t));
+    int ext = len - 1;
+    while (ext > 0 && fname[ext] != '.')
+        ext--;
+    if (ext <= 0) // no extension
+        ext = len;
+    char* name;
+    assert(0 < asprintf(&name, "%.*s~%d%s", ext, fname, version, fname + ext));
+    return name;
+}
+
+// Runs in a child process started by upload() and never returns. Analyzes the
+// GCODE in the file opened as fd while upload() is writing it and stores the result in
+// analysis_path(fpath). The analysis is finished when the parent closes done,
+// and it is discarded unless the parent has written a byte to done before
+// (which means the upload was successful). If the stored file is compressed
+// with codec, the analysis has to wait for the complete file.
+void analyze_upload(int fd, int done, Codec::Type codec, const char* fpath)
+{
+    File in("upload", fd);
+    GCodeAnalysis* analysis = new GCodeAnalysis(max_command_len());
+    char buf[65536];
+    int64_t consumed = 0;
+    bool complete = false;
+    bool ok = false;
+    for (;;)
+    {
+        if (codec == Codec::NONE || complete)
+        {
+            int n = read(in.fileDescriptor(), buf, sizeof(buf));
+            if (n > 0)
+            {
+                analysis->feed(buf, n);
+                consumed += n;
+                continue;
+            }
+            if (n < 0)
+                _exit(1);
+            if (complete)
+                break;
+        }
+
+        pollfd fds = {done, POLLIN, 0};
+        if (poll(&fds, 1, 100) > 0)
+        {
+            char ch;
+            ok = (read(done, &ch, 1) == 1);
+            complete = true;
+            if (ok && codec != Codec::NONE && !Codec::decompress(in, codec))
+                _exit(1);
+        }
+    }
+
+    if (!ok)
+        _exit(0);
+
+    // Multipart may have cut off data it had already written.
+    struct stat statbuf;
+    if (codec == Codec::NONE && in.stat(&statbuf) && statbuf.st_size < consumed)
+    {
+        delete analysis;
+        analysis = new GCodeAnalysis(max_command_len());
+        lseek(in.fileDescriptor(), 0, SEEK_SET);
+        for (int n; 0 < (n = read(in.fileDescriptor(), buf, sizeof(buf)));)
+            analysis->feed(buf, n);
+    }
+    analysis->finish();
+
+    char* json = analysis->toJSON();
+    char* path = analysis_path(fpath);
+    char* tmppath;
+    assert(0 < asprintf(&tmppath, "%s.tmp", path));
+    File f(tmppath);
+    f.action("storing GCODE analysis");
+    f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    f.writeAll(json, strlen(json));
+    f.move(path);
+    f.close();
+    if (f.hasError())
+        fprintf(stderr, "%s\n", f.error());
+    else if (verbosity > 0)
+        fprintf(stdout, "%s: %lld lines, %d layers, longest command %d bytes%s\n", fpath, (long long)analysis->lines,
+                analysis->layers, analysis->maxLineLength,
+                analysis->longLines > 0 ? " (TOO LONG FOR PRINTER BUFFER, PRINT WILL STALL)" : "");
+    _exit(0);
+}
+
 void upload(File& client, gcode::Reader& client_reader)
 {
     client_reader.whitespaceCompression(0); // preserve whitespace
     client_reader.commentChar('\n');        // do not handle comments
-    int contentlength = wait_empty_line(client_reader);
-    int contentread = 0;
-
-    const char* boundary = 0;
-    int len;
+    Codec::Type encoding = Codec::NONE;
+    int contentlength = wait_empty_line(client_reader, &encoding);
+
+    // Whatever client_reader has already read of the body goes to the parser.
+    char prefix[4096]; // more than gcode::Reader buffers
+    int prefix_len = 0;
+    for (int n; 0 < (n = client_reader.raw(prefix + prefix_len, sizeof(prefix) - prefix_len));)
+        prefix_len += n;
+
+    // A compressed request body is parsed from the output of a decompressor.
+    int decoded_fd = -1;
+    if (encoding != Codec::NONE)
+    {
+        decoded_fd = Codec::decodeStream(encoding, client, contentlength, prefix, prefix_len);
+        if (decoded_fd < 0)
+        {
+            perror("starting decompressor");
+            _exit(1);
+        }
+    }
+    File decoded("decompressed upload", decoded_fd);
+    Multipart multipart(decoded_fd < 0 ? client : decoded, decoded_fd < 0 ? contentlength : 0,
+                        decoded_fd < 0 ? prefix : 0, decoded_fd < 0 ? prefix_len : 0);
 
-    char* fname = 0;
-    char* file_line = 0;
     char* finished_fname = 0;
 
-    bool wait_for_file_start = false;
-
     // create temporary file
     char fpath[1024];
     snprintf(fpath, sizeof(fpath), "%s/upload-????", upload_dir);
@@ -1578,116 +3366,162 @@ void upload(File& client, gcode::Reader& client_reader)
 
     File tmp(tempname);
 
-    while (client_reader.hasNext())
+    // Read all parts, even those after the file, so that the client doesn't get
+    // a connection reset because of unread data.
+    for (char* headers; 0 != (headers = multipart.nextPart());)
     {
-        unique_ptr<gcode::Line> line(client_reader.next());
-        contentread += line->length();
+        if (verbosity > 1)
+            out.writeAll(headers, strlen(headers));
 
-        if (boundary == 0 && line->startsWith("--"))
+        char* fname = 0;
+        if (finished_fname == 0 && strstr(headers, "form-data") != 0)
         {
-            if (verbosity > 1)
-                out.writeAll(line->data(), line->length());
-            boundary = strdup(line->data());
+            gcode::Line h(headers);
+            fname = h.getString("filename");
         }
-        else if (0 != (len = line->startsWith(boundary)) && (line->length() == len))
-        {
-            if (verbosity > 1)
-                out.writeAll(line->data(), line->length());
+        free(headers);
 
-            if (file_line)
-            {
-                out.clearError(); // In case we wrote too fast and ran into EWOULDBLOCK
+        if (fname == 0)
+        {
+            multipart.body(0);
+            continue;
+        }
 
-                // Translate evil characters to _
-                finished_fname = strdup(fname);
-                for (unsigned char* p = (unsigned char*)finished_fname; *p != 0; p++)
-                    if (!(*p > 127 || isalnum(*p) || *p == '_' || *p == '-' || *p == '+' || *p == '.' || *p == ','))
-                        *p = '_';
+        if (verbosity > 1)
+        {
+            char msg[512];
+            int len = snprintf(msg, sizeof(msg), "Storing upload data in temporary file '%s'\n", tempname);
+            if (len >= 512)
+                len = 511;
+            out.writeAll(msg, len);
+        }
 
-                if (verbosity > 1)
-                {
-                    char msg[1024];
-                    int len =
-                        snprintf(msg, sizeof(msg), "Renaming temporary file '%s' => '%s'\n", tempname, finished_fname);
-                    if (len >= (int)sizeof(msg))
-                        len = sizeof(msg) - 1;
-                    out.writeAll(msg, len);
-                }
+        tmp.open(O_RDWR); // O_RDWR allows Multipart to use splice()
 
-                char* newpath;
-                assert(0 < asprintf(&newpath, "%s/%s", upload_dir, finished_fname));
-                tmp.move(newpath);
-                tmp.close();
+        // Compress with --compress unless the file is compressed already.
+        Codec::Type store = (Codec::fromName(fname) == Codec::NONE) ? upload_compression : Codec::NONE;
+        Codec::Type stored_codec = (store == Codec::NONE) ? Codec::fromName(fname) : store;
+        if (store != Codec::NONE)
+        {
+            char* compressed_name;
+            assert(0 <= asprintf(&compressed_name, "%s%s", fname, Codec::suffix(store)));
+            free(fname);
+            fname = compressed_name;
+        }
 
-                if (tmp.hasError())
-                    fprintf(stderr, "%s\n", tmp.error());
+        // Translate evil characters to _
+        for (unsigned char* p = (unsigned char*)fname; *p != 0; p++)
+            if (!(*p > 127 || isalnum(*p) || *p == '_' || *p == '-' || *p == '+' || *p == '.' || *p == ','))
+                *p = '_';
+
+        char* newpath;
+        assert(0 < asprintf(&newpath, "%s/%s", upload_dir, fname));
+
+        // A file that is printing or queued is not replaced. Because the upload
+        // goes to a new inode that is renamed into place, the print could
+        // continue from its open file descriptor, but queued jobs and a resume
+        // after a crash (which checks the mtime) would get the wrong version.
+        // So a re-upload becomes a new version of the file with its own job.
+        char* base = strdup(fname);
+        for (int version = 2; file_pinned(newpath); version++)
+        {
+            free(fname);
+            free(newpath);
+            fname = versioned_name(base, version);
+            assert(0 < asprintf(&newpath, "%s/%s", upload_dir, fname));
+        }
+        free(base);
 
-                free(fname);
-                free(file_line);
-                fname = 0;
-                file_line = 0;
-                break;
+        // The analysis reads the file while it is being written. It gets its own
+        // file descriptor because the file may be renamed before the child runs.
+        int done[2];
+        int analysis_fd = ::open(tempname, O_RDONLY);
+        if (analysis_fd >= 0 && pipe(done) == 0)
+        {
+            if (fork() == 0)
+            {
+                for (int fd = 3; fd < 1024; fd++) // don't keep the client connection open
+                    if (fd != done[0] && fd != analysis_fd)
+                        close(fd);
+                analyze_upload(analysis_fd, done[0], stored_codec, newpath);
             }
+            close(done[0]);
         }
-        else if (fname != 0)
+        else
+            done[1] = -1;
+        if (analysis_fd >= 0)
+            close(analysis_fd);
+
+        int64_t body_len;
+        if (store == Codec::NONE)
+            body_len = multipart.body(&tmp);
+        else
         {
-            if (wait_for_file_start)
+            int pfd[2];
+            pid_t pid = -1;
+            if (pipe(pfd) == 0)
             {
-                if (verbosity > 1)
-                    out.writeAll(line->data(), line->length());
-                wait_for_file_start = !(line->data()[0] == '\r' && line->data()[1] == '\n');
+                pid = Codec::spawn(store, false, pfd[0], tmp.fileDescriptor());
+                close(pfd[0]);
             }
-            else
+            if (pid < 0)
             {
-                if (file_line)
-                {
-                    if (verbosity > 2)
-                        out.writeAll(".", 1); // one dot per line
-                    tmp.writeAll(file_line, strlen(file_line));
-                }
-                else
-                {
-                    if (verbosity > 1)
-                    {
-                        char msg[512];
-                        int len = snprintf(msg, sizeof(msg), "Storing upload data in temporary file '%s'\n", tempname);
-                        if (len >= 512)
-                            len = 511;
-                        out.writeAll(msg, len);
-                    }
-
-                    tmp.open(O_WRONLY);
-                }
-                free(file_line);
-                file_line = strdup(line->data());
+                perror("starting compressor");
+                _exit(1);
             }
+            File compressor("compressor", pfd[1]);
+            body_len = multipart.body(&compressor);
+            close(pfd[1]);
+            waitpid(pid, 0, 0); // returns when the compressor is done (SIGCHLD is ignored)
         }
-        else if ((finished_fname == 0) && line->startsWith("Content-Disposition:\bform-data\b"))
+
+        if (body_len < 0)
         {
-            if (verbosity > 1)
-                out.writeAll(line->data(), line->length());
-            fname = line->getString("filename");
-            wait_for_file_start = (fname != 0);
+            close(done[1]); // without success byte => no analysis
+            free(newpath);
+            free(fname);
+            break;
         }
-        else if (verbosity > 1)
-            out.writeAll(line->data(), line->length());
+
+        out.clearError(); // In case we wrote too fast and ran into EWOULDBLOCK
+
+        finished_fname = fname;
+
+        if (verbosity > 1)
+        {
+            char msg[1024];
+            int len = snprintf(msg, sizeof(msg), "Renaming temporary file '%s' => '%s'\n", tempname, finished_fname);
+            if (len >= (int)sizeof(msg))
+                len = sizeof(msg) - 1;
+            out.writeAll(msg, len);
+        }
+
+        tmp.move(newpath);
+        tmp.close();
+
+        if (tmp.hasError())
+            fprintf(stderr, "%s\n", tmp.error());
+        else
+        {
+            if (done[1] >= 0 && write(done[1], "", 1) != 1)
+                perror("signalling GCODE analysis");
+            jobs.add(newpath);
+            jobs.sync();
+        }
+        close(done[1]);
     }
 
     if (tmp.fileDescriptor() >= 0)
+    {
         fprintf(stderr, "Premature end of upload data\n");
+        tmp.close();
+        unlink(tempname);
+    }
+    else if (finished_fname == 0)
+        unlink(tempname);
 
     if (finished_fname)
     {
-        // Read remainder of multipart MIME data
-        int dis = client_reader.discard();
-        contentread += dis;
-        contentlength -= contentread;
-        if (contentlength > 0 && contentlength < 65536)
-        {
-            char buf[contentlength];
-            client.read(buf, sizeof(buf), 200, 2000, 200);
-        }
-
         const char* location;
         if (0 >= asprintf((char**)&location, "Location: %s/api/files/local/%s\r\n", api_base_url, finished_fname))
             location = "";
@@ -1741,6 +3575,8 @@ void touch_file(gcode::Line& request, File& client, gcode::Reader& client_reader
                         if (f.stat(&statbuf) && S_ISREG(statbuf.st_mode))
                         {
                             utime(fpath, 0);
+                            jobs.add(fpath);
+                            jobs.sync();
                             char* reply;
                             len = asprintf(&reply, HTTP_HEADERS, HTTPCodeNum[NoContent], HTTPCodeDesc[NoContent], "", 0,
                                            "text/html", "");
@@ -1931,6 +3767,124 @@ void job_command(File& client, gcode::Reader& client_reader)
     _exit(1);
 }
 
+// Handles GET /api/files/local/<name>.
+void file_info(gcode::Line& request, File& client, gcode::Reader& client_reader)
+{
+    request.slice(strlen("files/local/"));
+    const char* space = strchr(request.data(), ' ');
+    if (space != 0)
+        request.slice(0, space - request.data());
+    const FileIndex::Entry* entry = files.find(request.data());
+    if (entry == 0)
+        http_error(request.data(), 1, client, client_reader, NotFound);
+    http_json(entry->json, client, client_reader, OK);
+}
+
+// Handles POST /api/queue/<id> with {"command":"cancel"} or
+// {"command":"move", "position":<n>}.
+void queue_command(gcode::Line& request, File& client, gcode::Reader& client_reader)
+{
+    char* endptr;
+    long long id = strtoll(request.data() + strlen("queue/"), &endptr, 10);
+    bool have_id = (endptr != request.data() + strlen("queue/") && (*endptr == ' ' || *endptr == '\t'));
+
+    client_reader.whitespaceCompression(0); // preserve whitespace
+    client_reader.commentChar('\n');        // do not handle comments
+    int contentlength = wait_empty_line(client_reader);
+
+    bool done = false;
+
+    if (contentlength > 0 && contentlength < 65536 && have_id)
+    {
+        char buf[contentlength + 1];
+        int i = client_reader.raw(buf, contentlength);
+        contentlength = client.read(buf + i, contentlength - i, 200, 2000);
+
+        if (contentlength >= 0)
+        {
+            contentlength += i;
+            buf[contentlength] = 0;
+
+            gcode::Line line(buf);
+
+            char* cmd = line.getString("\"command\"");
+            if (cmd)
+            {
+                jobs.update();
+                if (jobs.isQueued(id))
+                {
+                    if (strcmp(cmd, "cancel") == 0)
+                    {
+                        jobs.cancel(id);
+                        done = true;
+                    }
+                    else if (strcmp(cmd, "move") == 0)
+                    {
+                        const char* pos = strstr(buf, "\"position\"");
+                        if (pos != 0)
+                        {
+                            pos += strlen("\"position\"");
+                            while (*pos == ' ' || *pos == ':')
+                                pos++;
+                            long to = strtol(pos, &endptr, 10);
+                            if (endptr != pos && to >= 0)
+                            {
+                                jobs.move(id, to);
+                                done = true;
+                            }
+                        }
+                    }
+                }
+                free(cmd);
+            }
+        }
+    }
+
+    if (done)
+    {
+        jobs.sync();
+        char* reply;
+        int len =
+            asprintf(&reply, HTTP_HEADERS, HTTPCodeNum[NoContent], HTTPCodeDesc[NoContent], "", 0, "text/html", "");
+        if (len > 0)
+        {
+            client.writeAll(reply, len);
+            if (verbosity > 1)
+                out.writeAll(reply, len);
+        }
+        _exit(0);
+    }
+
+    const char* content =
+        "<!DOCTYPE html><html><head><title>Error</title></head><body><h1>Unsupported Queue Action</h1></body></html>";
+    char* reply;
+    int len = asprintf(&reply, HTTP_HEADERS, HTTPCodeNum[NotFound], HTTPCodeDesc[NotFound], "", strlen(content),
+                       "text/html", content);
+    if (len > 0)
+    {
+        client.writeAll(reply, len);
+        out.writeAll(reply, len);
+    }
+    _exit(1);
+}
+
+// Answers the API request on fd with NotFound.
+void api_not_found(int fd)
+{
+    File client("API request", fd);
+    gcode::Reader client_reader(client);
+    client_reader.whitespaceCompression(1);
+    Line* request = client_reader.next();
+    http_error(request ? request->data() : "", 1, client, client_reader, NotFound);
+}
+
+// In multi-printer mode, removes the "/<n>" from the start of the request path.
+void strip_path_prefix(Line& request)
+{
+    if (api_path_prefix != 0 && request.startsWith(api_path_prefix))
+        request.slice(strlen(api_path_prefix) - 1); // keep the '/'
+}
+
 void handle_socket_connection(int fd)
 {
     // union {
@@ -1998,6 +3952,7 @@ void handle_socket_connection(int fd)
     if (0 < (idx = (request->startsWith("get\b") + request->startsWith("GET\b"))))
     {
         request->slice(idx);
+        strip_path_prefix(*request);
         if (request->startsWith("/plugin/appkeys/probe\b"))
             http_error("/plugin/appkeys/probe", 2, client, client_reader, NotFound);
 
@@ -2012,6 +3967,12 @@ void handle_socket_connection(int fd)
                 http_json(printerState.toJSON(), client, client_reader, OK);
             else if (request->startsWith("job\b"))
                 http_json(printerState.jobJSON(), client, client_reader, OK);
+            else if (request->startsWith("queue\b"))
+                http_json(jobs.toJSON(), client, client_reader, OK);
+            else if (request->startsWith("files/local/"))
+                file_info(*request, client, client_reader);
+            else if (request->startsWith("files\b"))
+                http_json(files.listing(), client, client_reader, OK);
             else if (request->startsWith("printerprofiles\b"))
                 http_error("/api/printerprofiles", 2, client, client_reader, NotFound);
         }
@@ -2019,6 +3980,7 @@ void handle_socket_connection(int fd)
     else if (0 < (idx = (request->startsWith("post\b") + request->startsWith("POST\b"))))
     {
         request->slice(idx);
+        strip_path_prefix(*request);
         if (request->startsWith("/api/"))
         {
             request->slice(5);
@@ -2026,6 +3988,8 @@ void handle_socket_connection(int fd)
                 http_json(login_json(), client, client_reader, OK);
             else if (request->startsWith("job\b"))
                 job_command(client, client_reader);
+            else if (request->startsWith("queue/"))
+                queue_command(*request, client, client_reader);
             else if (request->startsWith("files/local/"))
                 touch_file(*request, client, client_reader);
             else if (request->startsWith("files/local\b"))
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MEATPACK_H
+#define MEATPACK_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The MeatPack serial compression protocol supported by Marlin (if compiled
+// with MEATPACK). The 15 most common characters in GCODE are sent as 4-bit
+// codes, two to a byte. A code of 0b1111 means that the character could not be
+// packed and follows as a full byte. The first character of a pair is in the
+// lower 4 bits. After a packed '\n' in the lower 4 bits the upper 4 bits are
+// ignored, so every line starts on a byte boundary.
+// The host switches packing on and off by sending 0xFF 0xFF <command>, to which
+// the firmware replies with its state, e.g. "[MP] PV01 ON ESP".
+class MeatPack
+{
+  public:
+    enum Command
+    {
+        ENABLE_PACKING = 0xFB,
+        DISABLE_PACKING = 0xFA,
+        RESET_ALL = 0xF9,
+        QUERY_CONFIG = 0xF8,
+        ENABLE_NO_SPACES = 0xF7,
+        DISABLE_NO_SPACES = 0xF6
+    };
+
+    static const unsigned char SIGNAL_BYTE = 0xFF;
+    static const int NOT_PACKED = 0xF;
+
+    // Stores the 3 byte sequence that sends command c to the printer in out.
+    static void command(Command c, char* out)
+    {
+        out[0] = out[1] = (char)SIGNAL_BYTE;
+        out[2] = (char)c;
+    }
+
+    // Returns the 4-bit code for ch or NOT_PACKED.
+    static int code(char ch)
+    {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        switch (ch)
+        {
+            case '.':
+                return 0xA;
+            case ' ':
+                return 0xB;
+            case '\n':
+                return 0xC;
+            case 'G':
+                return 0xD;
+            case 'X':
+                return 0xE;
+        }
+        return NOT_PACKED;
+    }
+
+    // Returns the character for code c (0 to 14). In no-spaces mode, 0xB stands for 'E'.
+    static char character(int c, bool no_spaces = false)
+    {
+        static const char chars[] = "0123456789. \nGX";
+        return (c == 0xB && no_spaces) ? 'E' : chars[c];
+    }
+
+    // The largest possible result of pack() for len bytes of input.
+    static int maxPackedLength(int len) { return len + (len + 1) / 2 + 1; }
+
+    // Packs the len bytes of text at data, which should consist of complete
+    // lines, and stores the result in out (which needs room for
+    // maxPackedLength(len) bytes). If out is 0, only the length is computed.
+    // Returns the number of bytes of the packed text.
+    static int pack(const char* data, int len, char* out = 0)
+    {
+        int n = 0;
+        for (int i = 0; i < len;)
+        {
+            char c1 = data[i++];
+            int p1 = code(c1);
+            // '\n' ends the byte. A last character without '\n' is padded with a space.
+            char c2 = (c1 == '\n') ? '\n' : (i < len) ? data[i++] : ' ';
+            int p2 = code(c2);
+            if (out != 0)
+            {
+                out[n] = (char)((p2 << 4) | p1);
+                if (p1 == NOT_PACKED)
+                    out[++n] = c1;
+                if (p2 == NOT_PACKED)
+                    out[++n] = c2;
+            }
+            else
+                n += (p1 == NOT_PACKED) + (p2 == NOT_PACKED);
+            n++;
+        }
+        return n;
+    }
+
+    // Number of bytes plain() adds to a line.
+    static const int PLAIN_OVERHEAD = 7;
+
+    // Stores the bytes that send the len bytes at line (one complete line) as
+    // plain text while packing is on in out, which needs room for
+    // len + PLAIN_OVERHEAD bytes, and returns their number. Packing is switched
+    // off for the line and on again after it. The line is preceded by an empty
+    // line, so that a parser that looks at the bytes before they are unpacked
+    // (like Marlin's EMERGENCY_PARSER) sees it at the start of a line.
+    static int plain(const char* line, int len, char* out)
+    {
+        command(DISABLE_PACKING, out);
+        out[3] = '\n';
+        memcpy(out + 4, line, len);
+        command(ENABLE_PACKING, out + 4 + len);
+        return len + PLAIN_OVERHEAD;
+    }
+
+    // The printer side of the protocol, as implemented by Marlin's meatpack.cpp.
+    class Decoder
+    {
+        bool active;
+        bool no_spaces;
+
+        // Number of SIGNAL_BYTEs seen in a row (0 or 1).
+        int signal_count;
+
+        // true if the next byte is a command.
+        bool command_next;
+
+        // Number of full bytes still to come for the current pair.
+        int full_count;
+
+        // The unpacked second character of a pair whose first character is a full byte; 0 if none.
+        char second;
+
+        // true if a command has been received since the last call of report().
+        bool report_pending;
+
+        int inner(unsigned char c, char* out)
+        {
+            if (!active)
+            {
+                out[0] = c;
+                return 1;
+            }
+            if (full_count > 0)
+            {
+                int n = 0;
+                out[n++] = c;
+                if (second != 0)
+                {
+                    out[n++] = second;
+                    second = 0;
+                }
+                full_count--;
+                return n;
+            }
+            int p1 = c & 0xF;
+            int p2 = c >> 4;
+            if (p1 == NOT_PACKED)
+            {
+                full_count = 1 + (p2 == NOT_PACKED);
+                if (p2 != NOT_PACKED)
+                    second = character(p2, no_spaces);
+                return 0;
+            }
+            int n = 0;
+            out[n++] = character(p1, no_spaces);
+            if (out[0] != '\n')
+            {
+                if (p2 == NOT_PACKED)
+                    full_count = 1;
+                else
+                    out[n++] = character(p2, no_spaces);
+            }
+            return n;
+        }
+
+        void execute(unsigned char c)
+        {
+            switch (c)
+            {
+                case ENABLE_PACKING:
+                    active = true;
+                    break;
+                case DISABLE_PACKING:
+                    active = false;
+                    break;
+                case RESET_ALL:
+                    active = no_spaces = false;
+                    break;
+                case ENABLE_NO_SPACES:
+                    no_spaces = true;
+                    break;
+                case DISABLE_NO_SPACES:
+                    no_spaces = false;
+                    break;
+            }
+            full_count = 0;
+            second = 0;
+            report_pending = true;
+        }
+
+      public:
+        Decoder()
+            : active(false), no_spaces(false), signal_count(0), command_next(false), full_count(0), second(0),
+              report_pending(false)
+        {
+        }
+
+        // Decodes len bytes from in and stores the result in out, which must have
+        // room for 2*len bytes. Returns the number of bytes stored.
+        int decode(const char* in, int len, char* out)
+        {
+            int n = 0;
+            for (int i = 0; i < len; i++)
+            {
+                unsigned char c = in[i];
+                if (command_next)
+                {
+                    command_next = false;
+                    execute(c);
+                }
+                else if (c == SIGNAL_BYTE)
+                {
+                    if (signal_count > 0)
+                    {
+                        command_next = true;
+                        signal_count = 0;
+                    }
+                    else
+                        signal_count++;
+                }
+                else
+                {
+                    if (signal_count > 0)
+                    {
+                        n += inner(SIGNAL_BYTE, out + n);
+                        signal_count = 0;
+                    }
+                    n += inner(c, out + n);
+                }
+            }
+            return n;
+        }
+
+        bool isActive() { return active; }
+
+        // Returns the state report ("[MP] ...\n") the firmware sends in reply to a
+        // command, or 0 if no command has been received since the last call.
+        const char* report()
+        {
+            if (!report_pending)
+                return 0;
+            report_pending = false;
+            if (active)
+                return no_spaces ? "[MP] PV01 ON NSP\n" : "[MP] PV01 ON ESP\n";
+            return no_spaces ? "[MP] PV01 OFF NSP\n" : "[MP] PV01 OFF ESP\n";
+        }
+    };
+};
+
+#endif
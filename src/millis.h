@@ -11,4 +11,12 @@ int64_t millis()
     return (int64_t)tv.tv_sec * 1000 + (tv.tv_usec + 500) / 1000;
 }
 
+// Unix timestamp in microseconds.
+int64_t micros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 #endif
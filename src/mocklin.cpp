@@ -19,20 +19,24 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <errno.h>
 #include <math.h>
 #include <memory>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "arg.h"
-
-#include "arg.h"
+#include "binproto.h"
 #include "fifo.h"
 #include "file.h"
 #include "gcode.h"
 #include "marlinbuf.h"
+#include "meatpack.h"
 #include "millis.h"
 
 using gcode::Line;
@@ -40,12 +44,19 @@ using std::unique_ptr;
 
 extern const char* WELCOME_TEXT;
 extern const char* WELCOME_TEXT2;
+extern const char* FIRMWARE_INFO;
 
 enum optionIndex
 {
     UNKNOWN,
     HELP,
-    RESEND
+    RESEND,
+    MEATPACK,
+    BINARY,
+    COST,
+    BAUD,
+    RXBUF,
+    TXDELAY
 };
 const option::Descriptor usage[] =
 
@@ -61,6 +72,25 @@ const option::Descriptor usage[] =
       "  \t--resend[=<when>,<what>]"
       "  \tEvery other time mocklin receives a command with line number <when>, "
       "mocklin will request a resend of line number <what>."},
+     {MEATPACK, 0, "", "meatpack", Arg::None,
+      "  \t--meatpack  \tSupport the MeatPack protocol like Marlin built with MEATPACK."},
+     {BINARY, 0, "", "binary", Arg::None,
+      "  \t--binary  \tSupport transferring files to the SD card with the binary protocol like Marlin built with "
+      "BINARY_FILE_TRANSFER."},
+     {COST, 0, "", "cost", Arg::Numeric,
+      "  \t--cost=<microseconds>  \tProcessing time per command, which limits the number of commands per second "
+      "like a real board's CPU does. Roughly 1000 for a slow 8-bit board, 50 for a fast 32-bit board. The default "
+      "is 0, i.e. as fast as possible."},
+     {BAUD, 0, "", "baud", Arg::Numeric,
+      "  \t--baud=<bits/s>  \tEmulate a serial line of this speed (8N1, i.e. <bits/s>/10 bytes per second) in both "
+      "directions. 0 (the default) means unlimited."},
+     {RXBUF, 0, "", "rxbuf", Arg::Numeric,
+      "  \t--rxbuf=<bytes>  \tSize of the emulated serial receive buffer. Data that arrives while it is full is "
+      "lost, like it is with a real printer whose host ignores the buffer size. Default: 128 like Marlin's "
+      "RX_BUFFER_SIZE."},
+     {TXDELAY, 0, "", "txdelay", Arg::Numeric,
+      "  \t--txdelay=<microseconds>  \tDelay before a reply is passed to the host, e.g. to emulate the polling "
+      "interval of a USB serial adapter."},
      {UNKNOWN, 0, "", "", Arg::None, "\n"},
      {0, 0, 0, 0, 0, 0}};
 
@@ -69,6 +99,27 @@ void handle_connection(int fd);
 long resend_when = LONG_MIN;
 long resend_what = LONG_MIN;
 bool resend_toggle = true;
+bool meatpack = false;
+bool binary_transfer = false;
+
+// See --cost.
+int64_t command_cost = 0;
+
+// See --baud, --rxbuf and --txdelay. The serial line is only emulated if one of them is given.
+bool emulate_uart = false;
+int uart_baud = 0;
+int uart_rxbuf = 128;
+int uart_txdelay = 0;
+
+// micros() before which the next command can't be processed because of command_cost.
+int64_t busy_until = 0;
+
+// true after M28 B1 until the binary protocol's CLOSE.
+bool binary_mode = false;
+
+// The File the gcode::Reader reads from. Either the connection or, with
+// --meatpack, the pipe that carries the decoded data.
+File* rx = 0;
 
 struct PrinterState
 {
@@ -79,8 +130,37 @@ struct PrinterState
     double nozzle = 22.3;
     double nozzle_target = 23.4;
     bool relative = false;
+    int autoreport_seconds = 0; // M155 interval; 0 if off
+    int64_t next_autoreport = 0;
 } p;
 
+// The SD card. Files are kept in memory.
+struct SDFile
+{
+    char* name;
+    char* data;
+    int64_t size;
+    SDFile* next;
+};
+SDFile* sd_files = 0;
+
+struct SDState
+{
+    SDFile* selected = 0; // M23
+    int64_t pos = 0;      // offset of the next line to be read from selected
+    bool printing = false;
+    int autoreport_seconds = 0; // M27 S interval; 0 if off
+    int64_t next_autoreport = 0;
+} sd;
+
+// The file being written with the binary protocol.
+struct BinaryUpload
+{
+    SDFile* file = 0;
+    bool compressed = false;
+    Heatshrink::Decoder decoder;
+} upload;
+
 void report_position() { fprintf(stdout, "X %5.1f  Y %5.1f  Z %5.1f\n", p.X, p.Y, p.Z); }
 
 int main(int argc, char* argv[])
@@ -116,6 +196,30 @@ int main(int argc, char* argv[])
             case RESEND:
                 resend_when = strtol(opt.arg, 0, 10);
                 resend_what = strtol(strchr(opt.arg, ',') + 1, 0, 10);
+                break;
+            case MEATPACK:
+                meatpack = true;
+                break;
+            case BINARY:
+                binary_transfer = true;
+                break;
+            case COST:
+                command_cost = strtol(opt.arg, 0, 10);
+                break;
+            case BAUD:
+                uart_baud = strtol(opt.arg, 0, 10);
+                emulate_uart = true;
+                break;
+            case RXBUF:
+                uart_rxbuf = strtol(opt.arg, 0, 10);
+                if (uart_rxbuf < 1)
+                    uart_rxbuf = 1;
+                emulate_uart = true;
+                break;
+            case TXDELAY:
+                uart_txdelay = strtol(opt.arg, 0, 10);
+                emulate_uart = true;
+                break;
             case UNKNOWN:
                 // not possible because Arg::Unknown returns ARG_ILLEGAL
                 // which aborts the parse with an error
@@ -194,7 +298,7 @@ void ok_to_send(File& peer)
 
 struct Block
 {
-    int64_t endTimeMillis;
+    int64_t endTimeMicros;
     double X;
     double Y;
     double Z;
@@ -204,6 +308,10 @@ struct Block
 const int BLOCK_BUFFER_SIZE = 16;
 FIFO<Block> block_fifo;
 
+// endTimeMicros and position of the last block put into block_fifo.
+int64_t planner_end = 0;
+double planner_X = 0, planner_Y = 0, planner_Z = 0;
+
 /**
  * Send a "Resend: nnn" message to the host to
  * indicate that a command needs to be re-sent.
@@ -215,7 +323,7 @@ void flush_and_request_resend(gcode::Reader& reader, File& peer)
     // https://github.com/MarlinFirmware/Marlin/issues/18955
     reader.discard();
     char buf[1024];
-    peer.tail(buf, sizeof(buf), 0, 0);
+    rx->tail(buf, sizeof(buf), 0, 0);
     int len = snprintf(buf, sizeof(buf), "%s%ld\nok\n", MSG_RESEND, gcode_LastN + 1);
     if (len >= (int)sizeof(buf))
         len = sizeof(buf) - 1; // -1 because of 0 terminator
@@ -258,11 +366,12 @@ void unknown_command_error(File& peer, const char* gcode)
     fprintf(stdout, "%s", sendbuf);
 }
 
-void report_temperatures(File& peer)
+// If ok is false, the report is sent without "ok " prefix like Marlin's M155 auto-report.
+void report_temperatures(File& peer, bool ok = true)
 {
     char sendbuf[1024];
-    int len = snprintf(sendbuf, sizeof(sendbuf), "ok T:%.1f /%.1f B:%.1f /%.1f T0:%.1f /%.1f @:0 B@:0\n", p.nozzle,
-                       p.nozzle_target, p.bed, p.bed_target, p.nozzle, p.nozzle_target);
+    int len = snprintf(sendbuf, sizeof(sendbuf), "%sT:%.1f /%.1f B:%.1f /%.1f T0:%.1f /%.1f @:0 B@:0\n",
+                       ok ? "ok " : "", p.nozzle, p.nozzle_target, p.bed, p.bed_target, p.nozzle, p.nozzle_target);
     if (len >= (int)sizeof(sendbuf))
         len = sizeof(sendbuf) - 1; // -1 because of 0 terminator
     peer.writeAll(sendbuf, len);
@@ -273,13 +382,26 @@ void plan_move(double x0, double y0, double z0, double feed)
 {
     if (feed < 60) // don't allow less than 1mm/s
         feed = 60;
-    double x1 = x0 - p.X;
-    double y1 = y0 - p.Y;
-    double z1 = z0 - p.Z;
+    if (block_fifo.empty())
+    {
+        planner_X = p.X;
+        planner_Y = p.Y;
+        planner_Z = p.Z;
+    }
+    double x1 = x0 - planner_X;
+    double y1 = y0 - planner_Y;
+    double z1 = z0 - planner_Z;
+    planner_X = x0;
+    planner_Y = y0;
+    planner_Z = z0;
     double dist = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
     double minutes = dist / feed;
-    int wait_millis = int(minutes * 60 * 1000);
-    block_fifo.put(new Block{wait_millis + millis(), x0, y0, z0});
+    // Blocks are executed one after the other.
+    int64_t start = micros();
+    if (planner_end > start)
+        start = planner_end;
+    planner_end = start + int64_t(minutes * 60 * 1000000);
+    block_fifo.put(new Block{planner_end, x0, y0, z0});
 }
 
 void sync_planner()
@@ -289,37 +411,213 @@ void sync_planner()
         Block* b = block_fifo.get();
         if (b == 0)
             break;
-        int64_t t = b->endTimeMillis - millis();
+        int64_t t = b->endTimeMicros - micros();
         p.X = b->X;
         p.Y = b->Y;
         p.Z = b->Z;
         delete b;
         if (t > 0)
-            usleep(t * 1000);
+            usleep(t);
         report_position();
     }
 }
 
+// Like Marlin's EMERGENCY_PARSER, which acts on some commands as soon as they
+// arrive, ahead of the commands waiting in the buffers. It looks at the bytes
+// as they come in, i.e. before MeatPack unpacks them, and only recognizes a
+// line whose command word is M410 (optionally after a line number). The command
+// is queued anyway and acked like any other.
+struct EmergencyParser
+{
+    enum State
+    {
+        LINE_START,
+        LINE_NUMBER,
+        M,
+        M4,
+        M41,
+        M410,
+        IGNORE // rest of a line that is not an emergency command
+    } state = LINE_START;
+
+    void quickstop()
+    {
+        for (Block* b; 0 != (b = block_fifo.get());)
+            delete b;
+        planner_end = 0;
+        fprintf(stdout, "Quickstop: planner buffer discarded\n");
+    }
+
+    void update(const char* data, int len)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            char c = data[i];
+            if (c == '\n' || c == '\r')
+            {
+                if (state == M410)
+                    quickstop();
+                state = LINE_START;
+                continue;
+            }
+            switch (state)
+            {
+                case LINE_START:
+                    state = (c == 'N') ? LINE_NUMBER : (c == 'M') ? M : (c == ' ') ? LINE_START : IGNORE;
+                    break;
+                case LINE_NUMBER:
+                    state = (isdigit(c) || c == '-' || c == ' ') ? LINE_NUMBER : (c == 'M') ? M : IGNORE;
+                    break;
+                case M:
+                    state = (c == '4') ? M4 : IGNORE;
+                    break;
+                case M4:
+                    state = (c == '1') ? M41 : IGNORE;
+                    break;
+                case M41:
+                    state = (c == '0') ? M410 : IGNORE;
+                    break;
+                case M410:
+                    if (!isdigit(c)) // e.g. the ' ' or '*' after "M410"
+                        quickstop();
+                    state = IGNORE;
+                    break;
+                case IGNORE:
+                    break;
+            }
+        }
+    }
+} emergency_parser;
+
+// Removes the blocks that have been completed by now.
 void check_planner()
 {
-    if (block_fifo.empty() || block_fifo.peek().endTimeMillis > millis())
-        return;
-    Block* b = block_fifo.get();
-    p.X = b->X;
-    p.Y = b->Y;
-    p.Z = b->Z;
-    delete b;
-    report_position();
+    while (!block_fifo.empty() && block_fifo.peek().endTimeMicros <= micros())
+    {
+        Block* b = block_fifo.get();
+        p.X = b->X;
+        p.Y = b->Y;
+        p.Z = b->Z;
+        delete b;
+        report_position();
+    }
+}
+
+void reply(File& peer, const char* msg)
+{
+    peer.writeAll(msg, strlen(msg));
+    fprintf(stdout, "%s", msg);
+}
+
+// Returns the file called name (case-insensitive like FAT) or 0.
+SDFile* sd_find(const char* name)
+{
+    for (SDFile* f = sd_files; f != 0; f = f->next)
+        if (strcasecmp(f->name, name) == 0)
+            return f;
+    return 0;
+}
+
+bool sd_delete(const char* name)
+{
+    for (SDFile** f = &sd_files; *f != 0; f = &(*f)->next)
+        if (strcasecmp((*f)->name, name) == 0)
+        {
+            SDFile* del = *f;
+            *f = del->next;
+            if (sd.selected == del)
+            {
+                sd.selected = 0;
+                sd.printing = false;
+            }
+            free(del->name);
+            free(del->data);
+            delete del;
+            return true;
+        }
+    return false;
+}
+
+// Creates an empty file called name, replacing an existing one.
+SDFile* sd_create(const char* name)
+{
+    sd_delete(name);
+    sd_files = new SDFile{strdup(name), 0, 0, sd_files};
+    return sd_files;
+}
+
+// Returns the file name argument of gcode (e.g. M23), malloc()ed.
+char* sd_argument(const char* gcode)
+{
+    const char* start = gcode;
+    while (*start != 0 && !isspace(*start))
+        start++;
+    while (isspace(*start))
+        start++;
+    const char* end = start;
+    while (*end != 0 && !isspace(*end) && *end != '*')
+        end++;
+    return strndup(start, end - start);
 }
 
-void process_next_command(File& peer)
+void report_sd_status(File& peer)
+{
+    char sendbuf[1024];
+    if (sd.printing)
+        snprintf(sendbuf, sizeof(sendbuf), "SD printing byte %lld/%lld\n", (long long)sd.pos,
+                 (long long)sd.selected->size);
+    else
+        snprintf(sendbuf, sizeof(sendbuf), "Not SD printing\n");
+    reply(peer, sendbuf);
+}
+
+// Reads commands from the file being printed from SD into cmd_fifo like
+// Marlin's card reader does. One place is left for commands from the host.
+void sd_feed(File& peer)
+{
+    while (sd.printing && cmd_fifo.size() < BUFSIZE - 1)
+    {
+        SDFile* f = sd.selected;
+        if (sd.pos >= f->size)
+        {
+            sd.printing = false;
+            sd.selected = 0;
+            reply(peer, "Done printing file\n");
+            break;
+        }
+        const char* start = f->data + sd.pos;
+        const char* eol = (const char*)memchr(start, '\n', f->size - sd.pos);
+        const char* end = (eol == 0) ? f->data + f->size : eol;
+        sd.pos = end - f->data + (eol != 0);
+        const char* comment = (const char*)memchr(start, ';', end - start);
+        if (comment != 0)
+            end = comment;
+        while (start < end && isspace(*start))
+            start++;
+        while (end > start && isspace(end[-1]))
+            end--;
+        if (start == end)
+            continue;
+        char* cmd = strndup(start, end - start);
+        fprintf(stdout, "SD: %s\n", cmd);
+        unique_ptr<Line> line(new Line(cmd));
+        free(cmd);
+        enqueue_command(line, false);
+    }
+}
+
+// Carries out the oldest command in cmd_fifo if the planner has room and the
+// time for processing the previous command (see --cost) has passed. Returns
+// true if a command has been processed.
+bool process_next_command(File& peer)
 {
     static double X(0);
     static double Y(0);
     static double Z(0);
 
-    if (cmd_fifo.empty() || block_fifo.size() == BLOCK_BUFFER_SIZE)
-        return;
+    if (cmd_fifo.empty() || block_fifo.size() == BLOCK_BUFFER_SIZE || micros() < busy_until)
+        return false;
+    busy_until = micros() + command_cost;
 
     const int G = 0;
     const int M = 0x10000;
@@ -376,6 +674,68 @@ void process_next_command(File& peer)
             Z = cmd->gcode->getDouble("Z", Z, false);
             plan_move(X, Y, Z, 999999999);
             break;
+        case M + 23: // Select SD file
+        {
+            char* name = sd_argument(gcode);
+            char sendbuf[1024];
+            sd.selected = sd_find(name);
+            sd.pos = 0;
+            sd.printing = false;
+            if (sd.selected != 0)
+                snprintf(sendbuf, sizeof(sendbuf), "File opened: %s Size: %lld\nFile selected\n", sd.selected->name,
+                         (long long)sd.selected->size);
+            else
+                snprintf(sendbuf, sizeof(sendbuf), "open failed, File: %s.\n", name);
+            reply(peer, sendbuf);
+            free(name);
+            break;
+        }
+        case M + 24: // Start or Resume SD print
+            if (sd.selected != 0)
+                sd.printing = true;
+            break;
+        case M + 25: // Pause SD print
+            sd.printing = false;
+            break;
+        case M + 27: // Report SD print status
+            if (cmd->gcode->getDouble("S", -1) >= 0)
+            {
+                sd.autoreport_seconds = cmd->gcode->getDouble("S", 0);
+                sd.next_autoreport = millis() + 1000 * sd.autoreport_seconds;
+            }
+            else if (strstr(gcode, " C") != 0)
+            {
+                char sendbuf[1024];
+                if (sd.selected != 0)
+                    snprintf(sendbuf, sizeof(sendbuf), "Current file: %s %s\n", sd.selected->name, sd.selected->name);
+                else
+                    snprintf(sendbuf, sizeof(sendbuf), "Current file: (no file)\n");
+                reply(peer, sendbuf);
+            }
+            else
+                report_sd_status(peer);
+            break;
+        case M + 28: // Start SD write
+            if (binary_transfer && cmd->gcode->getDouble("B", 0) == 1)
+            {
+                reply(peer, "echo:Switching to Binary Protocol\n");
+                binary_mode = true;
+            }
+            else
+                unknown_command_error(peer, gcode);
+            break;
+        case M + 30: // Delete SD file
+        {
+            char* name = sd_argument(gcode);
+            char sendbuf[1024];
+            if (sd_delete(name))
+                snprintf(sendbuf, sizeof(sendbuf), "File deleted:%s\n", name);
+            else
+                snprintf(sendbuf, sizeof(sendbuf), "Deletion failed, File: %s.\n", name);
+            reply(peer, sendbuf);
+            free(name);
+            break;
+        }
         case M + 82: // E Absolute
             break;
         case M + 18: // Disable Steppers
@@ -384,8 +744,8 @@ void process_next_command(File& peer)
         case M + 104: // Set Hotend Temperature
             break;
         case M + 105: // Report Temperatures
+            report_temperatures(peer, cmd->send_ok); // no "ok" for commands from SD
             cmd->send_ok = false;
-            report_temperatures(peer);
             break;
         case M + 106: // Set Fan Speed
             break;
@@ -398,11 +758,18 @@ void process_next_command(File& peer)
         case M + 110: // Set Line Number
             break;    // already handled
         case M + 115: // Firmware Info
+            peer.writeAll(FIRMWARE_INFO, strlen(FIRMWARE_INFO));
+            fprintf(stdout, "%s", FIRMWARE_INFO);
+            reply(peer, binary_transfer ? "Cap:BINARY_FILE_TRANSFER:1\n" : "Cap:BINARY_FILE_TRANSFER:0\n");
             break;
         case M + 117: // Set LCD Message
             break;
         case M + 140: // Set Bed Temperature
             break;
+        case M + 155: // Temperature Auto-Report
+            p.autoreport_seconds = cmd->gcode->getDouble("S", p.autoreport_seconds);
+            p.next_autoreport = millis() + 1000 * p.autoreport_seconds;
+            break;
         case M + 190: // Wait for Bed Temperature
             break;
         case M + 201: // Set Print Max Acceleration
@@ -419,23 +786,432 @@ void process_next_command(File& peer)
             break;
         case M + 221: // Set Flow Percentage
             break;
+        case M + 410: // Quickstop
+            break;    // already handled by emergency_parser()
+        case M + 524: // Abort SD print
+            sd.printing = false;
+            sd.selected = 0;
+            break;
         default:
             unknown_command_error(peer, gcode);
     }
 
     if (cmd->send_ok)
         ok_to_send(peer);
+    return true;
+}
+
+// Moves the data available from peer through decoder into the pipe pipe_w,
+// which is closed on EOF. Replies to MeatPack commands.
+void meatpack_pump(File& peer, MeatPack::Decoder& decoder, int& pipe_w)
+{
+    pollfd pfd = {pipe_w, POLLOUT, 0};
+    if (pipe_w < 0 || ::poll(&pfd, 1, 0) <= 0) // a writable pipe has room for 2 * sizeof(raw)
+        return;
+    char raw[1024];
+    char decoded[2 * sizeof(raw)];
+    int n = peer.read(raw, sizeof(raw));
+    if (n < 0 && peer.errNo() == EWOULDBLOCK)
+        peer.clearError();
+    if (n > 0)
+    {
+        if (!emulate_uart) // otherwise the UART has passed the bytes to the parser
+            emergency_parser.update(raw, n);
+        n = decoder.decode(raw, n, decoded);
+        if (n > 0 && write(pipe_w, decoded, n) != n)
+            perror("meatpack pipe");
+        const char* report = decoder.report();
+        if (report != 0)
+        {
+            peer.writeAll(report, strlen(report));
+            fprintf(stdout, "%s", report);
+        }
+    }
+    if (peer.EndOfFile() || peer.hasError())
+    {
+        close(pipe_w);
+        pipe_w = -1;
+    }
+}
+
+// Carries out a packet of the binary protocol.
+void binary_packet(File& peer, BinaryProtocol::Receiver& receiver)
+{
+    if (receiver.protocol() == BinaryProtocol::CONTROL)
+    {
+        if (receiver.type() == BinaryProtocol::CLOSE)
+            binary_mode = false;
+        return;
+    }
+    if (receiver.protocol() != BinaryProtocol::FILE_TRANSFER)
+        return;
+
+    int size = receiver.size();
+    const char* payload = receiver.payload();
+    switch (receiver.type())
+    {
+        case BinaryProtocol::QUERY:
+            reply(peer, "PFT:version:0.1.0:compression:heatshrink,8,4\n");
+            break;
+        case BinaryProtocol::OPEN:
+            if (upload.file != 0)
+                reply(peer, "PFT:busy\n");
+            else if (size < 3 || payload[size - 1] != 0)
+                reply(peer, "PFT:fail\n");
+            else
+            {
+                upload.file = sd_create(payload + 2);
+                upload.compressed = payload[1];
+                upload.decoder = Heatshrink::Decoder();
+                reply(peer, "PFT:success\n");
+            }
+            break;
+        case BinaryProtocol::WRITE:
+        {
+            SDFile* f = upload.file;
+            if (f == 0)
+            {
+                reply(peer, "PFT:ioerror\n");
+                break;
+            }
+            int max = upload.compressed ? Heatshrink::Decoder::maxOutput(size) : size;
+            f->data = (char*)realloc(f->data, f->size + max);
+            if (upload.compressed)
+                f->size += upload.decoder.decode(payload, size, f->data + f->size);
+            else
+            {
+                memcpy(f->data + f->size, payload, size);
+                f->size += size;
+            }
+            break;
+        }
+        case BinaryProtocol::CLOSE_FILE:
+            if (upload.file == 0)
+                reply(peer, "PFT:notopen\n");
+            else
+            {
+                fprintf(stdout, "Received %s (%lld bytes)\n", upload.file->name, (long long)upload.file->size);
+                upload.file = 0;
+                reply(peer, "PFT:success\n");
+            }
+            break;
+        case BinaryProtocol::ABORT:
+            if (upload.file != 0)
+                sd_delete(upload.file->name);
+            upload.file = 0;
+            reply(peer, "PFT:success\n");
+            break;
+    }
+}
+
+// Reads binary protocol data from rx (starting with what the reader has
+// buffered) until binary mode ends.
+void binary_pump(File& peer, gcode::Reader& reader, BinaryProtocol::Receiver& receiver)
+{
+    char buf[1024];
+    int n = reader.raw(buf, sizeof(buf));
+    if (n == 0)
+    {
+        n = rx->read(buf, sizeof(buf));
+        if (n < 0 && rx->errNo() == EWOULDBLOCK)
+            rx->clearError();
+    }
+    for (int i = 0; i < n && binary_mode;)
+    {
+        i += receiver.receive(buf + i, n - i);
+        if (receiver.reply() != 0)
+            reply(peer, receiver.reply());
+        if (receiver.hasPacket())
+            binary_packet(peer, receiver);
+    }
+}
+
+// Data the emulated serial line passes to the host at a later time.
+struct TxChunk
+{
+    char* data;
+    int len;
+    int64_t due; // micros() when the chunk has arrived at the host
+    TxChunk(const char* data_, int len_, int64_t due_) : data((char*)malloc(len_)), len(len_), due(due_)
+    {
+        memcpy(data, data_, len);
+    }
+    ~TxChunk() { free(data); }
+};
+
+// The serial line between host and printer (see --baud, --rxbuf and --txdelay).
+// The firmware code talks to one end of a socket pair as if it were the
+// connection and the UART passes the data between the other end and the host.
+// Data from the host arrives at the line's speed in the RX buffer. Like
+// Marlin's get_serial_commands(), the firmware takes data out of the RX buffer
+// only while there is room in its command queue. Bytes that arrive while the
+// RX buffer is full are lost. Replies reach the host after a delay.
+class UART
+{
+    // Maximum number of bytes taken from the connection that have not arrived
+    // in the RX buffer, yet. More data waits in the kernel like it waits in the
+    // host's serial driver.
+    static const int WIRE_SIZE = 4096;
+
+    File& line;
+
+    // fds[0] is the firmware's end of the socket pair, fds[1] is the UART's.
+    int fds[2];
+
+    // Transmission time of one byte in nanoseconds; 0 if the speed is unlimited.
+    int64_t byte_ns;
+
+    // wire[0..wire_len) have been sent by the host. wire[0] arrives at
+    // wire_start (nanoseconds, like micros()).
+    char wire[WIRE_SIZE];
+    int wire_len;
+    int64_t wire_start;
+
+    // The RX buffer. ring_len bytes starting with the oldest at ring[ring_start].
+    char* ring;
+    int ring_start;
+    int ring_len;
+
+    // Replies not yet passed to the host and micros() when the last one has arrived.
+    FIFO<TxChunk> tx;
+    int64_t tx_end;
+
+    // With --meatpack, this decoder follows the firmware's decoder to find the
+    // line ends in the packed data.
+    MeatPack::Decoder framer;
+
+    // true after EOF or an error on line.
+    bool eof;
+
+    UART(const UART&);
+    UART& operator=(const UART&);
+
+    bool endOfLine(char c)
+    {
+        if (!meatpack)
+            return c == '\n';
+        char out[2];
+        int n = framer.decode(&c, 1, out);
+        return (n > 0 && out[n - 1] == '\n') || (n == 2 && out[0] == '\n');
+    }
+
+    // Moves n bytes from the RX buffer to the firmware.
+    void deliver(int n)
+    {
+        int first = uart_rxbuf - ring_start;
+        if (first > n)
+            first = n;
+        if (write(fds[1], ring + ring_start, first) != first || write(fds[1], ring, n - first) != n - first)
+            perror("UART");
+        ring_start = (ring_start + n) % uart_rxbuf;
+        ring_len -= n;
+    }
+
+  public:
+    UART(File& line_) : line(line_), wire_len(0), wire_start(0), ring_start(0), ring_len(0), tx_end(0), eof(false)
+    {
+        fds[0] = fds[1] = -1;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            perror("socketpair");
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        byte_ns = (uart_baud > 0) ? 10000000000LL / uart_baud : 0; // 10 bits per byte with 8N1
+        ring = (char*)malloc(uart_rxbuf);
+    }
+
+    ~UART()
+    {
+        close(fds[0]);
+        close(fds[1]);
+        free(ring);
+        while (!tx.empty())
+            delete tx.get();
+    }
+
+    // The file descriptor the firmware code uses as its connection.
+    int firmwareSide() { return fds[0]; }
+
+    // Returns the file descriptor to poll for data from the host or -1 if no
+    // data is taken from the host at the moment.
+    int listenFD() { return (eof || wire_len == WIRE_SIZE) ? -1 : line.fileDescriptor(); }
+
+    // Returns micros() when the next line (or a batch of bytes) arrives in the
+    // RX buffer or the next reply is due; INT64_MAX if nothing is underway.
+    int64_t nextEvent()
+    {
+        int64_t wake = INT64_MAX;
+        if (wire_len > 0)
+        {
+            int n = 1;
+            while (n < wire_len && n < 16 && wire[n - 1] != '\n')
+                n++;
+            wake = (wire_start + (n - 1) * byte_ns) / 1000;
+        }
+        if (!tx.empty() && tx.peek().due < wake)
+            wake = tx.peek().due;
+        return wake;
+    }
+
+    // Takes the data that has arrived from the host into the RX buffer and
+    // passes data from the RX buffer to the firmware, up to the end of the
+    // lines-th line (everything if lines < 0). Nothing is passed on while the
+    // firmware has not read the previous data.
+    void receive(int lines)
+    {
+        int64_t now = micros() * 1000;
+        if (listenFD() >= 0)
+        {
+            int n = line.read(wire + wire_len, WIRE_SIZE - wire_len);
+            if (n < 0 && line.errNo() == EWOULDBLOCK)
+                line.clearError();
+            if (n > 0)
+            {
+                if (wire_len == 0) // the line has been idle
+                    wire_start = std::max(now, wire_start - byte_ns) + byte_ns;
+                wire_len += n;
+            }
+            if (line.EndOfFile() || line.hasError())
+            {
+                if (line.hasError())
+                    fprintf(stderr, "%s\n", line.error());
+                eof = true;
+            }
+        }
+
+        int arrived = wire_len;
+        if (byte_ns > 0 && arrived > 0)
+            arrived = (now < wire_start) ? 0 : std::min<int64_t>(wire_len, (now - wire_start) / byte_ns + 1);
+        int lost = 0;
+        if (!binary_mode)
+            emergency_parser.update(wire, arrived);
+        for (int i = 0; i < arrived; i++)
+        {
+            if (ring_len < uart_rxbuf)
+                ring[(ring_start + ring_len++) % uart_rxbuf] = wire[i];
+            else
+                lost++;
+        }
+        if (arrived > 0)
+        {
+            wire_len -= arrived;
+            memmove(wire, wire + arrived, wire_len);
+            wire_start += arrived * byte_ns;
+        }
+        if (lost > 0)
+            fprintf(stdout, "RX buffer overflow: %d bytes lost\n", lost);
+
+        int unread = 0;
+        if (ring_len > 0 && lines != 0 && ioctl(fds[0], FIONREAD, &unread) == 0 && unread == 0)
+        {
+            int n = 0;
+            while (n < ring_len && lines != 0)
+            {
+                if (endOfLine(ring[(ring_start + n++) % uart_rxbuf]) && lines > 0)
+                    lines--;
+            }
+            deliver(n);
+        }
+
+        if (eof && wire_len == 0 && ring_len == 0)
+            shutdown(fds[1], SHUT_WR);
+    }
+
+    // Passes the replies the firmware has written to the host when they are due.
+    void transmit()
+    {
+        int64_t now = micros();
+        char buf[4096];
+        int n;
+        while ((n = read(fds[1], buf, sizeof(buf))) > 0)
+        {
+            tx_end = std::max(now + uart_txdelay, tx_end) + n * byte_ns / 1000;
+            tx.put(new TxChunk(buf, n, tx_end));
+        }
+        while (!tx.empty() && tx.peek().due <= now)
+        {
+            TxChunk* chunk = tx.get();
+            line.writeAll(chunk->data, chunk->len);
+            delete chunk;
+        }
+    }
+};
+
+// Sleeps until there is something to do for handle_connection(): input that
+// can be processed, the completion of the oldest planner block, the end of the
+// processing time of the previous command, an auto-report or an event of the
+// emulated serial line uart (0 if none). pipe_w is the MeatPack pipe (-1 if none).
+void wait_for_event(File& peer, int pipe_w, UART* uart)
+{
+    int64_t now = micros();
+    int64_t wake = INT64_MAX;
+    if (!block_fifo.empty())
+        wake = block_fifo.peek().endTimeMicros;
+    if (!cmd_fifo.empty() && block_fifo.size() < BLOCK_BUFFER_SIZE && busy_until < wake)
+        wake = busy_until;
+    if (p.autoreport_seconds > 0 && p.next_autoreport * 1000 < wake)
+        wake = p.next_autoreport * 1000;
+    if (sd.autoreport_seconds > 0 && sd.next_autoreport * 1000 < wake)
+        wake = sd.next_autoreport * 1000;
+    if (uart != 0 && uart->nextEvent() < wake)
+        wake = uart->nextEvent();
+
+    // Input is only of interest if there's room for it. Otherwise it waits in
+    // the kernel like it waits in the USB interface of a real printer.
+    pollfd fds[3];
+    int nfds = 0;
+    if (binary_mode || cmd_fifo.size() < BUFSIZE)
+    {
+        if (rx != &peer)
+            fds[nfds++] = {rx->fileDescriptor(), POLLIN, 0};
+        if (rx == &peer || pipe_w >= 0)
+            fds[nfds++] = {peer.fileDescriptor(), POLLIN, 0};
+    }
+    // The serial line carries data whether there's room for it or not.
+    if (uart != 0 && uart->listenFD() >= 0)
+        fds[nfds++] = {uart->listenFD(), POLLIN, 0};
+
+    struct timespec timeout;
+    if (wake != INT64_MAX)
+    {
+        int64_t t = (wake > now) ? wake - now : 0;
+        timeout.tv_sec = t / 1000000;
+        timeout.tv_nsec = (t % 1000000) * 1000;
+    }
+    ppoll(fds, nfds, (wake != INT64_MAX) ? &timeout : 0, 0);
 }
 
 void handle_connection(int fd)
 {
 
     fprintf(stdout, "New connection\n");
-    File peer("remote connection", fd);
-    peer.autoClose();
+    File host("remote connection", fd);
+    host.autoClose();
+    host.setNonBlock(true);
+
+    // With --baud, --rxbuf or --txdelay, the firmware code talks to the host
+    // through an emulated serial line.
+    unique_ptr<UART> uart(emulate_uart ? new UART(host) : 0);
+    File peer("remote connection", uart ? uart->firmwareSide() : fd);
     peer.setNonBlock(true);
-    gcode::Reader reader(peer);
+
+    // With --meatpack, the data from the host is decoded into a pipe that the
+    // reader reads from, because gcode::Reader can only read from a File.
+    MeatPack::Decoder decoder;
+    int pipefd[2] = {-1, -1};
+    if (meatpack && pipe(pipefd) != 0)
+        perror("pipe");
+    File decoded("decoded remote connection", pipefd[0]);
+    decoded.autoClose();
+    decoded.setNonBlock(true);
+    rx = (pipefd[0] >= 0) ? &decoded : &peer;
+
+    gcode::Reader reader(*rx);
     reader.whitespaceCompression(0); // don't mess up checksums
+    p.autoreport_seconds = 0;        // a new connection resets the printer
+    sd.autoreport_seconds = 0;   // but an SD print goes on like on printers whose USB link does not reset them
+    upload.file = 0;
+    binary_mode = false;
+    emergency_parser.state = EmergencyParser::LINE_START;
+    BinaryProtocol::Receiver receiver;
 
     sleep(1); // Wait a little because that's what a normal printer does
     peer.writeAll(WELCOME_TEXT, strlen(WELCOME_TEXT));
@@ -444,13 +1220,26 @@ void handle_connection(int fd)
 
     for (;;)
     {
+        if (uart)
+            uart->receive(binary_mode ? -1 : BUFSIZE - cmd_fifo.size());
+
+        if (rx == &decoded)
+            meatpack_pump(peer, decoder, pipefd[1]);
+
+        if (binary_mode)
+            binary_pump(peer, reader, receiver);
+
         // compare Marlin function get_serial_commands()
-        while (cmd_fifo.size() < BUFSIZE && reader.hasNext())
+        while (!binary_mode && cmd_fifo.size() < BUFSIZE && reader.hasNext())
         {
             unique_ptr<Line> line(reader.next());
 
             const char* command = line->data();
+            if (strspn(command, "\r\n") == (size_t)line->length()) // Marlin skips empty lines without ok
+                continue;
             fprintf(stdout, "%s", command);
+            if (!emulate_uart && rx == &peer) // otherwise the bytes have been parsed before
+                emergency_parser.update(command, line->length());
 
             const char* npos = (*command == 'N') ? command : NULL; // Require the N parameter to start the line
 
@@ -514,16 +1303,39 @@ void handle_connection(int fd)
             enqueue_command(line, true);
         }
 
-        process_next_command(peer);
+        check_planner();
+        sd_feed(peer);
+        bool processed = false;
+        while (process_next_command(peer))
+        {
+            processed = true;
+            sd_feed(peer);
+        }
 
-        if (cmd_fifo.empty() && block_fifo.empty())
+        if ((cmd_fifo.empty() && block_fifo.empty()) || sd.printing) // an SD print goes on without host
         {
-            if (peer.EndOfFile() || peer.hasError())
+            if (rx->EndOfFile() || rx->hasError())
                 break;
         }
 
-        usleep(1000); // sleep 1ms to save some clock cycles
-        check_planner();
+        if (p.autoreport_seconds > 0 && millis() >= p.next_autoreport)
+        {
+            report_temperatures(peer, false);
+            p.next_autoreport = millis() + 1000 * p.autoreport_seconds;
+        }
+
+        if (sd.autoreport_seconds > 0 && millis() >= sd.next_autoreport)
+        {
+            if (sd.printing)
+                report_sd_status(peer);
+            sd.next_autoreport = millis() + 1000 * sd.autoreport_seconds;
+        }
+
+        if (uart)
+            uart->transmit();
+
+        if (!processed) // otherwise there may be room for commands the reader has buffered
+            wait_for_event(peer, pipefd[1], uart.get());
     }
 
     if (peer.hasError()) // report if we ended due to an error and not EOF
@@ -565,4 +1377,17 @@ const char* WELCOME_TEXT =
 const char* WELCOME_TEXT2 = "echo:SD card ok\n"
                             "Init power off infomation.\n"
                             "size: \n"
-                            "591\n";
\ No newline at end of file
+                            "591\n";
+
+const char* FIRMWARE_INFO = "FIRMWARE_NAME:Marlin 2.0.6 (Sep  4 2020 12:00:00) "
+                            "SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin "
+                            "PROTOCOL_VERSION:1.0 MACHINE_TYPE:mocklin EXTRUDER_COUNT:1 "
+                            "UUID:cede2a2f-41a2-4748-9b12-c55c62f367ff\n"
+                            "Cap:SERIAL_XON_XOFF:0\n"
+                            "Cap:EEPROM:0\n"
+                            "Cap:AUTOREPORT_TEMP:1\n"
+                            "Cap:PROGRESS:0\n"
+                            "Cap:PRINT_JOB:1\n"
+                            "Cap:EMERGENCY_PARSER:1\n"
+                            "Cap:AUTOREPORT_SD_STATUS:1\n"
+                            "Cap:ADVANCED_OK:0\n";
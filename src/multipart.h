@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+
+// Streaming parser for a multipart/form-data request body. Part bodies are
+// found by searching for the delimiter with memmem() in large chunks and are
+// passed on in these chunks, so the cost per byte is low and independent of
+// the line structure of the data.
+// Large bodies that go to a regular file are moved from in to the file with
+// splice(2) without passing through userspace at all. See spliceBody().
+class Multipart
+{
+    static const int BUFSIZE = 65536;
+
+    // The last TAIL_RESERVE bytes of the request are always read into buf,
+    // because that's where the closing delimiter and the small parts that
+    // usually follow the file are.
+    static const int TAIL_RESERVE = 65536;
+
+    // Maximum number of bytes spliced before checking them for a delimiter.
+    // This is also the maximum amount of data that has to be read back into
+    // buf if the check finds one.
+    static const int SPLICE_STEP = 4 * 1024 * 1024;
+
+    // Milliseconds to wait for more data from in before giving up.
+    static const int TIMEOUT = 30000;
+
+    // Longest part header block we accept.
+    static const int MAX_HEADERS = 4096;
+
+    File& in;
+
+    // Number of body bytes that have not been read from in, yet.
+    int64_t unread;
+
+    // "\r\n--<boundary>". malloc()ed. 0 until the first delimiter line has been seen.
+    char* delim;
+    int delimlen;
+
+    // buf[start..end) is data read from in that has not been processed, yet.
+    // bufsize is BUFSIZE unless data had to be put back after splicing.
+    char* buf;
+    int bufsize;
+    int start;
+    int end;
+
+    // Pipe used as the kernel buffer for splice(2). Created when needed.
+    int pipefd[2];
+
+    // false after splice(2) has turned out not to work with in.
+    bool can_splice;
+
+    // true after the closing delimiter has been seen.
+    bool finished;
+
+    Multipart(const Multipart&);
+    Multipart& operator=(const Multipart&);
+
+    // Moves the unprocessed data to the beginning of buf and reads more data
+    // from in. Returns false if no more data can be read.
+    bool fill()
+    {
+        if (start > 0)
+        {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+
+        int64_t want = bufsize - end;
+        if (want > unread)
+            want = unread;
+        if (want <= 0)
+            return false;
+
+        int n = in.read(buf + end, want, 0, TIMEOUT, TIMEOUT);
+        if (n <= 0)
+            return false;
+        end += n;
+        unread -= n;
+        return true;
+    }
+
+    // Returns the offset relative to buf+start of the first needle at or after
+    // buf+start+from or -1 if there is none.
+    int find(const char* needle, int len, int from = 0)
+    {
+        if (end - start <= from)
+            return -1;
+        const char* p = (const char*)memmem(buf + start + from, end - start - from, needle, len);
+        return (p == 0) ? -1 : p - (buf + start);
+    }
+
+    // Moves n bytes from in to the file descriptor outfd via pipefd. Returns the
+    // number of bytes moved, which is less than n only on error or EOF.
+    int64_t pump(int outfd, int64_t n)
+    {
+        int64_t moved = 0;
+        while (moved < n)
+        {
+            ssize_t got = splice(in.fileDescriptor(), 0, pipefd[1], 0, n - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (got < 0 && errno == EAGAIN && in.poll(POLLIN, TIMEOUT) > 0)
+                continue;
+            if (got <= 0)
+                break;
+            while (got > 0)
+            {
+                ssize_t put = splice(pipefd[0], 0, outfd, 0, got, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (put <= 0)
+                    return moved;
+                got -= put;
+                moved += put;
+            }
+        }
+        return moved;
+    }
+
+    // Writes the contents of buf to out and splices up to SPLICE_STEP bytes from
+    // in after them. Then the new data in the file is searched for the delimiter
+    // (through a read-only mapping, so it is not copied). If it is found, the
+    // file is truncated before it and the rest is put back into buf.
+    // Returns the number of bytes of the body that have been added to out
+    // (possibly 0 if splicing is not possible) or -1 on error.
+    int64_t spliceBody(int outfd)
+    {
+        if (pipefd[0] < 0)
+        {
+            if (pipe(pipefd) != 0)
+            {
+                can_splice = false;
+                return 0;
+            }
+            fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024); // fewer syscalls if permitted
+        }
+
+        off_t scan_from = lseek(outfd, 0, SEEK_CUR);
+        if (scan_from < 0)
+            return -1;
+
+        int64_t n = end - start;
+        if (n > 0 && write(outfd, buf + start, n) != n)
+            return -1;
+        start = end = 0;
+
+        int64_t step = unread - TAIL_RESERVE;
+        if (step > SPLICE_STEP)
+            step = SPLICE_STEP;
+        int64_t moved = pump(outfd, step);
+        unread -= moved;
+        if (moved == 0 && n == 0)
+        {
+            // Can't splice from in (or EOF). The regular code path deals with it.
+            can_splice = false;
+            return 0;
+        }
+        n += moved;
+
+        // A delimiter can only start in the new data because the caller has
+        // written nothing that might be the beginning of one.
+        off_t file_end = scan_from + n;
+        off_t map_start = scan_from & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        char* map = (char*)mmap(0, file_end - map_start, PROT_READ, MAP_SHARED, outfd, map_start);
+        if (map == MAP_FAILED)
+            return -1;
+        char* data = map + (scan_from - map_start);
+        char* d = (char*)memmem(data, n, delim, delimlen);
+        if (d != 0)
+        {
+            int64_t rest = n - (d - data);
+            if (rest > bufsize)
+            {
+                bufsize = rest;
+                buf = (char*)realloc(buf, bufsize);
+            }
+            memcpy(buf, d, rest);
+            end = rest;
+            n -= rest;
+        }
+        munmap(map, file_end - map_start);
+
+        if (d != 0 && (ftruncate(outfd, scan_from + n) != 0 || lseek(outfd, scan_from + n, SEEK_SET) < 0))
+            return -1;
+
+        if (moved < step) // EOF or error. Let the regular code path detect it.
+            can_splice = false;
+
+        return n;
+    }
+
+    // Returns true if it is worth trying spliceBody() for writing to out.
+    bool spliceable(File* out)
+    {
+        if (!can_splice || out == 0 || unread < TAIL_RESERVE + BUFSIZE)
+            return false;
+        // mmap() needs read access
+        int flags = fcntl(out->fileDescriptor(), F_GETFL);
+        struct stat statbuf;
+        return flags >= 0 && (flags & O_ACCMODE) == O_RDWR && out->stat(&statbuf) && S_ISREG(statbuf.st_mode);
+    }
+
+  public:
+    // Parses the body of length content_length that is read from in. prefix are
+    // prefix_len bytes of the body that have already been read from in (e.g. by a
+    // gcode::Reader parsing the request headers). If content_length <= 0, the
+    // body extends to EOF.
+    Multipart(File& in_, int64_t content_length, const char* prefix = 0, int prefix_len = 0)
+        : in(in_), unread(content_length), delim(0), delimlen(0), bufsize(BUFSIZE), start(0), end(0),
+          can_splice(true), finished(false)
+    {
+        pipefd[0] = pipefd[1] = -1;
+        if (unread <= 0)
+            unread = INT64_MAX;
+        buf = (char*)malloc(BUFSIZE);
+        // The delimiter is defined to include the CRLF preceding it. Inserting
+        // one in front means the first delimiter needs no special treatment.
+        buf[end++] = '\r';
+        buf[end++] = '\n';
+        if (prefix_len > BUFSIZE - end)
+            prefix_len = BUFSIZE - end;
+        memcpy(buf + end, prefix, prefix_len);
+        end += prefix_len;
+        unread -= prefix_len;
+    }
+
+    ~Multipart()
+    {
+        free(buf);
+        free(delim);
+        if (pipefd[0] >= 0)
+        {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+    }
+
+    // Skips to the next part and returns its headers (malloc()ed, each header
+    // line terminated by CRLF, without the empty line). Returns 0 if there is no
+    // further part or the data is malformed.
+    char* nextPart()
+    {
+        if (finished)
+            return 0;
+
+        if (delim == 0)
+        {
+            // Everything up to the first line starting with "--" is preamble.
+            for (;;)
+            {
+                int i = find("\r\n--", 4);
+                if (i >= 0)
+                {
+                    start += i;
+                    int eol;
+                    while ((eol = find("\r\n", 2, 2)) < 0)
+                    {
+                        if (end - start >= MAX_HEADERS || !fill())
+                            return 0;
+                    }
+                    delimlen = eol;
+                    delim = strndup(buf + start, delimlen);
+                    break;
+                }
+                if (end - start > 3)
+                    start = end - 3;
+                if (!fill())
+                    return 0;
+            }
+        }
+
+        // Find the next delimiter. Anything before it (e.g. the remainder of a
+        // part whose body has not been read) is skipped.
+        for (;;)
+        {
+            int i = find(delim, delimlen);
+            if (i >= 0)
+            {
+                start += i + delimlen;
+                break;
+            }
+            if (end - start >= delimlen)
+                start = end - (delimlen - 1);
+            if (!fill())
+                return 0;
+        }
+
+        // The delimiter is followed by "--" for the last one or by optional
+        // whitespace and CRLF.
+        for (;;)
+        {
+            if (end - start >= 2 && buf[start] == '-' && buf[start + 1] == '-')
+            {
+                finished = true;
+                return 0;
+            }
+            int eol = find("\r\n", 2);
+            if (eol >= 0)
+            {
+                start += eol + 2;
+                break;
+            }
+            if (end - start >= MAX_HEADERS || !fill())
+                return 0;
+        }
+
+        for (;;)
+        {
+            if (end - start >= 2 && buf[start] == '\r' && buf[start + 1] == '\n') // no headers
+            {
+                start += 2;
+                return strdup("");
+            }
+            int eoh = find("\r\n\r\n", 4);
+            if (eoh >= 0)
+            {
+                char* headers = strndup(buf + start, eoh + 2);
+                start += eoh + 4;
+                return headers;
+            }
+            if (end - start >= MAX_HEADERS || !fill())
+                return 0;
+        }
+    }
+
+    // Reads the body of the current part (i.e. the part whose headers have just
+    // been returned by nextPart()) and writes it to out. If out is 0, the data is
+    // discarded. If out is a regular file opened with O_RDWR, most of a large
+    // body is transferred without copying it into userspace.
+    // Returns the number of bytes of the body or -1 if the body is not properly
+    // terminated by a delimiter or writing to out fails.
+    int64_t body(File* out)
+    {
+        int64_t total = 0;
+        for (;;)
+        {
+            int i = find(delim, delimlen);
+            // Data that could be the beginning of a delimiter has to wait for more data.
+            int n = (i >= 0) ? i : end - start - (delimlen - 1);
+            if (n > 0)
+            {
+                if (out != 0 && !out->writeAll(buf + start, n))
+                    return -1;
+                start += n;
+                total += n;
+            }
+            if (i >= 0)
+                return total;
+            if (spliceable(out))
+            {
+                n = spliceBody(out->fileDescriptor());
+                if (n < 0)
+                    return -1;
+                total += n;
+                continue;
+            }
+            if (!fill())
+                return -1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "devfinder.h"
+#include "file.h"
+
+// What marlinfeed knows about a particular printer: the capabilities it reports
+// in its M115 reply and settings that can't be queried, such as the size of its
+// serial receive buffer. The profile is stored in a small text file, so that it
+// is available before the printer has said anything, and so that it can be
+// edited by hand. The file is named after the printer's USB serial number if
+// it has one, so that the profile follows the printer to another port.
+//
+// The file consists of "<name>=<value>" lines:
+//   firmware=<FIRMWARE_NAME from M115>
+//   <capability>=<1 or 0>   for each of CAPABILITY_NAMES the printer reported
+//   bufsize=<bytes>         size of the serial receive buffer; 0 means default
+//   baud=<bits/s>           speed of the serial line; 0 means unknown
+class PrinterProfile
+{
+  public:
+    enum Capability
+    {
+        AUTOREPORT_TEMP,      // M155
+        ADVANCED_OK,          // "ok N<line> P<planner> B<buffer>"
+        EMERGENCY_PARSER,     // M108, M112, M410 act as soon as they arrive
+        BINARY_FILE_TRANSFER, // M28 B1
+        AUTOREPORT_SD_STATUS, // M27 S<seconds>
+        CAPABILITIES
+    };
+
+    static const char* const CAPABILITY_NAMES[CAPABILITIES];
+
+  private:
+    // The profile file. malloc()ed. 0 if the profile exists in memory only.
+    char* path;
+
+    // The arguments of the last open(): the directory and the key() of the
+    // printer device. malloc()ed. 0 if open() has not been called.
+    char* dir;
+    char* name;
+
+    // FIRMWARE_NAME reported by M115. malloc()ed. Never 0.
+    char* firmware_name;
+
+    // 1 if the printer has reported the capability, -1 if it has reported it as
+    // 0 or not at all, 0 if we don't know.
+    int cap[CAPABILITIES];
+
+    int buf_size;
+
+    int baud_rate;
+
+    PrinterProfile(const PrinterProfile&);
+    PrinterProfile& operator=(const PrinterProfile&);
+
+    void clear()
+    {
+        free(firmware_name);
+        firmware_name = strdup("");
+        for (int i = 0; i < CAPABILITIES; i++)
+            cap[i] = 0;
+        buf_size = 0;
+        baud_rate = 0;
+    }
+
+    // Applies the line "<name>=<value>" (or "<name>:<value>" as in M115's "Cap:"
+    // lines) and returns true if it has changed something.
+    bool set(const char* name, int namelen, const char* value)
+    {
+        if (namelen == 8 && strncmp(name, "firmware", 8) == 0)
+        {
+            if (strcmp(firmware_name, value) == 0)
+                return false;
+            free(firmware_name);
+            firmware_name = strdup(value);
+            return true;
+        }
+        if (namelen == 7 && strncmp(name, "bufsize", 7) == 0)
+        {
+            int b = atoi(value);
+            if (b == buf_size)
+                return false;
+            buf_size = b;
+            return true;
+        }
+        if (namelen == 4 && strncmp(name, "baud", 4) == 0)
+        {
+            int b = atoi(value);
+            if (b == baud_rate)
+                return false;
+            baud_rate = b;
+            return true;
+        }
+        for (int i = 0; i < CAPABILITIES; i++)
+            if ((int)strlen(CAPABILITY_NAMES[i]) == namelen && strncmp(name, CAPABILITY_NAMES[i], namelen) == 0)
+            {
+                int c = (atoi(value) > 0) ? 1 : -1;
+                if (c == cap[i])
+                    return false;
+                cap[i] = c;
+                return true;
+            }
+        return false;
+    }
+
+  public:
+    PrinterProfile() : path(0), dir(0), name(0), firmware_name(0) { clear(); }
+
+    ~PrinterProfile()
+    {
+        free(path);
+        free(dir);
+        free(name);
+        free(firmware_name);
+    }
+
+    // Returns the name (malloc()ed) of the profile file for the printer at
+    // printdev: "usb-<vendor>-<product>-<serial>" if printdev is a USB device
+    // with a serial number, otherwise printdev with '/' replaced by '_'.
+    static char* key(const char* printdev)
+    {
+        char* name = 0;
+        char dev[PATH_MAX];
+        char attr[3][128];
+        if (realpath(printdev, dev) != 0 && strncmp(dev, "/dev/", 5) == 0 &&
+            DeviceFinder::usbAttributes(strrchr(dev, '/') + 1, attr))
+            assert(0 <= asprintf(&name, "usb-%s-%s-%s", attr[0], attr[1], attr[2]));
+        if (name == 0)
+            name = strdup(printdev);
+        for (char* p = name; *p != 0; p++)
+            if (!isalnum(*p) && *p != '-' && *p != '.')
+                *p = '_';
+        return name;
+    }
+
+    // Uses the profile file for printdev in directory dir (which is created if
+    // necessary) and loads it if it exists. Returns false and prints an error if
+    // the profile can't be stored in dir, in which case it exists in memory only.
+    bool open(const char* dir, const char* printdev)
+    {
+        clear();
+        free(path);
+        path = 0;
+        char* d = strdup(dir); // dir may be this->dir (see follow())
+        free(this->dir);
+        this->dir = d;
+        free(name);
+        name = key(printdev);
+
+        if (mkdir(d, 0755) != 0 && errno != EEXIST)
+        {
+            perror(d);
+            return false;
+        }
+
+        assert(0 <= asprintf(&path, "%s/%s", d, name));
+
+        File f(path);
+        f.action("reading printer profile");
+        if (!f.open(O_RDONLY))
+            return f.errNo() == ENOENT;
+
+        char buf[4096];
+        int n = f.read(buf, sizeof(buf) - 1);
+        if (n < 0)
+        {
+            fprintf(stderr, "%s\n", f.error());
+            return false;
+        }
+        buf[n] = 0;
+        char* save;
+        for (char* line = strtok_r(buf, "\n", &save); line != 0; line = strtok_r(0, "\n", &save))
+        {
+            char* eq = strchr(line, '=');
+            if (line[0] != '#' && eq != 0)
+                set(line, eq - line, eq + 1);
+        }
+        return true;
+    }
+
+    // If the profile has been open()ed for a device other than printdev (i.e. a
+    // device with a different key()), opens the profile for printdev in the same
+    // directory and returns true. This matters when the printer's device is only
+    // known once it has appeared, e.g. after it has been plugged in. Otherwise
+    // returns false and leaves the profile alone.
+    bool follow(const char* printdev)
+    {
+        if (dir == 0)
+            return false;
+        char* k = key(printdev);
+        bool same = (strcmp(k, name) == 0);
+        free(k);
+        if (!same)
+            open(dir, printdev);
+        return !same;
+    }
+
+    // Writes the profile to its file. Returns false and prints an error if that fails.
+    bool save()
+    {
+        if (path == 0)
+            return true;
+
+        char* newpath;
+        assert(0 <= asprintf(&newpath, "%s.new", path));
+        File f(newpath);
+        f.action("writing printer profile");
+        bool ok = f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ok)
+        {
+            char buf[4096];
+            int n = snprintf(buf, sizeof(buf), "# written by marlinfeed\nfirmware=%s\n", firmware_name);
+            for (int i = 0; i < CAPABILITIES && n < (int)sizeof(buf); i++)
+                if (cap[i] != 0)
+                    n += snprintf(buf + n, sizeof(buf) - n, "%s=%d\n", CAPABILITY_NAMES[i], cap[i] > 0);
+            if (n < (int)sizeof(buf))
+                n += snprintf(buf + n, sizeof(buf) - n, "bufsize=%d\nbaud=%d\n", buf_size, baud_rate);
+            ok = n < (int)sizeof(buf) && f.writeAll(buf, n) && rename(newpath, path) == 0;
+        }
+        if (!ok)
+        {
+            if (f.hasError())
+                fprintf(stderr, "%s\n", f.error());
+            else
+                perror(path);
+            unlink(newpath);
+        }
+        free(newpath);
+        return ok;
+    }
+
+    // Takes the capabilities from reply, the printer's reply to M115. A
+    // capability the reply does not mention is not supported. Returns true if the
+    // profile has changed. A reply without FIRMWARE_NAME (e.g. from firmware
+    // that does not know M115) changes nothing.
+    bool update(const char* reply)
+    {
+        const char* fw = strstr(reply, "FIRMWARE_NAME:");
+        if (fw == 0)
+            return false;
+
+        bool changed = false;
+        fw += 14;
+        const char* end = fw;
+        while (*end != 0 && *end != '\n' && *end != '\r' && strncmp(end, " SOURCE_CODE_URL:", 17) != 0 &&
+               strncmp(end, " PROTOCOL_VERSION:", 18) != 0)
+            end++;
+        char* name = strndup(fw, end - fw);
+        changed |= set("firmware", 8, name);
+        free(name);
+
+        int reported[CAPABILITIES] = {0};
+        for (const char* c = strstr(reply, "Cap:"); c != 0; c = strstr(c, "Cap:"))
+        {
+            c += 4;
+            const char* colon = strchr(c, ':');
+            if (colon == 0)
+                break;
+            for (int i = 0; i < CAPABILITIES; i++)
+                if ((int)strlen(CAPABILITY_NAMES[i]) == colon - c && strncmp(c, CAPABILITY_NAMES[i], colon - c) == 0)
+                {
+                    reported[i] = 1;
+                    changed |= set(c, colon - c, colon + 1);
+                }
+        }
+        for (int i = 0; i < CAPABILITIES; i++)
+            if (!reported[i])
+                changed |= set(CAPABILITY_NAMES[i], strlen(CAPABILITY_NAMES[i]), "0");
+        return changed;
+    }
+
+    // 1 if the printer supports c, -1 if it doesn't, 0 if we don't know.
+    int capability(Capability c) { return cap[c]; }
+
+    // FIRMWARE_NAME from M115; "" if not known.
+    const char* firmware() { return firmware_name; }
+
+    // Size of the printer's serial receive buffer; 0 if not known.
+    int bufSize() { return buf_size; }
+
+    // Sets bufSize(). Returns true if that is a change.
+    bool setBufSize(int b)
+    {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", b);
+        return set("bufsize", 7, value);
+    }
+
+    // Speed of the printer's serial line in bits/s; 0 if not known.
+    int baud() { return baud_rate; }
+
+    // Sets baud(). Returns true if that is a change.
+    bool setBaud(int b)
+    {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", b);
+        return set("baud", 4, value);
+    }
+};
+
+const char* const PrinterProfile::CAPABILITY_NAMES[PrinterProfile::CAPABILITIES] = {
+    "AUTOREPORT_TEMP", "ADVANCED_OK", "EMERGENCY_PARSER", "BINARY_FILE_TRANSFER", "AUTOREPORT_SD_STATUS"};
+
+#endif
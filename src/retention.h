@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "millis.h"
+#include "timerwheel.h"
+
+// Keeps the upload directory within a budget of bytes and number of files by
+// deleting the GCODE files that have not been printed for the longest time.
+// The time a file was last printed is its access time, which touch() sets
+// when a print starts; a file that has never been printed counts from its
+// modification time. Using the file system for this means the order survives
+// restarts without a record of its own.
+// The directory is only read when its mtime has changed or a file has been
+// touch()ed since the last check, so an idle check costs a single stat().
+class Retention
+{
+  public:
+    // Returns true if the file at path must not be deleted, e.g. because it is
+    // being printed or waiting in the queue.
+    typedef bool (*InUse)(const char* path);
+
+  private:
+    // Milliseconds between checks.
+    static const int CHECK_INTERVAL = 5000;
+
+    struct Candidate
+    {
+        char* name;
+        int64_t size;
+        int64_t used; // max(atime, mtime) in ns
+    };
+
+    char* dir;
+    int64_t max_bytes; // 0 means unlimited
+    int max_files;     // 0 means unlimited
+    InUse in_use;
+    bool verbose;
+
+    // st_mtim of dir after the last check.
+    int64_t dir_mtime;
+
+    // true if a file has been touch()ed since the last check.
+    bool dirty;
+
+    TimerWheel& wheel;
+    TimerWheel::Timer check_timer;
+
+    Retention(const Retention&);
+    Retention& operator=(const Retention&);
+
+    static int64_t nano(const timespec& tp) { return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec; }
+
+    // Least recently used first. Ties are broken by name so that the order is stable.
+    static int compare(const void* a, const void* b)
+    {
+        const Candidate* ca = (const Candidate*)a;
+        const Candidate* cb = (const Candidate*)b;
+        if (ca->used != cb->used)
+            return (ca->used < cb->used) ? -1 : 1;
+        return strcmp(ca->name, cb->name);
+    }
+
+    // Returns the st_mtim of dir or -1 on error.
+    int64_t dirMTime()
+    {
+        struct stat statbuf;
+        if (stat(dir, &statbuf) != 0)
+            return -1;
+        return nano(statbuf.st_mtim);
+    }
+
+    // Deletes the file name in dir together with its analysis.
+    void evict(int dfd, const char* name)
+    {
+        if (unlinkat(dfd, name, 0) != 0)
+        {
+            perror(name);
+            return;
+        }
+        char* sidecar;
+        assert(0 < asprintf(&sidecar, ".%s.analysis", name));
+        unlinkat(dfd, sidecar, 0);
+        free(sidecar);
+        if (verbose)
+            fprintf(stdout, "Deleted '%s/%s' to stay within the upload directory budget\n", dir, name);
+    }
+
+  public:
+    Retention(TimerWheel& wheel_, int timer_id)
+        : dir(0), max_bytes(0), max_files(0), in_use(0), verbose(false), dir_mtime(-1), dirty(true), wheel(wheel_),
+          check_timer(timer_id)
+    {
+    }
+
+    ~Retention() { free(dir); }
+
+    // Starts enforcing the budget of max_bytes_ (0: unlimited) and max_files_
+    // (0: unlimited) on the directory dpath. in_use_ protects files from deletion.
+    // If verbose_, every deletion is reported on stdout.
+    void open(const char* dpath, int64_t max_bytes_, int max_files_, InUse in_use_, bool verbose_ = false)
+    {
+        free(dir);
+        dir = strdup(dpath);
+        max_bytes = max_bytes_;
+        max_files = max_files_;
+        in_use = in_use_;
+        verbose = verbose_;
+        dir_mtime = -1;
+        dirty = true;
+        wheel.start(check_timer, millis(), 0);
+    }
+
+    // Records that the file at path is used now (i.e. it has started printing),
+    // which makes it the last candidate for deletion. Files outside the
+    // directory are left alone.
+    void touch(const char* path)
+    {
+        const char* name = strrchr(path, '/');
+        if (dir == 0 || name == 0 || (size_t)(name - path) != strlen(dir) || strncmp(path, dir, name - path) != 0)
+            return;
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_NOW;
+        times[1].tv_sec = 0;
+        times[1].tv_nsec = UTIME_OMIT;
+        if (utimensat(AT_FDCWD, path, times, 0) == 0)
+            dirty = true;
+    }
+
+    // Deletes the least recently used files until the directory is within the
+    // budget (or only files that are in use are left). Returns the number of
+    // files deleted.
+    int enforce()
+    {
+        if (dir == 0 || (max_bytes <= 0 && max_files <= 0))
+            return 0;
+        int64_t mtime = dirMTime();
+        if (mtime == dir_mtime && !dirty)
+            return 0;
+        dirty = false;
+
+        DIR* dp = opendir(dir);
+        if (dp == 0)
+        {
+            perror(dir);
+            return 0;
+        }
+        int dfd = dirfd(dp);
+        int capacity = 64;
+        int count = 0;
+        int64_t total = 0;
+        Candidate* files = (Candidate*)malloc(capacity * sizeof(Candidate));
+        for (;;)
+        {
+            auto f = readdir(dp);
+            if (f == 0)
+                break;
+            if (f->d_name[0] == '.' || !Codec::isGCodeName(f->d_name))
+                continue;
+            struct stat statbuf;
+            if (0 > fstatat(dfd, f->d_name, &statbuf, 0) || !S_ISREG(statbuf.st_mode))
+                continue;
+            if (count == capacity)
+            {
+                capacity *= 2;
+                files = (Candidate*)realloc(files, capacity * sizeof(Candidate));
+            }
+            Candidate& c = files[count++];
+            c.name = strdup(f->d_name);
+            c.size = statbuf.st_size;
+            c.used = nano(statbuf.st_atim);
+            if (c.used < nano(statbuf.st_mtim))
+                c.used = nano(statbuf.st_mtim);
+            total += c.size;
+        }
+
+        int deleted = 0;
+        if ((max_bytes > 0 && total > max_bytes) || (max_files > 0 && count > max_files))
+        {
+            qsort(files, count, sizeof(Candidate), compare);
+            int left = count;
+            for (int i = 0; i < count; i++)
+            {
+                if ((max_bytes <= 0 || total <= max_bytes) && (max_files <= 0 || left <= max_files))
+                    break;
+                char* path;
+                assert(0 < asprintf(&path, "%s/%s", dir, files[i].name));
+                if (in_use == 0 || !in_use(path))
+                {
+                    evict(dfd, files[i].name);
+                    total -= files[i].size;
+                    left--;
+                    deleted++;
+                }
+                free(path);
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+            free(files[i].name);
+        free(files);
+        closedir(dp);
+
+        // Our own deletions don't need another check.
+        dir_mtime = (deleted > 0) ? dirMTime() : mtime;
+        return deleted;
+    }
+
+    // If t is our timer, calls enforce(), schedules the next check and returns
+    // true. Otherwise returns false.
+    bool fire(TimerWheel::Timer* t)
+    {
+        if (t != &check_timer)
+            return false;
+        enforce();
+        wheel.start(check_timer, millis(), CHECK_INTERVAL);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fifo.h"
+#include "gcode.h"
+#include "timerwheel.h"
+
+// Schedules GCODE to be sent to the printer at a later time, either once or
+// periodically. The timers live on a TimerWheel shared with the rest of the
+// program. When the owner of the wheel gets an expired timer it passes it to
+// fire(). Commands whose time has come are then available via next() until
+// the print loop has picked them up.
+class CommandScheduler
+{
+  public:
+    enum Priority
+    {
+        URGENT = 0, // written to the printer right away, without line number and bypassing MarlinBuf
+        HIGH = 1,   // sent before commands injected via the API
+        NORMAL = 2, // sent after commands injected via the API but before the commands of the infile
+        PRIORITIES = 3
+    };
+
+  private:
+    struct Entry
+    {
+        TimerWheel::Timer timer;
+
+        // Handle returned by schedule().
+        int id;
+
+        // One or more lines of GCODE, each terminated by '\n'. malloc()ed.
+        char* gcode;
+
+        // Start of the next line to return from gcode while the entry is ready.
+        const char* pos;
+
+        Priority prio;
+
+        // Interval in milliseconds for periodic entries; 0 for one-shot entries.
+        int period;
+
+        // true while the entry is in one of the ready FIFOs.
+        bool ready;
+
+        Entry(int timer_id) : timer(timer_id), id(0), gcode(0), pos(0), prio(NORMAL), period(0), ready(false) {}
+        ~Entry() { free(gcode); }
+    };
+
+    // Finds the entry that belongs to a timer or id.
+    struct Finder
+    {
+        TimerWheel::Timer* timer;
+        int id;
+        Entry* found;
+        Finder(TimerWheel::Timer* t, int i) : timer(t), id(i), found(0) {}
+        bool operator()(Entry* e)
+        {
+            if (&e->timer == timer || e->id == id)
+                found = e;
+            return found == 0;
+        }
+    };
+
+    // Removes (and optionally deletes) the entry matching id.
+    struct Remover
+    {
+        int id;
+        bool del;
+        bool operator()(Entry* e)
+        {
+            if (e->id != id)
+                return true;
+            if (del)
+                delete e;
+            return false;
+        }
+    };
+
+    TimerWheel& wheel;
+
+    // The id all our timers carry, so that the owner of the wheel can tell them apart.
+    int timer_id;
+
+    int next_id;
+
+    // All entries that have been scheduled and not yet completed or cancelled.
+    FIFO<Entry> entries;
+
+    // Entries whose time has come, by priority. The same Entry pointers as in entries.
+    FIFO<Entry> ready[PRIORITIES];
+
+    CommandScheduler(const CommandScheduler&);
+    CommandScheduler& operator=(const CommandScheduler&);
+
+    void remove(Entry* e)
+    {
+        if (e->ready)
+        {
+            Remover unready{e->id, false};
+            ready[e->prio].filter(unready);
+        }
+        Remover rem{e->id, true};
+        entries.filter(rem);
+    }
+
+  public:
+    // All timers the scheduler puts on wheel will have the id timer_id_.
+    CommandScheduler(TimerWheel& wheel_, int timer_id_) : wheel(wheel_), timer_id(timer_id_), next_id(1) {}
+
+    ~CommandScheduler()
+    {
+        for (int p = 0; p < PRIORITIES; p++)
+            while (!ready[p].empty())
+                ready[p].get();
+        while (!entries.empty())
+            delete entries.get();
+    }
+
+    // Schedules gcode (one or more lines separated by '\n') to become ready
+    // delay_millis after now. If period_millis > 0, it becomes ready again every
+    // period_millis after that until cancel()led. A periodic command that is still
+    // waiting to be picked up when it becomes ready again is not queued twice.
+    // gcode is copied.
+    // Returns an id for use with cancel() and scheduled().
+    int schedule(const char* gcode, int64_t now, int delay_millis, int period_millis = 0, Priority prio = NORMAL)
+    {
+        Entry* e = new Entry(timer_id);
+        e->id = next_id++;
+        if (next_id <= 0)
+            next_id = 1;
+        int len = strlen(gcode);
+        e->gcode = (char*)malloc(len + 2);
+        memcpy(e->gcode, gcode, len);
+        if (len == 0 || gcode[len - 1] != '\n')
+            e->gcode[len++] = '\n';
+        e->gcode[len] = 0;
+        e->prio = prio;
+        e->period = period_millis;
+        entries.put(e);
+        wheel.start(e->timer, now, delay_millis);
+        return e->id;
+    }
+
+    // Removes the command with the given id, even if it is already ready.
+    // Does nothing if no such command exists (e.g. because a one-shot command has
+    // already been picked up completely).
+    void cancel(int id)
+    {
+        Finder find(0, id);
+        if (entries.visit(find).found)
+            remove(find.found);
+    }
+
+    // Returns true if the command with the given id is still scheduled or ready.
+    bool scheduled(int id)
+    {
+        Finder find(0, id);
+        return entries.visit(find).found != 0;
+    }
+
+    // If t is one of our timers, queues the corresponding command as ready,
+    // reschedules it if it is periodic and returns true. Returns false if
+    // t does not belong to this scheduler.
+    bool fire(TimerWheel::Timer* t, int64_t now)
+    {
+        if (t->id != timer_id)
+            return false;
+
+        Finder find(t, 0);
+        Entry* e = entries.visit(find).found;
+        if (e == 0)
+            return true; // can't happen because cancel() unschedules the timer
+
+        if (e->period > 0)
+            wheel.start(e->timer, now, e->period);
+
+        if (!e->ready)
+        {
+            e->ready = true;
+            e->pos = e->gcode;
+            ready[e->prio].put(e);
+        }
+
+        return true;
+    }
+
+    // Returns true if a command of priority prio or more urgent is ready.
+    bool hasReady(Priority prio = NORMAL)
+    {
+        for (int p = 0; p <= prio; p++)
+            if (!ready[p].empty())
+                return true;
+        return false;
+    }
+
+    // Returns the next line of the oldest ready command with priority prio or
+    // 0 if there is none. Like the lines returned by gcode::Reader, the returned
+    // line includes the terminating '\n'.
+    // You own the return value and must use delete to free it.
+    gcode::Line* next(Priority prio)
+    {
+        while (!ready[prio].empty())
+        {
+            Entry* e = &ready[prio].peek();
+            const char* start = e->pos;
+            while (*start == '\n')
+                start++;
+            gcode::Line* line = 0;
+            const char* end = start;
+            if (*start != 0)
+            {
+                end = strchr(start, '\n') + 1; // there is always a terminating '\n'
+                char* text = strndup(start, end - start);
+                line = new gcode::Line(text);
+                free(text);
+            }
+            e->pos = end;
+
+            while (*e->pos == '\n')
+                e->pos++;
+
+            if (*e->pos == 0) // all lines of this entry picked up
+            {
+                ready[prio].get();
+                e->ready = false;
+                if (e->period == 0)
+                    remove(e);
+            }
+
+            if (line != 0)
+                return line;
+        }
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SEQUENCES_H
+#define SEQUENCES_H
+
+#include <stdint.h>
+
+#include "scheduler.h"
+#include "timerwheel.h"
+
+// The GCODE sequences marlinfeed sends to the printer by itself (rather than
+// from a job) and their timing.
+
+// Cooldown code sent to the printer when a print is aborted or when a shutdown is
+// scheduled. The nozzle needs to be cooled down before turning off the printer
+// because otherwise heat creep can cause filament above the heat break to melt
+// which can clog the nozzle if the fan is turned off suddenly.
+// The bed temperature is intentionally not touched in this code because it is
+// not relevant to the safety of turning off the power and keeping the bed warm
+// between prints reduces the startup time significantly on printers with weak
+// heaters.
+const char* COOLDOWN_GCODE = "M108\nM104 S0\nM105\n";
+
+// Code sent when hard reconnecting to printer to stop any pending SD card print,
+// unless it is the --sd print of the job being started, which is taken over.
+// Also sent to abort an --sd print.
+const char* STOP_SD_PRINT_GCODE = "M524\n";
+
+// Code to lift the nozzle a bit sent after a print is aborted to prevent the
+// hot nozzle melting into the aborted print.
+const char* LIFT_NOZZLE_GCODE = "G91\nG0 Z10\nG90\n";
+
+// Milliseconds between injections of COOLDOWN_GCODE while waiting for the
+// printer to cool down before shutdown.
+const int COOLDOWN_INTERVAL = 1000;
+
+// When a print is aborted, COOLDOWN_GCODE is sent ABORT_COOLDOWN_REPEAT times,
+// ABORT_COOLDOWN_INTERVAL milliseconds apart, followed by LIFT_NOZZLE_GCODE.
+// Then we give the printer ABORT_SETTLE_TIME milliseconds before we consider
+// the abort complete.
+const int ABORT_COOLDOWN_REPEAT = 3;
+const int ABORT_COOLDOWN_INTERVAL = 10;
+const int ABORT_SETTLE_TIME = 250;
+
+// Schedules COOLDOWN_GCODE on sched every COOLDOWN_INTERVAL milliseconds,
+// starting at now, while waiting for the printer to cool down before shutdown.
+// The M105 in it keeps the temperature readings up to date. Returns the id to
+// cancel() it with.
+int schedule_cooldown(CommandScheduler& sched, int64_t now)
+{
+    return sched.schedule(COOLDOWN_GCODE, now, 0, COOLDOWN_INTERVAL);
+}
+
+// Schedules the abort sequence as URGENT commands on sched, starting at now:
+// STOP_SD_PRINT_GCODE if stop_sd is true, then the COOLDOWN_GCODE repeats and
+// LIFT_NOZZLE_GCODE. Starts done on wheel, so that it expires when the printer
+// has had ABORT_SETTLE_TIME to process the sequence.
+void schedule_abort(CommandScheduler& sched, TimerWheel& wheel, TimerWheel::Timer& done, int64_t now, bool stop_sd)
+{
+    if (stop_sd)
+        sched.schedule(STOP_SD_PRINT_GCODE, now, 0, 0, CommandScheduler::URGENT);
+    int i = 0;
+    for (; i < ABORT_COOLDOWN_REPEAT; i++)
+        sched.schedule(COOLDOWN_GCODE, now, i * ABORT_COOLDOWN_INTERVAL, 0, CommandScheduler::URGENT);
+    sched.schedule(LIFT_NOZZLE_GCODE, now, i * ABORT_COOLDOWN_INTERVAL, 0, CommandScheduler::URGENT);
+    wheel.start(done, now, i * ABORT_COOLDOWN_INTERVAL + ABORT_SETTLE_TIME);
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2020 Matthias S. Benkmann
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software, to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <limits.h>
+#include <stdint.h>
+
+// A hierarchical timer wheel with a resolution of 1ms. Scheduling, cancelling
+// and expiring a timer are O(1) (apart from the occasional cascade of a timer
+// from a coarser to a finer level), so a main loop can have as many timeouts as
+// it likes without checking each of them on every iteration. Use timeout() as
+// the timeout argument for poll() and call expire() after poll() returns.
+//
+// The wheel never reads the clock itself. All functions take the current time
+// in milliseconds (usually millis()) as an argument.
+class TimerWheel
+{
+  public:
+    // A timer that can be scheduled on a TimerWheel. Timers are intrusive, i.e.
+    // the wheel does not copy or allocate anything. It links the Timer objects
+    // you pass to it. A Timer that is destroyed while scheduled removes itself
+    // from its wheel.
+    class Timer
+    {
+        friend class TimerWheel;
+
+        // Absolute time in milliseconds when the timer is due.
+        int64_t due;
+
+        // Neighbours in the slot list. Both 0 if the timer is not scheduled.
+        Timer* prev;
+        Timer* next;
+
+        // The wheel this timer is scheduled on or 0.
+        TimerWheel* wheel;
+
+        // true if the timer is in the wheel's expired list rather than in a slot.
+        bool fired;
+
+        Timer(const Timer&);
+        Timer& operator=(const Timer&);
+
+      public:
+        // Arbitrary number for use by the owner, usually to tell expired timers apart.
+        int id;
+
+        Timer(int id_ = 0) : due(0), prev(0), next(0), wheel(0), fired(false), id(id_) {}
+
+        ~Timer()
+        {
+            if (wheel != 0)
+                wheel->cancel(*this);
+        }
+
+        // Returns true if the timer is scheduled on a wheel and has not been returned
+        // by expire(), yet.
+        bool scheduled() { return wheel != 0; }
+
+        // Returns the absolute time at which the timer is (or was last) due.
+        int64_t dueTime() { return due; }
+    };
+
+  private:
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    static const int LEVELS = 4;
+
+    // Each slot is a circular list with a sentinel node. Level 0 slots cover 1ms each,
+    // level 1 slots 64ms, level 2 slots 4096ms, level 3 slots 262144ms.
+    Timer slot[LEVELS][SLOTS];
+
+    // Timers that are due but have not been returned by expire(), yet.
+    Timer expired;
+
+    // All ticks before now_ have been processed.
+    int64_t now_;
+
+    // Number of timers scheduled (including those in expired).
+    int count;
+
+    // Number of timers in slots, i.e. count minus the timers in expired.
+    int queued;
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    static void init(Timer& head)
+    {
+        head.prev = &head;
+        head.next = &head;
+    }
+
+    static void link(Timer& head, Timer& t)
+    {
+        t.next = &head;
+        t.prev = head.prev;
+        head.prev->next = &t;
+        head.prev = &t;
+    }
+
+    static void unlink(Timer& t)
+    {
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.prev = 0;
+        t.next = 0;
+    }
+
+    // Puts t into the slot appropriate for its due time relative to now_.
+    void insert(Timer& t)
+    {
+        int64_t due = t.due;
+        if (due < now_)
+            due = now_;
+        int64_t delta = due - now_;
+
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= ((int64_t)1 << (BITS * (level + 1))))
+            level++;
+
+        // Beyond the range of the wheel => park in the slot that is cascaded last.
+        // The timer will be re-inserted at that point.
+        if (delta >= ((int64_t)1 << (BITS * LEVELS)))
+            due = now_ + ((int64_t)1 << (BITS * LEVELS)) - 1;
+
+        link(slot[level][(due >> (BITS * level)) & (SLOTS - 1)], t);
+    }
+
+    // Re-inserts all timers of the given slot.
+    void cascade(int level, int idx)
+    {
+        Timer& head = slot[level][idx];
+        Timer list;
+        if (head.next == &head)
+            return;
+        // move the whole list to a temporary head so that re-inserting into the
+        // same slot cannot loop.
+        list.next = head.next;
+        list.prev = head.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        init(head);
+        while (list.next != &list)
+        {
+            Timer& t = *list.next;
+            unlink(t);
+            insert(t);
+        }
+        list.prev = 0;
+        list.next = 0;
+    }
+
+    // Processes all ticks up to and including t.
+    void advance(int64_t t)
+    {
+        if (queued == 0)
+        {
+            if (now_ <= t)
+                now_ = t + 1;
+            return;
+        }
+
+        for (; now_ <= t; now_++)
+        {
+            for (int level = LEVELS - 1; level > 0; level--)
+                if ((now_ & (((int64_t)1 << (BITS * level)) - 1)) == 0)
+                    cascade(level, (now_ >> (BITS * level)) & (SLOTS - 1));
+
+            Timer& head = slot[0][now_ & (SLOTS - 1)];
+            while (head.next != &head)
+            {
+                Timer& tim = *head.next;
+                unlink(tim);
+                link(expired, tim);
+                tim.fired = true;
+                queued--;
+            }
+        }
+    }
+
+  public:
+    // Creates an empty wheel. now is the current time in milliseconds.
+    TimerWheel(int64_t now = 0) : now_(now), count(0), queued(0)
+    {
+        for (int level = 0; level < LEVELS; level++)
+            for (int i = 0; i < SLOTS; i++)
+                init(slot[level][i]);
+        init(expired);
+    }
+
+    // Timers still scheduled when the wheel is destroyed are left unscheduled.
+    ~TimerWheel()
+    {
+        for (int level = 0; level < LEVELS; level++)
+            for (int i = 0; i < SLOTS; i++)
+                while (slot[level][i].next != &slot[level][i])
+                    cancel(*slot[level][i].next);
+        while (expired.next != &expired)
+            cancel(*expired.next);
+    }
+
+    // Returns true if no timer is scheduled.
+    bool empty() { return count == 0; }
+
+    // Schedules t to expire delay_millis after now. If t is already scheduled
+    // (on this or another wheel) it is rescheduled.
+    void start(Timer& t, int64_t now, int64_t delay_millis)
+    {
+        if (t.wheel != 0)
+            t.wheel->cancel(t);
+        if (queued == 0 && now_ < now)
+            now_ = now; // nothing pending => skip idle ticks
+        t.due = now + delay_millis;
+        t.wheel = this;
+        t.fired = false;
+        count++;
+        queued++;
+        insert(t);
+    }
+
+    // Removes t from the wheel. Does nothing if t is not scheduled on this wheel.
+    void cancel(Timer& t)
+    {
+        if (t.wheel != this)
+            return;
+        unlink(t);
+        t.wheel = 0;
+        count--;
+        if (!t.fired)
+            queued--;
+        t.fired = false;
+    }
+
+    // Returns the next timer that is due at time now or 0 if there is none.
+    // The returned timer is no longer scheduled and may be restarted right away.
+    // Call this in a loop until it returns 0.
+    Timer* expire(int64_t now)
+    {
+        advance(now);
+        if (expired.next == &expired)
+            return 0;
+        Timer* t = expired.next;
+        unlink(*t);
+        t->wheel = 0;
+        t->fired = false;
+        count--;
+        return t;
+    }
+
+    // Returns the number of milliseconds from now until expire() may have something
+    // to do, suitable as timeout for poll(). Returns -1 if no timer is scheduled.
+    // The returned value may be shorter than the time until the next timer is
+    // due, because timers far in the future are moved to a finer level on the way,
+    // but it is never longer.
+    int timeout(int64_t now)
+    {
+        if (count == 0)
+            return -1;
+        if (expired.next != &expired)
+            return 0;
+
+        int64_t next = INT64_MAX;
+
+        for (int i = 0; i < SLOTS; i++)
+        {
+            int64_t tick = now_ + i;
+            Timer& head = slot[0][tick & (SLOTS - 1)];
+            if (head.next != &head)
+            {
+                next = tick;
+                break;
+            }
+        }
+
+        for (int level = 1; level < LEVELS; level++)
+        {
+            int shift = BITS * level;
+            int64_t base = now_ >> shift;
+            int j = ((now_ & (((int64_t)1 << shift) - 1)) == 0) ? 0 : 1;
+            int jmax = j + SLOTS;
+            for (; j < jmax; j++)
+            {
+                int64_t tick = (base + j) << shift;
+                if (tick >= next)
+                    break;
+                Timer& head = slot[level][(base + j) & (SLOTS - 1)];
+                if (head.next != &head)
+                {
+                    next = tick;
+                    break;
+                }
+            }
+        }
+
+        int64_t t = next - now;
+        if (t < 0)
+            return 0;
+        if (t > INT_MAX)
+            return INT_MAX;
+        return (int)t;
+    }
+};
+
+#endif
@@ -26,14 +26,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <utime.h>
 
+#include "analysis.h"
+#include "binproto.h"
+#include "checkpoint.h"
+#include "compression.h"
+#include "devfinder.h"
 #include "dirscanner.h"
 #include "fifo.h"
 #include "file.h"
+#include "fileindex.h"
 #include "gcode.h"
+#include "jobqueue.h"
 #include "marlinbuf.h"
+#include "meatpack.h"
+#include "multipart.h"
+#include "profile.h"
+#include "retention.h"
+#include "scheduler.h"
+#include "sequences.h"
+#include "timerwheel.h"
 
 const char* SIGCHILD_MSG = "...\n";
 const char* WELCOME_MSG = "Running unit tests...\n";
@@ -54,6 +69,20 @@ void gcode_tests();
 void fifo_tests();
 void marlinbuf_tests();
 void dirscanner_tests();
+void timerwheel_tests();
+void scheduler_tests();
+void sequence_tests();
+void jobqueue_tests();
+void checkpoint_tests();
+void multipart_tests();
+void compression_tests();
+void analysis_tests();
+void fileindex_tests();
+void retention_tests();
+void meatpack_tests();
+void binproto_tests();
+void profile_tests();
+void devfinder_tests();
 
 File out("stdout", 1);
 
@@ -66,6 +95,20 @@ int main()
     marlinbuf_tests();
     file_tests();
     fifo_tests();
+    timerwheel_tests();
+    scheduler_tests();
+    sequence_tests();
+    jobqueue_tests();
+    checkpoint_tests();
+    multipart_tests();
+    compression_tests();
+    analysis_tests();
+    fileindex_tests();
+    retention_tests();
+    meatpack_tests();
+    binproto_tests();
+    profile_tests();
+    devfinder_tests();
 
     out.writeAll(BYE_MSG, strlen(BYE_MSG));
 };
@@ -216,6 +259,23 @@ void gcode_tests()
     assert(line == 0);
     assert(!reader.hasNext());
 
+    // consumedBytes() is the file offset where the next line starts
+    f.open();
+    gcode::Reader offsets(f);
+    assert(offsets.consumedBytes() == 0);
+    line = offsets.next();
+    assert(offsets.consumedBytes() == 26);
+    delete line;
+    line = offsets.next();
+    assert(offsets.consumedBytes() == 37);
+    delete line;
+    while (0 != (line = offsets.next()))
+    {
+        assert(offsets.consumedBytes() <= offsets.totalBytesRead());
+        delete line;
+    }
+    assert(offsets.consumedBytes() == 2006);
+
     line = new gcode::Line("X:\"1\" Beta  Alpha: 'Foo'   Beta = \"Foobar\"  Gamma :\"Bla");
     assert(0 == strcmp(line->getString("Alpha"), "Foo"));
     assert(line->getString("Delta") == 0);
@@ -294,6 +354,97 @@ void marlinbuf_tests()
 
     assert(strncmp(buf.next() + 2, buf.next() + 2, 5) == 0);
     assert(strcmp(buf.next(), "N2G452*8\n") == 0);
+
+    // tags
+    assert(buf.ackedTag() == -1);
+    buf.append("G1 X1", 7);
+    buf.append("M105");
+    buf.next();
+    buf.next();
+    assert(buf.ack()); // the G452s
+    assert(buf.ack());
+    assert(buf.ack());
+    assert(buf.ackedTag() == -1);
+    assert(buf.ack());
+    assert(buf.ackedTag() == 7);
+    assert(buf.ack());
+    assert(buf.ackedTag() == 7); // M105 has no tag
+
+    // wide line numbers: no wrap-around and more than 98 lines waiting for ack
+    MarlinBuf wide;
+    wide.setBufSize(65536);
+    wide.setWideNumbers(true);
+    assert(wide.maxCommandLen() > 65000);
+    for (int i = 0; i < 300; i++)
+    {
+        assert(wide.maxAppendLen() > 10);
+        wide.append("G1", i);
+    }
+    for (int i = 0; i < 150; i++)
+        wide.next();
+    assert(strcmp(wide.next(&l), "N150G1*12\n") == 0 && l == 10);
+    for (int i = 0; i < 100; i++)
+        assert(wide.ack());
+    assert(wide.ackedTag() == 99);
+    assert(!wide.seek(99));
+    assert(!wide.seek(300));
+    assert(wide.seek(100));
+    assert(strncmp(wide.next(), "N100G1*", 7) == 0);
+    assert(wide.seek(299));
+    assert(strncmp(wide.next(), "N299G1*", 7) == 0);
+    assert(!wide.hasNext());
+    for (int i = 0; i < 1000; i++) // grows while lines are waiting for ack
+        wide.append("G0");
+    assert(wide.seek(101));
+    for (int i = 101; i < 1300; i++)
+    {
+        char n[16];
+        snprintf(n, sizeof(n), "N%dG", i);
+        assert(strncmp(wide.next(), n, strlen(n)) == 0);
+    }
+    assert(!wide.hasNext());
+
+    // a second buffer continues the numbering of the first, including the wrap-around
+    MarlinBuf first;
+    first.append("G1 X1");
+    first.next();
+    assert(first.ack() && first.nextNumber() == 1);
+    MarlinBuf second;
+    second.continueAt(97);
+    second.append("G1 X2");
+    second.append("G1 X3");
+    assert(strncmp(second.next(), "N97G1 X2*", 9) == 0);
+    assert(strncmp(second.next(), "N98G1 X3*", 9) == 0);
+    assert(strcmp(second.next(), MarlinBuf::WRAP_AROUND_STRING) == 0);
+    assert(second.nextNumber() == 0);
+
+    // lines sent out of band are ack()d after the lines sent before them
+    MarlinBuf oob;
+    oob.append("G1 X1", 1);
+    oob.append("G1 X2", 2);
+    oob.next();
+    int free_before = oob.maxAppendLen();
+    assert(oob.outOfBand(5));
+    assert(oob.maxAppendLen() == free_before - 5);
+    oob.next();
+    assert(oob.ack() && oob.ackedTag() == 1);
+    assert(oob.ack() && oob.ackedTag() == 1); // M108
+    assert(oob.needsAck());
+    assert(oob.ack() && oob.ackedTag() == 2);
+    assert(!oob.needsAck() && !oob.ack());
+    oob.append("G1 X3", 3);
+    oob.append("G1 X4", 4);
+    oob.next();
+    oob.next();
+    assert(oob.outOfBand(5));
+    assert(oob.seek(2)); // the printer drops N2 and N3, but takes the M410
+    assert(oob.ack() && oob.ackedTag() == 2);
+    assert(!oob.ack());
+    oob.next();
+    oob.next();
+    assert(oob.ack() && oob.ackedTag() == 3);
+    assert(oob.ack() && oob.ackedTag() == 4);
+    assert(!oob.needsAck() && oob.maxAppendLen() == MarlinBuf().maxAppendLen());
 };
 
 struct OddEven
@@ -533,6 +684,31 @@ void file_tests()
     assert(unlink_test.close());
     assert(!unlink_test.stat(&statbuf));
 
+    int sv[2];
+    int pfd[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv));
+    assert(0 == pipe(pfd));
+    File sender("fd sender", sv[0]);
+    File receiver("fd receiver", sv[1]);
+    receiver.setNonBlock(true);
+    assert(receiver.receiveFd() < 0);
+    assert(receiver.errNo() == EWOULDBLOCK);
+    receiver.clearError();
+    assert(sender.sendFd(pfd[1]));
+    close(pfd[1]);
+    int passed = receiver.receiveFd();
+    assert(passed >= 0);
+    assert(1 == write(passed, "!", 1));
+    close(passed);
+    char ch;
+    assert(1 == read(pfd[0], &ch, 1) && ch == '!');
+    assert(0 == read(pfd[0], &ch, 1)); // all write ends closed
+    close(pfd[0]);
+    assert(sender.close());
+    assert(receiver.receiveFd() < 0);
+    assert(receiver.errNo() == ECONNRESET);
+    receiver.close();
+
     File illport("localhost:-99");
     assert(!illport.listen());
     assert(illport.errNo() == EADDRNOTAVAIL);
@@ -551,3 +727,1071 @@ void file_tests()
     assert(!notallowed.listen());
     assert(notallowed.errNo() == EACCES);
 };
+
+void timerwheel_tests()
+{
+    const int64_t start = 1600000000000LL;
+    TimerWheel wheel(start);
+    assert(wheel.empty());
+    assert(wheel.timeout(start) == -1);
+    assert(wheel.expire(start + 5) == 0);
+
+    const int N = 7;
+    int64_t delays[N] = {0, 1, 63, 64, 5000, 300000, 20000000};
+    TimerWheel::Timer* timers[N];
+    for (int i = 0; i < N; i++)
+    {
+        timers[i] = new TimerWheel::Timer(i);
+        wheel.start(*timers[i], start + 10, delays[i]);
+        assert(timers[i]->scheduled());
+    }
+    assert(!wheel.empty());
+
+    // Step through time the way a poll() loop would and check that every timer
+    // expires exactly when due and that timeout() never oversleeps.
+    int64_t now = start + 10;
+    int fired = 0;
+    while (fired < N)
+    {
+        int to = wheel.timeout(now);
+        assert(to >= 0);
+        int64_t next_due = INT64_MAX;
+        for (int i = 0; i < N; i++)
+            if (timers[i]->scheduled() && timers[i]->dueTime() < next_due)
+                next_due = timers[i]->dueTime();
+        assert(now + to <= next_due || to == 0);
+        now += to;
+        for (TimerWheel::Timer* t; 0 != (t = wheel.expire(now));)
+        {
+            assert(t == timers[t->id]);
+            assert(t->dueTime() == start + 10 + delays[t->id]);
+            assert(now == t->dueTime());
+            assert(!t->scheduled());
+            fired++;
+        }
+        if (to == 0 && fired < N)
+            now++;
+    }
+    assert(wheel.empty());
+    assert(wheel.timeout(now) == -1);
+
+    // cancel, reschedule and automatic removal on destruction
+    wheel.start(*timers[0], now, 100);
+    wheel.start(*timers[1], now, 200);
+    wheel.start(*timers[2], now, 50);
+    wheel.cancel(*timers[2]);
+    assert(!timers[2]->scheduled());
+    wheel.start(*timers[0], now, 300); // reschedule
+    assert(wheel.expire(now + 199) == 0);
+    delete timers[1];
+    assert(wheel.expire(now + 299) == 0);
+    assert(wheel.expire(now + 300) == timers[0]);
+    assert(wheel.empty());
+
+    // timers in the past expire right away
+    wheel.start(*timers[3], now + 1000, -500);
+    assert(wheel.timeout(now + 1000) == 0);
+    assert(wheel.expire(now + 1000) == timers[3]);
+
+    for (int i = 0; i < N; i++)
+        if (i != 1)
+            delete timers[i];
+}
+
+// Runs all timers of wheel up to and including time now through sched.
+void fire_all(TimerWheel& wheel, CommandScheduler& sched, int64_t now)
+{
+    for (TimerWheel::Timer* t; 0 != (t = wheel.expire(now));)
+        assert(sched.fire(t, now));
+}
+
+// Asserts that the next line of priority prio is text and deletes it.
+void expect_line(CommandScheduler& sched, CommandScheduler::Priority prio, const char* text)
+{
+    gcode::Line* line = sched.next(prio);
+    assert(line != 0);
+    assert(strcmp(line->data(), text) == 0);
+    delete line;
+}
+
+void scheduler_tests()
+{
+    const int64_t start = 1600000000000LL;
+    TimerWheel wheel(start);
+    CommandScheduler sched(wheel, 42);
+    assert(!sched.hasReady(CommandScheduler::NORMAL));
+
+    // timers that are not ours are rejected
+    TimerWheel::Timer other(7);
+    assert(!sched.fire(&other, start));
+
+    // one-shot, multi-line, the last line without '\n'
+    int once = sched.schedule("M108\n\nM104 S0", start, 100, 0, CommandScheduler::HIGH);
+    assert(sched.scheduled(once));
+    assert(wheel.timeout(start) > 0 && wheel.timeout(start) <= 100);
+    fire_all(wheel, sched, start + 99);
+    assert(!sched.hasReady(CommandScheduler::NORMAL));
+    fire_all(wheel, sched, start + 100);
+    assert(sched.hasReady(CommandScheduler::HIGH));
+    assert(!sched.hasReady(CommandScheduler::URGENT));
+    assert(sched.next(CommandScheduler::NORMAL) == 0);
+    expect_line(sched, CommandScheduler::HIGH, "M108\n");
+    assert(sched.scheduled(once));
+    expect_line(sched, CommandScheduler::HIGH, "M104 S0\n");
+    assert(!sched.scheduled(once)); // one-shot is gone once picked up completely
+    assert(sched.next(CommandScheduler::HIGH) == 0);
+    assert(wheel.empty());
+
+    // periodic commands are not queued twice if not picked up in time
+    int periodic = sched.schedule("M105\n", start + 200, 0, 1000);
+    fire_all(wheel, sched, start + 200);
+    fire_all(wheel, sched, start + 1200);
+    fire_all(wheel, sched, start + 2200);
+    expect_line(sched, CommandScheduler::NORMAL, "M105\n");
+    assert(sched.next(CommandScheduler::NORMAL) == 0);
+    assert(sched.scheduled(periodic));
+    assert(wheel.timeout(start + 2200) > 0 && wheel.timeout(start + 2200) <= 1000);
+    fire_all(wheel, sched, start + 3200);
+    expect_line(sched, CommandScheduler::NORMAL, "M105\n");
+
+    // priorities are independent of each other, order within a priority is kept
+    sched.schedule("G0 Z10\n", start + 3200, 30, 0, CommandScheduler::URGENT);
+    for (int i = 0; i < 3; i++)
+        sched.schedule("M108\n", start + 3200, i * 10, 0, CommandScheduler::URGENT);
+    fire_all(wheel, sched, start + 4200); // M105 is also ready again
+    assert(sched.hasReady(CommandScheduler::URGENT));
+    for (int i = 0; i < 3; i++)
+        expect_line(sched, CommandScheduler::URGENT, "M108\n");
+    expect_line(sched, CommandScheduler::URGENT, "G0 Z10\n");
+    assert(!sched.hasReady(CommandScheduler::HIGH));
+    assert(sched.hasReady(CommandScheduler::NORMAL));
+
+    // cancel removes ready and scheduled commands
+    sched.cancel(periodic);
+    assert(!sched.scheduled(periodic));
+    assert(!sched.hasReady(CommandScheduler::NORMAL));
+    assert(wheel.empty());
+    sched.cancel(periodic); // no-op
+
+    // pending entries are cleaned up by the destructor
+    {
+        CommandScheduler tmp(wheel, 43);
+        tmp.schedule("M105", start, 5000, 5000);
+        assert(!wheel.empty());
+    }
+    assert(wheel.empty());
+}
+
+// Emulates the print loop from time from up to and including time to in 1ms
+// steps: expired timers go to sched, then all ready lines of priority prio are
+// picked up. Appends "<ms since from> <line>" to log (size bytes) for every
+// line picked up. If done expires, "<ms since from> done\n" is appended and the
+// run ends, like handle() returns on ABORT_DONE.
+void run_loop(TimerWheel& wheel, CommandScheduler& sched, TimerWheel::Timer* done, CommandScheduler::Priority prio,
+              int64_t from, int64_t to, char* log, int size)
+{
+    int n = strlen(log);
+    for (int64_t now = from; now <= to; now++)
+    {
+        for (TimerWheel::Timer* t; 0 != (t = wheel.expire(now));)
+        {
+            if (t == done)
+            {
+                n += snprintf(log + n, size - n, "%d done\n", (int)(now - from));
+                return;
+            }
+            assert(sched.fire(t, now));
+        }
+        for (gcode::Line* line; 0 != (line = sched.next(prio)); delete line)
+            n += snprintf(log + n, size - n, "%d %s", (int)(now - from), line->data());
+        assert(n < size);
+    }
+}
+
+void sequence_tests()
+{
+    const int64_t start = 1600000000000LL;
+    TimerWheel wheel(start);
+    CommandScheduler sched(wheel, 42);
+    char log[1024];
+    char expected[1024];
+
+    // abort: cooldown ABORT_COOLDOWN_REPEAT times, then the lift, then ABORT_DONE
+    for (int sd = 0; sd < 2; sd++)
+    {
+        int64_t now = start + sd * 10000;
+        TimerWheel::Timer done(43);
+        schedule_abort(sched, wheel, done, now, sd);
+        log[0] = 0;
+        run_loop(wheel, sched, &done, CommandScheduler::URGENT, now, now + 10000, log, sizeof(log));
+
+        int n = snprintf(expected, sizeof(expected), "%s", sd ? "0 M524\n" : "");
+        int i = 0;
+        for (; i < ABORT_COOLDOWN_REPEAT; i++)
+        {
+            int t = i * ABORT_COOLDOWN_INTERVAL;
+            n += snprintf(expected + n, sizeof(expected) - n, "%d M108\n%d M104 S0\n%d M105\n", t, t, t);
+        }
+        int t = i * ABORT_COOLDOWN_INTERVAL;
+        snprintf(expected + n, sizeof(expected) - n, "%d G91\n%d G0 Z10\n%d G90\n%d done\n", t, t, t,
+                 t + ABORT_SETTLE_TIME);
+        assert(strcmp(log, expected) == 0);
+        assert(!sched.hasReady(CommandScheduler::NORMAL));
+        assert(wheel.empty());
+    }
+    assert(ABORT_COOLDOWN_REPEAT == 3);
+
+    // shutdown: COOLDOWN_GCODE every COOLDOWN_INTERVAL until cancelled
+    int64_t now = start + 20000;
+    int id = schedule_cooldown(sched, now);
+    log[0] = 0;
+    run_loop(wheel, sched, 0, CommandScheduler::NORMAL, now, now + 3 * COOLDOWN_INTERVAL - 1, log, sizeof(log));
+    int n = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        int t = i * COOLDOWN_INTERVAL;
+        n += snprintf(expected + n, sizeof(expected) - n, "%d M108\n%d M104 S0\n%d M105\n", t, t, t);
+    }
+    assert(strcmp(log, expected) == 0);
+    assert(!sched.hasReady(CommandScheduler::URGENT));
+
+    // while the print loop is busy (e.g. a G28 on the printer) it is queued once only
+    now += 3 * COOLDOWN_INTERVAL;
+    for (int i = 0; i < 3; i++)
+        fire_all(wheel, sched, now + i * COOLDOWN_INTERVAL);
+    log[0] = 0;
+    run_loop(wheel, sched, 0, CommandScheduler::NORMAL, now + 2 * COOLDOWN_INTERVAL, now + 3 * COOLDOWN_INTERVAL - 1,
+             log, sizeof(log));
+    assert(strcmp(log, "0 M108\n0 M104 S0\n0 M105\n") == 0);
+
+    sched.cancel(id);
+    assert(wheel.empty());
+    log[0] = 0;
+    run_loop(wheel, sched, 0, CommandScheduler::NORMAL, now + 3 * COOLDOWN_INTERVAL, now + 5 * COOLDOWN_INTERVAL,
+             log, sizeof(log));
+    assert(log[0] == 0);
+}
+
+void jobqueue_tests()
+{
+    const char* journal = "test/jobqueue.journal";
+    unlink(journal);
+    TimerWheel wheel(millis());
+
+    // without a journal
+    {
+        JobQueue q(wheel, 5);
+        assert(q.empty());
+        assert(q.start() == 0);
+        q.add("-", false);
+        q.add("-", false); // no duplicate check for jobs that are not journaled
+        assert(q.size() == 2);
+        JobQueue::Job* job = q.start();
+        assert(job != 0 && job->id < 0 && strcmp(job->path, "-") == 0);
+        assert(q.printing() == job);
+        q.finish(true, 0);
+        assert(q.printing() == 0);
+        assert(q.size() == 1);
+    }
+
+    JobQueue q(wheel, 5);
+    assert(q.open(journal));
+    assert(q.empty());
+    JobQueue child(wheel, 5); // plays the role of an API child process
+    assert(child.open(journal));
+    q.add("test/cube.gcode");
+    q.add("test/intro.gcode");
+    q.add("test/cube.gcode"); // duplicate
+    q.add("test/outro.gcode");
+    assert(q.size() == 3);
+    assert(!wheel.empty()); // sync pending
+
+    TimerWheel::Timer other(7);
+    assert(!q.fire(&other));
+    TimerWheel::Timer* t;
+    while (0 == (t = wheel.expire(millis() + 2000)))
+        ;
+    assert(q.fire(t));
+    assert(wheel.empty());
+
+    // a second queue on the same journal sees the same jobs and its changes
+    // become visible in the first one
+    child.update();
+    assert(child.size() == 3);
+    JobQueue::Job* head = q.start();
+    assert(head != 0 && strcmp(head->path, "test/cube.gcode") == 0);
+    child.update();
+    assert(child.size() == 2);
+    assert(!child.isQueued(head->id));
+    assert(child.references("test/cube.gcode"));  // printing
+    assert(child.references("test/intro.gcode")); // queued
+    assert(!child.references("test/nothing.gcode"));
+    q.add("test/cube.gcode"); // still a duplicate while printing
+
+    char* json = child.toJSON();
+    assert(strstr(json, "\"cube.gcode\", \"state\": \"printing\"") != 0);
+    assert(strstr(json, "\"intro.gcode\", \"state\": \"queued\"") < strstr(json, "\"outro.gcode\""));
+    free(json);
+
+    json = q.toJSON();
+    const char* idp = strstr(json, "outro.gcode");
+    assert(idp != 0);
+    while (strncmp(idp, "\"id\": ", 6) != 0)
+        idp--;
+    int64_t outro = strtoll(idp + 6, 0, 10);
+    free(json);
+    assert(q.isQueued(outro));
+
+    child.move(outro, 0);
+    q.update();
+    json = q.toJSON();
+    assert(strstr(json, "outro.gcode") < strstr(json, "intro.gcode"));
+    free(json);
+    child.cancel(outro);
+    q.update();
+    assert(q.size() == 1);
+    assert(!q.isQueued(outro));
+    child.sync();
+    q.sync();
+    assert(wheel.empty());
+
+    // the job that was printing when the journal was abandoned is not restarted
+    JobQueue restarted(wheel, 5);
+    assert(restarted.open(journal));
+    assert(restarted.printing() == 0);
+    assert(restarted.size() == 1);
+    JobQueue::Job* job = restarted.start();
+    assert(job != 0 && strcmp(job->path, "test/intro.gcode") == 0);
+    restarted.finish(false, 123);
+    assert(restarted.empty());
+    restarted.sync();
+
+    // compaction leaves only the queued jobs
+    q.forget();
+    assert(q.open(journal));
+    assert(q.empty());
+    struct stat statbuf;
+    assert(stat(journal, &statbuf) == 0 && statbuf.st_size == 0);
+
+    unlink(journal);
+}
+
+void checkpoint_tests()
+{
+    ModalState state;
+    const char* program[] = {"M140 S60", "M104 S200", "G90",       "M82",       "G1 Z0.2 F3000", "G1 X10 E1.5",
+                             "G92 E0",   "G1 E2 F1500", "M109 R210", "G91",        "G1 Z0.5",      "M83",
+                             "G1 E-1",   "M190 S65",  "G10",       "G1X3 Y4 F900"};
+    for (unsigned i = 0; i < sizeof(program) / sizeof(program[0]); i++)
+    {
+        gcode::Line line(program[i]);
+        state.update(line);
+    }
+    assert(state.relative && state.relative_e);
+    assert(state.hotend == 210 && state.bed == 65);
+    assert(state.z > 0.69 && state.z < 0.71);
+    assert(state.e > 0.99 && state.e < 1.01);
+    assert(state.feedrate == 1500); // "G1X3" is not a G1 without the space
+
+    char* gcode = Checkpoint::resumeGCode(state);
+    assert(strstr(gcode, "M190 S65\n") < strstr(gcode, "M109 S210\n"));
+    assert(strstr(gcode, "G28 X Y\n") < strstr(gcode, "G0 Z0.7\n"));
+    assert(strstr(gcode, "G91\nM83\nG1 F1500\n") != 0);
+    assert(gcode[strlen(gcode) - 1] == '\n');
+    free(gcode);
+
+    const char* path = "test/checkpoint.tmp";
+    unlink(path);
+    {
+        Checkpoint cp;
+        assert(!cp.interrupted());
+        assert(cp.open(path));
+        assert(!cp.interrupted());
+        cp.begin("test/cube.gcode", 42);
+        assert(cp.interrupted());
+        assert(cp.last().offset == 0);
+        Checkpoint::Record r;
+        r.offset = 1234;
+        r.state = state;
+        cp.save(r);
+        r.offset = 2345;
+        cp.save(r);
+        cp.flush();
+    } // as if marlinfeed died
+
+    {
+        Checkpoint cp;
+        assert(cp.open(path));
+        assert(cp.interrupted());
+        assert(strcmp(cp.path(), "test/cube.gcode") == 0);
+        assert(cp.mtime() == 42);
+        assert(cp.last().offset == 2345);
+        assert(cp.last().state.hotend == 210);
+        cp.finish();
+        assert(!cp.interrupted());
+    }
+
+    {
+        Checkpoint cp;
+        assert(cp.open(path));
+        assert(!cp.interrupted());
+    }
+
+    // garbage is ignored
+    File f(path);
+    f.open(O_WRONLY | O_TRUNC);
+    f.writeAll("garbage", 7);
+    f.close();
+    {
+        Checkpoint cp;
+        assert(cp.open(path));
+        assert(!cp.interrupted());
+    }
+    unlink(path);
+}
+
+void multipart_tests()
+{
+    // A file part bigger than the parser's buffer with data that resembles the
+    // delimiter, followed by a form field.
+    int datalen = 200000;
+    char* data = (char*)malloc(datalen);
+    for (int i = 0; i < datalen; i++)
+        data[i] = (i % 1000 == 999) ? '\n' : 'A' + i % 26;
+    memcpy(data + 5000, "\r\n--XyZ", 8);
+    memcpy(data + datalen - 7, "\r\n--Xy", 7);
+
+    const char* path = "test/multipart.tmp";
+    const char* outpath = "test/multipart.out";
+    File f(path);
+    assert(f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    const char* head = "preamble\r\n--XyZZy\r\n"
+                       "Content-Disposition: form-data; name=\"file\"; filename=\"a.gcode\"\r\n"
+                       "Content-Type: application/octet-stream\r\n\r\n";
+    const char* tail = "\r\n--XyZZy  \r\nContent-Disposition: form-data; name=\"print\"\r\n\r\ntrue"
+                       "\r\n--XyZZy--\r\nepilogue";
+    assert(f.writeAll(head, strlen(head)));
+    assert(f.writeAll(data, datalen));
+    assert(f.writeAll(tail, strlen(tail)));
+    assert(f.close());
+    int64_t total = strlen(head) + datalen + strlen(tail);
+
+    File in(path);
+    assert(in.open(O_RDONLY));
+    char prefix[10];
+    assert(10 == in.read(prefix, 10));
+    {
+        Multipart mp(in, total, prefix, 10);
+        char* headers = mp.nextPart();
+        assert(headers != 0);
+        assert(strstr(headers, "filename=\"a.gcode\"\r\n") != 0);
+        assert(strstr(headers, "Content-Type: application/octet-stream\r\n") != 0);
+        free(headers);
+        File out(outpath);
+        assert(out.open(O_RDWR | O_CREAT | O_TRUNC, 0644)); // spliced
+        assert(datalen == mp.body(&out));
+        assert(out.close());
+
+        headers = mp.nextPart();
+        assert(headers != 0 && strstr(headers, "name=\"print\"") != 0);
+        free(headers);
+        assert(4 == mp.body(0));
+        assert(mp.nextPart() == 0);
+        assert(mp.nextPart() == 0);
+    }
+    assert(in.close());
+
+    File out(outpath);
+    assert(out.open(O_RDONLY));
+    char* copy = (char*)malloc(datalen + 1);
+    assert(datalen == out.read(copy, datalen + 1));
+    assert(0 == memcmp(copy, data, datalen));
+    assert(out.close());
+
+    // unread parts are skipped
+    assert(in.open(O_RDONLY));
+    {
+        Multipart mp(in, total);
+        free(mp.nextPart());
+        char* headers = mp.nextPart();
+        assert(headers != 0 && strstr(headers, "name=\"print\"") != 0);
+        free(headers);
+        assert(mp.nextPart() == 0);
+    }
+    assert(in.close());
+
+    // premature end within the file part
+    assert(in.open(O_RDONLY));
+    {
+        Multipart mp(in, strlen(head) + 1000);
+        free(mp.nextPart());
+        assert(-1 == mp.body(0));
+    }
+    assert(in.close());
+
+    // Two big parts. The delimiter between them ends up in the middle of
+    // spliced data and everything after it has to be put back.
+    assert(f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    assert(f.writeAll(head, strlen(head)));
+    for (int i = 0; i < 30; i++)
+        assert(f.writeAll(data, datalen));
+    assert(f.writeAll(tail, strlen(tail) - 21)); // up to "true"
+    for (int i = 0; i < 20; i++)
+        assert(f.writeAll(data, datalen));
+    assert(f.writeAll("\r\n--XyZZy--\r\n", 13));
+    assert(f.close());
+
+    assert(in.open(O_RDONLY));
+    {
+        Multipart mp(in, -1);
+        free(mp.nextPart());
+        assert(out.open(O_RDWR | O_CREAT | O_TRUNC, 0644));
+        assert(30 * datalen == mp.body(&out));
+        struct stat statbuf;
+        assert(out.stat(&statbuf) && statbuf.st_size == 30 * datalen);
+        assert(out.close());
+
+        char* headers = mp.nextPart();
+        assert(headers != 0 && strstr(headers, "name=\"print\"") != 0);
+        free(headers);
+        assert(out.open(O_RDWR | O_CREAT | O_TRUNC, 0644));
+        assert(20 * datalen + 4 == mp.body(&out));
+        assert(out.close());
+        assert(mp.nextPart() == 0);
+    }
+    assert(in.close());
+
+    assert(out.open(O_RDONLY));
+    assert(4 == out.read(copy, 4) && 0 == memcmp(copy, "true", 4));
+    for (int i = 0; i < 20; i++)
+    {
+        assert(datalen == out.read(copy, datalen));
+        assert(0 == memcmp(copy, data, datalen));
+    }
+    assert(0 == out.read(copy, 1));
+    assert(out.close());
+
+    free(copy);
+    free(data);
+    unlink(path);
+    unlink(outpath);
+}
+
+void compression_tests()
+{
+    assert(Codec::fromName("a.gcode") == Codec::NONE);
+    assert(Codec::fromName("a.gcode.gz") == Codec::GZIP);
+    assert(Codec::fromName("a.gcode.zst") == Codec::ZSTD);
+    assert(Codec::fromEncoding(" gzip\r\n") == Codec::GZIP);
+    assert(Codec::fromEncoding("X-GZIP") == Codec::GZIP);
+    assert(Codec::fromEncoding("zstd") == Codec::ZSTD);
+    assert(Codec::fromEncoding("identity") == Codec::NONE);
+    assert(Codec::isGCodeName("a.gcode"));
+    assert(Codec::isGCodeName("a.gcode.gz"));
+    assert(Codec::isGCodeName("a.gcode.zst"));
+    assert(!Codec::isGCodeName("a.gz"));
+    assert(!Codec::isGCodeName("a.stl"));
+    assert(!Codec::isGCodeName(".gz"));
+
+    const char* path = "test/unit-test.gcode";
+    const char* gzpath = "test/unit-test.gcode.gz";
+    File orig(path);
+    assert(orig.open(O_RDONLY));
+    char* data = (char*)malloc(65536);
+    int datalen = orig.read(data, 65536);
+    assert(datalen > 0);
+    assert(lseek(orig.fileDescriptor(), 0, SEEK_SET) == 0);
+
+    File gz(gzpath);
+    assert(gz.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    pid_t pid = Codec::spawn(Codec::GZIP, false, orig.fileDescriptor(), gz.fileDescriptor());
+    assert(pid > 0);
+    assert(waitpid(pid, 0, 0) == pid);
+    assert(gz.close());
+    assert(orig.close());
+
+    char* buf = (char*)malloc(65536);
+    assert(gz.open(O_RDONLY));
+    assert(Codec::uncompressedSize(gz, Codec::GZIP) == datalen);
+    assert(Codec::decompress(gz, Codec::GZIP));
+    int len = 0;
+    for (int n; 0 < (n = gz.read(buf + len, 65536 - len, 100, 10000, 10000));)
+        len += n;
+    assert(len == datalen && memcmp(buf, data, len) == 0);
+    assert(gz.close());
+
+    // compressed stream with the first bytes already consumed
+    assert(gz.open(O_RDONLY));
+    char prefix[10];
+    assert(10 == gz.read(prefix, 10));
+    struct stat statbuf;
+    assert(gz.stat(&statbuf));
+    int fd = Codec::decodeStream(Codec::GZIP, gz, statbuf.st_size, prefix, 10);
+    assert(fd >= 0);
+    File decoded("decoded", fd);
+    len = 0;
+    for (int n; 0 < (n = decoded.read(buf + len, 65536 - len, 100, 10000, 10000));)
+        len += n;
+    assert(len == datalen && memcmp(buf, data, len) == 0);
+    assert(decoded.close());
+    assert(gz.close());
+    unlink(gzpath);
+
+    // zstd frame header with single segment and 1 byte Frame_Content_Size
+    const char* zstpath = "test/unit-test.gcode.zst";
+    unsigned char zst[18] = {0x28, 0xb5, 0x2f, 0xfd, 0x20, 42};
+    File z(zstpath);
+    assert(z.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    assert(z.writeAll(zst, sizeof(zst)));
+    assert(z.close());
+    assert(z.open(O_RDONLY));
+    assert(Codec::uncompressedSize(z, Codec::ZSTD) == 42);
+    assert(z.close());
+    zst[4] = 0x40; // 2 bytes, +256, window descriptor present
+    zst[6] = 1;
+    zst[7] = 1;
+    assert(z.open(O_WRONLY | O_TRUNC));
+    assert(z.writeAll(zst, sizeof(zst)));
+    assert(z.close());
+    assert(z.open(O_RDONLY));
+    assert(Codec::uncompressedSize(z, Codec::ZSTD) == 256 + 257);
+    assert(z.close());
+    unlink(zstpath);
+
+    free(buf);
+    free(data);
+}
+
+void analysis_tests()
+{
+    const char* gcode = ";TIME:1234\n"
+                        "M104 S200 ; hot\n"
+                        "G28\n"
+                        "G90\n"
+                        "M82\n"
+                        "G1 Z0.2 F1200\n"
+                        "\n"
+                        "G1   X10  Y10 E1 ; first extrusion\r\n"
+                        "G1 X20 Y10 E2\n"
+                        "G1 E1 ; retract\n"
+                        "G1 Z0.4\n"
+                        "G1 E2\n"
+                        "G1 X20 Y30 E3\n"
+                        "G91\n"
+                        "G1 X-5 E0.5\n"
+                        "G7 X1\n"
+                        "FOO\n"
+                        "M1234\n"
+                        "M1234\n"
+                        "M117 G1 X1000 E1000";
+
+    MarlinBuf marlinbuf;
+    for (int chunk = 1; chunk < 8; chunk++)
+    {
+        GCodeAnalysis a(marlinbuf.maxCommandLen());
+        for (int i = 0; i < (int)strlen(gcode); i += chunk)
+            a.feed(gcode + i, (i + chunk < (int)strlen(gcode)) ? chunk : strlen(gcode) - i);
+        a.finish();
+        assert(a.lines == 20);
+        assert(a.commands == 18);
+        assert(a.slicerTime == 1234);
+        assert(a.layers == 2);
+        assert(a.extrusions == 4);
+        assert(a.minX == 0 && a.maxX == 20);
+        assert(a.minY == 0 && a.maxY == 30);
+        assert(a.minZ > 0.19 && a.maxZ < 0.41);
+        assert(a.filament > 3.49 && a.filament < 3.51);
+        assert(a.estimatedTime > 0);
+        assert(a.maxLineLength == (int)strlen("M117 G1 X1000 E1000"));
+        assert(a.longLines == 0);
+        assert(a.unknownCount == 4);
+        assert(strcmp(a.unknownCommands[0], "G7") == 0);
+        assert(strcmp(a.unknownCommands[1], "FOO") == 0);
+        assert(strcmp(a.unknownCommands[2], "M1234") == 0);
+        assert(a.unknownCommands[3] == 0);
+        char* json = a.toJSON();
+        assert(strstr(json, "\"estimatedPrintTime\": 1234,") != 0);
+        assert(strstr(json, "\"firstUnknownCommands\": [\"G7\", \"FOO\", \"M1234\"]") != 0);
+        free(json);
+    }
+
+    // a command that can never fit into the printer's buffer
+    char longline[300];
+    memset(longline, 'X', sizeof(longline));
+    memcpy(longline, "M117 ", 5);
+    longline[sizeof(longline) - 1] = '\n';
+    GCodeAnalysis a(marlinbuf.maxCommandLen());
+    a.feed(longline, sizeof(longline));
+    a.feed(longline, marlinbuf.maxCommandLen());
+    a.feed("\n", 1);
+    assert(a.maxLineLength == sizeof(longline) - 1);
+    assert(a.longLines == 1);
+    assert(marlinbuf.maxCommandLen() < 128 && marlinbuf.maxCommandLen() > 64);
+}
+
+void fileindex_tests()
+{
+    const char* dir = "test/fileindex.tmp";
+    const char* names[] = {"b.gcode", "a.gcode.gz", "c.stl", ".hidden.gcode", "a.gcode.analysis", ".b.gcode.analysis"};
+    mkdir(dir, 0755);
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char* path;
+        assert(0 < asprintf(&path, "%s/%s", dir, names[i]));
+        File f(path);
+        assert(f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (i == 5)
+            assert(f.writeAll("{\"estimatedPrintTime\": 42}", 26));
+        else
+            assert(f.writeAll(names[i], i + 1));
+        assert(f.close());
+        free(path);
+    }
+
+    FileIndex index;
+    assert(index.find("b.gcode") == 0);
+    index.open(dir, "http://x");
+    assert(index.size() == 2);
+    assert(index.find("c.stl") == 0);
+    assert(index.find(".hidden.gcode") == 0);
+    const FileIndex::Entry* b = index.find("b.gcode");
+    assert(b != 0 && b->size == 1);
+    assert(strstr(b->json, "\"refs\": {\"resource\": \"http://x/api/files/local/b.gcode\"}") != 0);
+    assert(strstr(b->json, "\"gcodeAnalysis\": {\"estimatedPrintTime\": 42}") != 0);
+    const FileIndex::Entry* a = index.find("a.gcode.gz");
+    assert(a != 0 && a->size == 2 && a->analysis == 0);
+
+    const char* listing = index.listing();
+    assert(listing == index.listing()); // cached
+    assert(strstr(listing, "\"name\": \"a.gcode.gz\"") < strstr(listing, "\"name\": \"b.gcode\""));
+    assert(strstr(listing, "\"free\": ") != 0);
+
+    // Files that appear, change and disappear
+    File f("test/fileindex.tmp/d.gcode");
+    assert(f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    assert(f.writeAll("G28\n", 4));
+    assert(f.close());
+    unlink("test/fileindex.tmp/b.gcode");
+    index.refresh();
+    assert(index.size() == 2);
+    assert(index.find("b.gcode") == 0);
+    assert(index.find("d.gcode")->size == 4);
+    assert(strstr(index.listing(), "d.gcode") != 0);
+
+    assert(f.open(O_WRONLY | O_APPEND));
+    assert(f.writeAll("G28\n", 4));
+    assert(f.close());
+    index.update("test/fileindex.tmp/d.gcode");
+    assert(index.find("d.gcode")->size == 8);
+    index.update("test/fileindex.tmp/e.gcode"); // does not exist
+    assert(index.find("e.gcode") == 0);
+    index.update("test/e.gcode"); // not in dir
+    assert(index.size() == 2);
+
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char* path;
+        assert(0 < asprintf(&path, "%s/%s", dir, names[i]));
+        unlink(path);
+        free(path);
+    }
+    unlink("test/fileindex.tmp/d.gcode");
+    index.update("test/fileindex.tmp/d.gcode");
+    assert(index.size() == 1);
+    assert(0 == rmdir(dir));
+}
+
+bool retention_test_in_use(const char* path) { return strcmp(path, "test/retention.tmp/c.gcode") == 0; }
+
+void retention_tests()
+{
+    const char* dir = "test/retention.tmp";
+    // in order of increasing mtime
+    const char* names[] = {"c.gcode", "a.gcode.gz", "b.gcode", "d.gcode", "e.stl"};
+    mkdir(dir, 0755);
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char* path;
+        assert(0 < asprintf(&path, "%s/%s", dir, names[i]));
+        File f(path);
+        assert(f.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        assert(f.writeAll("G28 X Y Z\n", 10));
+        assert(f.close());
+        struct utimbuf t = {1000000 + (time_t)i, 1000000 + (time_t)i};
+        assert(0 == utime(path, &t));
+        free(path);
+    }
+    File sidecar("test/retention.tmp/.a.gcode.gz.analysis");
+    assert(sidecar.open(O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    assert(sidecar.close());
+
+    TimerWheel wheel(millis());
+    Retention retention(wheel, 1);
+    assert(retention.enforce() == 0); // not open()ed
+
+    retention.open(dir, 0, 4, retention_test_in_use);
+    assert(retention.enforce() == 0); // .stl and sidecar don't count
+    assert(retention.enforce() == 0);
+
+    // The oldest file is in use, so the next one goes, with its analysis.
+    retention.open(dir, 0, 3, retention_test_in_use);
+    assert(retention.enforce() == 1);
+    assert(access("test/retention.tmp/c.gcode", F_OK) == 0);
+    assert(access("test/retention.tmp/a.gcode.gz", F_OK) != 0);
+    assert(access("test/retention.tmp/.a.gcode.gz.analysis", F_OK) != 0);
+    assert(access("test/retention.tmp/e.stl", F_OK) == 0);
+
+    // Printing b.gcode makes d.gcode the least recently used file.
+    retention.touch("test/retention.tmp/b.gcode");
+    retention.touch("test/b.gcode"); // not in dir
+    retention.open(dir, 25, 0, retention_test_in_use); // 25 bytes: only 2 files fit
+    assert(retention.enforce() == 1);
+    assert(access("test/retention.tmp/d.gcode", F_OK) != 0);
+    assert(access("test/retention.tmp/b.gcode", F_OK) == 0);
+    assert(access("test/retention.tmp/c.gcode", F_OK) == 0);
+
+    // The timer fires right after open().
+    TimerWheel::Timer* t = wheel.expire(millis());
+    assert(t != 0 && retention.fire(t));
+    TimerWheel::Timer other(2);
+    assert(!retention.fire(&other));
+
+    retention.open(dir, 0, 0, retention_test_in_use); // unlimited
+    assert(retention.enforce() == 0);
+
+    unlink("test/retention.tmp/b.gcode");
+    unlink("test/retention.tmp/c.gcode");
+    unlink("test/retention.tmp/e.stl");
+    assert(0 == rmdir(dir));
+}
+
+void meatpack_tests()
+{
+    char packed[64];
+    char decoded[128];
+    assert(MeatPack::pack("G1 X10\n", 7, packed) == 4);
+    assert(memcmp(packed, "\x1D\xEB\x01\xCC", 4) == 0);
+    assert(MeatPack::pack("M104 S200\n", 10, packed) == 7);
+    assert(memcmp(packed, "\x1FM\x40\xFBS\x02\xC0", 7) == 0);
+    assert(MeatPack::pack("M104 S200\n", 10) == 7);
+    assert(MeatPack::pack("MM\n", 3, packed) == 4); // both characters as full bytes
+    assert(memcmp(packed, "\xFFMM\xCC", 4) == 0);
+
+    MeatPack::Decoder decoder;
+    assert(decoder.report() == 0);
+    assert(decoder.decode("G1\n", 3, decoded) == 3); // passed through while packing is off
+    assert(memcmp(decoded, "G1\n", 3) == 0);
+    MeatPack::command(MeatPack::ENABLE_PACKING, packed);
+    assert(decoder.decode(packed, 3, decoded) == 0);
+    assert(decoder.isActive());
+    assert(strcmp(decoder.report(), "[MP] PV01 ON ESP\n") == 0);
+    assert(decoder.report() == 0);
+
+    // Several lines, odd and even lengths, fed in pieces
+    const char* text = "N1G1 X1.5 Y-2*33\nMM\nN2M117 Hello\nN3G28*19\n";
+    int len = MeatPack::pack(text, strlen(text), packed);
+    assert(len < (int)strlen(text) && len <= MeatPack::maxPackedLength(strlen(text)));
+    int n = 0;
+    for (int i = 0; i < len; i += 3)
+        n += decoder.decode(packed + i, (len - i < 3) ? len - i : 3, decoded + n);
+    assert(n == (int)strlen(text) && memcmp(decoded, text, n) == 0);
+
+    // An emergency command goes over the wire as plain text at the start of a line
+    n = MeatPack::plain("M112\n", 5, packed);
+    assert(n == 5 + MeatPack::PLAIN_OVERHEAD);
+    assert(memmem(packed, n, "\nM112\n", 6) != 0);
+    assert(decoder.decode(packed, n, decoded) == 6 && memcmp(decoded, "\nM112\n", 6) == 0);
+    assert(decoder.isActive());
+    assert(strcmp(decoder.report(), "[MP] PV01 ON ESP\n") == 0);
+
+    MeatPack::command(MeatPack::ENABLE_NO_SPACES, packed);
+    assert(decoder.decode(packed, 3, decoded) == 0);
+    assert(strcmp(decoder.report(), "[MP] PV01 ON NSP\n") == 0);
+    assert(decoder.decode("\xBD\xC1", 2, decoded) == 4); // 0xB is 'E' without spaces
+    assert(memcmp(decoded, "GE1\n", 4) == 0);
+    MeatPack::command(MeatPack::RESET_ALL, packed);
+    assert(decoder.decode(packed, 3, decoded) == 0);
+    assert(!decoder.isActive());
+    assert(strcmp(decoder.report(), "[MP] PV01 OFF ESP\n") == 0);
+
+    // MarlinBuf counts packed bytes against the buffer
+    MarlinBuf raw;
+    MarlinBuf mp;
+    raw.setBufSize(16);
+    mp.setBufSize(16);
+    mp.setPacking(true);
+    assert(!raw.fits("G1 X10.5 Y20.5"));
+    assert(mp.fits("G1 X10.5 Y20.5"));
+    assert(mp.fits("; just a comment"));
+    mp.append("G1 X10.5 Y20.5");
+    assert(!mp.fits("G1 X10.5 Y20.5"));
+    int l;
+    const char* line = mp.next(&l);
+    assert(strncmp(line, "N0G1 X10.5 Y20.5*", 17) == 0 && line[l - 1] == '\n'); // next() is not packed
+    assert(mp.ack());
+    assert(mp.fits("G1 X10.5 Y20.5"));
+    int free_before = mp.maxAppendLen();
+    assert(mp.outOfBand(5)); // M108 sent as MeatPack::plain()
+    assert(mp.maxAppendLen() == free_before - 5 - MeatPack::PLAIN_OVERHEAD);
+    assert(mp.ack());
+    assert(mp.maxAppendLen() == free_before);
+}
+
+
+void binproto_tests()
+{
+    char pkt[BinaryProtocol::MAX_PACKET];
+    BinaryProtocol::Receiver rx;
+
+    // SYNC is answered regardless of the packet's sync number
+    int len = BinaryProtocol::packet(7, BinaryProtocol::CONTROL, BinaryProtocol::SYNC, 0, 0, pkt);
+    assert(len == BinaryProtocol::HEADER_SIZE);
+    assert((uint8_t)pkt[0] == 0xAD && (uint8_t)pkt[1] == 0xB5);
+    assert(rx.receive(pkt, len) == len);
+    assert(strcmp(rx.reply(), "ss0,512,0.1.0\n") == 0 && !rx.hasPacket());
+
+    // A packet with payload, preceded by garbage and fed byte by byte
+    const char* name = "\0\1TEST.GCO";
+    char data[64] = "xy";
+    len = BinaryProtocol::packet(0, BinaryProtocol::FILE_TRANSFER, BinaryProtocol::OPEN, name, 10, data + 2);
+    assert(len == BinaryProtocol::HEADER_SIZE + 10 + BinaryProtocol::FOOTER_SIZE);
+    len += 2;
+    for (int i = 0; i < len - 1; i++)
+    {
+        assert(rx.receive(data + i, 1) == 1);
+        assert(rx.reply() == 0 && !rx.hasPacket());
+    }
+    assert(rx.receive(data + len - 1, 1) == 1);
+    assert(strcmp(rx.reply(), "ok0\n") == 0 && rx.hasPacket());
+    assert(rx.protocol() == BinaryProtocol::FILE_TRANSFER && rx.type() == BinaryProtocol::OPEN);
+    assert(rx.size() == 10 && memcmp(rx.payload(), name, 10) == 0);
+
+    // The same packet again (the ok got lost) is acknowledged but not processed again
+    assert(rx.receive(data + 2, len - 2) == len - 2);
+    assert(strcmp(rx.reply(), "ok0\n") == 0 && !rx.hasPacket());
+
+    // A corrupted payload and a wrong sync number both ask for the expected packet
+    len = BinaryProtocol::packet(1, BinaryProtocol::FILE_TRANSFER, BinaryProtocol::WRITE, "abc", 3, pkt);
+    pkt[BinaryProtocol::HEADER_SIZE + 1] ^= 1;
+    assert(rx.receive(pkt, len) == len);
+    assert(strcmp(rx.reply(), "rs1\n") == 0 && !rx.hasPacket());
+    len = BinaryProtocol::packet(5, BinaryProtocol::FILE_TRANSFER, BinaryProtocol::WRITE, "abc", 3, pkt);
+    assert(rx.receive(pkt, len) == len);
+    assert(strcmp(rx.reply(), "rs1\n") == 0 && !rx.hasPacket());
+    len = BinaryProtocol::packet(1, BinaryProtocol::FILE_TRANSFER, BinaryProtocol::WRITE, "abc", 3, pkt);
+    assert(rx.receive(pkt, len) == len);
+    assert(strcmp(rx.reply(), "ok1\n") == 0 && rx.hasPacket() && rx.size() == 3);
+
+    // Heatshrink round trip, compressed and decompressed in pieces of odd sizes
+    int size = 20000;
+    char* text = (char*)malloc(size);
+    for (int i = 0; i < size; i++)
+        text[i] = (i % 7 == 0) ? '\n' : "G1 X10.5 Y"[i % 11] + (i / 500) % 3;
+    char* packed = (char*)malloc(Heatshrink::Encoder::maxOutput(size));
+    char* unpacked = (char*)malloc(size + Heatshrink::Decoder::maxOutput(1000));
+    Heatshrink::Encoder enc;
+    int n = 0;
+    for (int i = 0; i < size; i += 997)
+        n += enc.encode(text + i, (size - i < 997) ? size - i : 997, packed + n, i + 997 >= size);
+    assert(n < size / 2);
+    Heatshrink::Decoder dec;
+    int m = 0;
+    for (int i = 0; i < n; i += 13)
+        m += dec.decode(packed + i, (n - i < 13) ? n - i : 13, unpacked + m);
+    assert(m == size && memcmp(text, unpacked, size) == 0);
+    free(text);
+    free(packed);
+    free(unpacked);
+}
+
+void profile_tests()
+{
+    char* key = PrinterProfile::key("test/no such printer");
+    assert(strcmp(key, "test_no_such_printer") == 0);
+
+    const char* dir = "test/profiles";
+    char* path;
+    assert(0 <= asprintf(&path, "%s/%s", dir, key));
+    free(key);
+    unlink(path);
+
+    PrinterProfile profile;
+    assert(profile.open(dir, "test/no such printer"));
+    assert(profile.capability(PrinterProfile::ADVANCED_OK) == 0 && profile.bufSize() == 0);
+
+    // Firmware without M115 leaves the profile alone
+    assert(!profile.update("echo:Unknown command: \"M115\"\nok\n"));
+    assert(profile.capability(PrinterProfile::AUTOREPORT_TEMP) == 0);
+
+    const char* reply = "FIRMWARE_NAME:Marlin 2.0.6 SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin "
+                        "PROTOCOL_VERSION:1.0\n"
+                        "Cap:EEPROM:0\n"
+                        "Cap:AUTOREPORT_TEMP:1\n"
+                        "Cap:EMERGENCY_PARSER:0\n"
+                        "Cap:ADVANCED_OK:1\n"
+                        "ok\n";
+    assert(profile.update(reply));
+    assert(!profile.update(reply));
+    assert(strcmp(profile.firmware(), "Marlin 2.0.6") == 0);
+    assert(profile.capability(PrinterProfile::AUTOREPORT_TEMP) == 1);
+    assert(profile.capability(PrinterProfile::ADVANCED_OK) == 1);
+    assert(profile.capability(PrinterProfile::EMERGENCY_PARSER) == -1);
+    assert(profile.capability(PrinterProfile::BINARY_FILE_TRANSFER) == -1); // not mentioned
+    assert(profile.setBufSize(512) && !profile.setBufSize(512));
+    assert(profile.setBaud(250000) && profile.baud() == 250000);
+    assert(profile.save());
+
+    PrinterProfile loaded;
+    assert(loaded.open(dir, "test/no such printer"));
+    assert(strcmp(loaded.firmware(), "Marlin 2.0.6") == 0 && loaded.bufSize() == 512);
+    assert(loaded.baud() == 250000);
+    for (int i = 0; i < PrinterProfile::CAPABILITIES; i++)
+        assert(loaded.capability((PrinterProfile::Capability)i) == profile.capability((PrinterProfile::Capability)i));
+
+    // follow() switches only to a different printer's profile
+    PrinterProfile unopened;
+    assert(!unopened.follow("test/no such printer"));
+    assert(!loaded.follow("test/no such printer") && loaded.bufSize() == 512);
+    assert(loaded.follow("test/other printer") && loaded.bufSize() == 0 && loaded.baud() == 0);
+    assert(strcmp(loaded.firmware(), "") == 0);
+    assert(loaded.follow("test/no such printer") && loaded.bufSize() == 512 && loaded.baud() == 250000);
+
+    unlink(path);
+    free(path);
+    rmdir(dir);
+}
+
+void devfinder_tests()
+{
+    DeviceFinder fixed;
+    fixed.open("test/printer.sock");
+    assert(!fixed.isSearch());
+    assert(strcmp(fixed.resolve(), "test/printer.sock") == 0);
+
+    // Breadth first search finds the shallowest TTY
+    const char* dirs[] = {"test/sys", "test/sys/a", "test/sys/a/b", "test/sys/a/b/ttyUSB0", "test/sys/c",
+                          "test/sys/c/ttyACM3"};
+    const int ndirs = sizeof(dirs) / sizeof(dirs[0]);
+    for (int i = 0; i < ndirs; i++)
+        assert(mkdir(dirs[i], 0755) == 0);
+    DeviceFinder finder;
+    finder.open("test/sys");
+    assert(finder.isSearch());
+    assert(strcmp(finder.resolve(), "/dev/ttyACM3") == 0);
+
+    // The printer reappears under a different name
+    assert(rmdir("test/sys/c/ttyACM3") == 0);
+    assert(strcmp(finder.resolve(), "/dev/ttyUSB0") == 0);
+
+    // The printer is gone => the last known device is returned
+    assert(rename("test/sys/a/b/ttyUSB0", "test/sys/a/b/gone") == 0);
+    dirs[3] = "test/sys/a/b/gone";
+    assert(strcmp(finder.resolve(), "/dev/ttyUSB0") == 0);
+
+    int64_t start = millis();
+    assert(!finder.wait(50));
+    assert(millis() - start >= 50);
+
+    for (int i = ndirs - 2; i >= 0; i--) // ttyACM3 is already gone
+        assert(rmdir(dirs[i]) == 0);
+}